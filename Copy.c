@@ -0,0 +1,185 @@
+/*
+ * mdadm - manage Linux "md" devices aka RAID arrays.
+ *
+ * Copyright (C) 2010 Neil Brown <neilb@suse.de>
+ *
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *    Author: Neil Brown
+ *    Email: <neilb@suse.de>
+ */
+
+/*
+ * Copy the whole of an array to a file or device, with several large
+ * reads and writes in flight at once so the members and the target are
+ * all kept busy.  The target gets the array's data at the same offsets.
+ *
+ * This is a plain full copy each time.  The write-intent bitmap cannot
+ * say what changed since an earlier copy: md clears bits once writes
+ * are on every device, so they only describe writes that are not yet
+ * safe.  The copy is only consistent if the array is not written to
+ * while it runs.
+ */
+
+#include	"mdadm.h"
+#include	<sys/time.h>
+
+/* largest single copy, and how many are in flight */
+#define COPY_IO (4*1024*1024)
+#define COPY_DEPTH 8
+
+struct copy_job {
+	int afd, tfd;
+	char *buf;
+	unsigned long long off, len;
+};
+
+static int copy_one(struct io_req *r)
+{
+	struct copy_job *j = r->data;
+	unsigned long long done = 0;
+	ssize_t n;
+
+	while (done < j->len) {
+		n = pread(j->afd, j->buf + done, j->len - done, j->off + done);
+		if (n <= 0)
+			return -1;
+		done += n;
+	}
+	for (done = 0; done < j->len; done += n) {
+		n = pwrite(j->tfd, j->buf + done, j->len - done, j->off + done);
+		if (n <= 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int copy_all(int afd, int tfd, unsigned long long size)
+{
+	/* Copy 'size' bytes, COPY_IO at a time with up to COPY_DEPTH
+	 * copies running at once.
+	 */
+	struct io_pool *pool = io_pool_create(COPY_DEPTH);
+	struct copy_job jobs[COPY_DEPTH];
+	struct io_req reqs[COPY_DEPTH];
+	unsigned long long pos = 0;
+	int i, n, rv = 0;
+
+	memset(jobs, 0, sizeof(jobs));
+	for (i = 0; i < COPY_DEPTH; i++)
+		if (posix_memalign((void**)&jobs[i].buf, 4096, COPY_IO)) {
+			rv = -1;
+			goto out;
+		}
+	while (pos < size && rv == 0) {
+		for (n = 0; n < COPY_DEPTH && pos < size; n++) {
+			struct copy_job *j = &jobs[n];
+
+			j->afd = afd;
+			j->tfd = tfd;
+			j->off = pos;
+			j->len = size - pos;
+			if (j->len > COPY_IO)
+				j->len = COPY_IO;
+			pos += j->len;
+
+			memset(&reqs[n], 0, sizeof(reqs[n]));
+			reqs[n].op = IO_CALL;
+			reqs[n].fn = copy_one;
+			reqs[n].data = j;
+			io_pool_submit(pool, &reqs[n]);
+		}
+		io_pool_wait_reqs(pool, reqs, n);
+		for (i = 0; i < n; i++)
+			if (reqs[i].rv < 0) {
+				fprintf(stderr, Name ": copy failed at byte %llu: %s\n",
+					jobs[i].off, strerror(reqs[i].err));
+				rv = -1;
+				break;
+			}
+	}
+out:
+	io_pool_destroy(pool);
+	for (i = 0; i < COPY_DEPTH; i++)
+		free(jobs[i].buf);
+	return rv;
+}
+
+int Copy(char *devname, char *target, int verbose)
+{
+	int afd, tfd = -1;
+	unsigned long long size, tsize;
+	unsigned long long t0, usec;
+	struct stat stb;
+	int rv = 1;
+
+	afd = open_mddev(devname, 1);
+	if (afd < 0)
+		return 1;
+	if (!get_dev_size(afd, devname, &size))
+		goto out;
+	/* the reads are large; don't fill the page cache with them */
+	close(afd);
+	afd = open(devname, O_RDONLY|O_DIRECT);
+	if (afd < 0) {
+		fprintf(stderr, Name ": %s: cannot open: %s\n", devname,
+			strerror(errno));
+		goto out;
+	}
+	tfd = open(target, O_WRONLY|O_CREAT, S_IRUSR|S_IWUSR);
+	if (tfd < 0) {
+		fprintf(stderr, Name ": cannot open %s: %s\n", target,
+			strerror(errno));
+		goto out;
+	}
+	if (fstat(tfd, &stb) != 0)
+		goto out;
+	if ((S_IFMT & stb.st_mode) == S_IFBLK) {
+		if (!get_dev_size(tfd, target, &tsize))
+			goto out;
+		if (tsize < size) {
+			fprintf(stderr, Name ": %s is smaller than %s\n",
+				target, devname);
+			goto out;
+		}
+	} else if ((unsigned long long)stb.st_size != size &&
+		   ftruncate(tfd, size) != 0) {
+		fprintf(stderr, Name ": cannot size %s: %s\n", target,
+			strerror(errno));
+		goto out;
+	}
+
+	t0 = now_usec();
+	if (copy_all(afd, tfd, size) != 0 || fdatasync(tfd) != 0) {
+		fprintf(stderr, Name ": %s: copy to %s failed\n", devname,
+			target);
+		goto out;
+	}
+	usec = now_usec() - t0;
+	/* the image is no use in the page cache */
+	posix_fadvise(tfd, 0, 0, POSIX_FADV_DONTNEED);
+	rv = 0;
+	if (verbose >= 0)
+		printf("%s: copied %lluK to %s in %llu.%03llu seconds, "
+		       "%llu MB/s\n", devname, size/1024, target,
+		       usec/1000000, (usec/1000)%1000, size / (usec + 1));
+out:
+	if (afd >= 0)
+		close(afd);
+	if (tfd >= 0)
+		close(tfd);
+	return rv;
+}
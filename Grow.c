@@ -24,6 +24,7 @@
 #include	"mdadm.h"
 #include	"dlink.h"
 #include	<sys/mman.h>
+#include	<sys/time.h>
 
 #if ! defined(__BIG_ENDIAN) && ! defined(__LITTLE_ENDIAN)
 #error no endian defined
@@ -392,8 +393,13 @@ int Grow_addbitmap(char *devname, int fd, char *file, int chunk, int delay, int
  * It has the following structure.
  */
 
+/* most sections a backup may hold */
+#define BSB_SLOTS 8
+/* how much backup data is checked per read */
+#define BSB_VERIFY_IO (1024*1024)
+
 static struct mdp_backup_super {
-	char	magic[16];  /* md_backup_data-1 or -2 */
+	char	magic[16];  /* md_backup_data-1 to -4 */
 	__u8	set_uuid[16];
 	__u64	mtime;
 	/* start/sizes in 512byte sectors */
@@ -406,11 +412,29 @@ static struct mdp_backup_super {
 	__u64	arraystart2;
 	__u64	length2;
 	__u32	sb_csum2;	/* csum of preceeding bytes. */
-	__u8 pad[512-68-32];
+	/* md_backup_data-3: a ring of 'slots' sections, section N
+	 * starting at devstart + N*devstart2.  Sections 0 and 1 are
+	 * described above, the rest here.
+	 */
+	__u32	slots;
+	__u64	arraystart3[BSB_SLOTS-2];
+	__u64	length3[BSB_SLOTS-2];
+	__u32	sb_csum3;	/* csum of preceeding bytes. */
+	/* md_backup_data-4: as -3, with a CRC32C of the data in each
+	 * section as it was written, and of the superblock itself.
+	 */
+	__u32	data_crc[BSB_SLOTS];
+	__u32	sb_crc;		/* crc32c of preceeding bytes. */
+	__u8 pad[512-104-16*(BSB_SLOTS-2)-4-4*BSB_SLOTS-4];
 } __attribute__((aligned(512))) bsb, bsb2;
 
 __u32 bsb_csum(char *buf, int len)
 {
+	/* Only ever looks at buf[0], so this depends on nothing but
+	 * 'len' and the first byte of the magic.  Backups written in
+	 * formats 1 to 3 carry it, so it must stay as it is; format 4
+	 * relies on sb_crc instead.
+	 */
 	int i;
 	int csum = 0;
 	for (i=0; i<len; i++)
@@ -418,6 +442,149 @@ __u32 bsb_csum(char *buf, int len)
 	return __cpu_to_le32(csum);
 }
 
+static int bsb_nslots(struct mdp_backup_super *b)
+{
+	int n;
+
+	switch (b->magic[15]) {
+	case '1': return 1;
+	case '2': return 2;
+	}
+	n = __le32_to_cpu(b->slots);
+	if (n < (b->magic[15] == '3' ? 2 : 1))
+		n = b->magic[15] == '3' ? 2 : 1;
+	if (n > BSB_SLOTS)
+		n = BSB_SLOTS;
+	return n;
+}
+
+static unsigned long long bsb_start(struct mdp_backup_super *b, int slot)
+{
+	if (slot == 0)
+		return __le64_to_cpu(b->arraystart);
+	if (slot == 1)
+		return __le64_to_cpu(b->arraystart2);
+	return __le64_to_cpu(b->arraystart3[slot-2]);
+}
+
+static unsigned long long bsb_length(struct mdp_backup_super *b, int slot)
+{
+	if (slot == 0)
+		return __le64_to_cpu(b->length);
+	if (slot == 1)
+		return __le64_to_cpu(b->length2);
+	return __le64_to_cpu(b->length3[slot-2]);
+}
+
+static void bsb_set_slot(int slot, unsigned long long start,
+			 unsigned long long length)
+{
+	/* Record a section in 'bsb', moving to a newer format if
+	 * this slot needs it.  The data crc is set once it is known.
+	 */
+	bsb.data_crc[slot] = 0;
+	if (slot == 0) {
+		bsb.arraystart = __cpu_to_le64(start);
+		bsb.length = __cpu_to_le64(length);
+		return;
+	}
+	if (slot == 1) {
+		bsb.arraystart2 = __cpu_to_le64(start);
+		bsb.length2 = __cpu_to_le64(length);
+	} else {
+		bsb.arraystart3[slot-2] = __cpu_to_le64(start);
+		bsb.length3[slot-2] = __cpu_to_le64(length);
+	}
+	if (bsb.magic[15] < '2')
+		bsb.magic[15] = '2';
+	if (bsb.magic[15] < '3' &&
+	    (slot >= 2 || __le32_to_cpu(bsb.slots) > 2))
+		bsb.magic[15] = '3';
+}
+
+static void bsb_set_csums(void)
+{
+	bsb.sb_csum = bsb_csum((char*)&bsb, ((char*)&bsb.sb_csum)-((char*)&bsb));
+	if (bsb.magic[15] >= '2')
+		bsb.sb_csum2 = bsb_csum((char*)&bsb,
+					((char*)&bsb.sb_csum2)-((char*)&bsb));
+	if (bsb.magic[15] >= '3')
+		bsb.sb_csum3 = bsb_csum((char*)&bsb,
+					((char*)&bsb.sb_csum3)-((char*)&bsb));
+	if (bsb.magic[15] >= '4')
+		bsb.sb_crc = __cpu_to_le32(crc32c(0, &bsb,
+						  offsetof(struct mdp_backup_super, sb_crc)));
+}
+
+static char *bsb_bad(struct mdp_backup_super *b)
+{
+	/* Check the magic and checksums of a backup superblock.
+	 * Returns NULL if it is good, else what was wrong.
+	 */
+	if (memcmp(b->magic, "md_backup_data-", 15) != 0 ||
+	    b->magic[15] < '1' || b->magic[15] > '4')
+		return "magic";
+	if (b->sb_csum != bsb_csum((char*)b, ((char*)&b->sb_csum)-((char*)b)))
+		return "checksum";
+	if (b->magic[15] >= '2' &&
+	    b->sb_csum2 != bsb_csum((char*)b, ((char*)&b->sb_csum2)-((char*)b)))
+		return "checksum2";
+	if (b->magic[15] >= '3' &&
+	    b->sb_csum3 != bsb_csum((char*)b, ((char*)&b->sb_csum3)-((char*)b)))
+		return "checksum3";
+	if (b->magic[15] >= '4' &&
+	    __le32_to_cpu(b->sb_crc) !=
+	    crc32c(0, b, offsetof(struct mdp_backup_super, sb_crc)))
+		return "crc";
+	return NULL;
+}
+
+static int bsb_data_ok(struct mdp_backup_super *b, int fd,
+		       unsigned long long offset)
+{
+	/* Check the data in each section of a format 4 backup, which
+	 * starts at 'offset' on 'fd', against its crc.  Returns the
+	 * number of the first bad section, or -1 if all are good.
+	 */
+	unsigned long long pos, len, n;
+	char *buf;
+	int slot;
+	int rv = -1;
+
+	if (b->magic[15] < '4')
+		return -1;
+	if (posix_memalign((void**)&buf, 4096, BSB_VERIFY_IO))
+		return 0;
+	for (slot = 0; slot < bsb_nslots(b) && rv < 0; slot++) {
+		__u32 crc = 0;
+
+		len = bsb_length(b, slot) * 512;
+		pos = offset + slot * __le64_to_cpu(b->devstart2) * 512;
+		while (len) {
+			n = len < BSB_VERIFY_IO ? len : BSB_VERIFY_IO;
+			if (pread(fd, buf, n, pos) != (ssize_t)n)
+				break;
+			crc = crc32c(crc, buf, n);
+			pos += n;
+			len -= n;
+		}
+		if (len || crc != __le32_to_cpu(b->data_crc[slot]))
+			rv = slot;
+	}
+	free(buf);
+	return rv;
+}
+
+static int bsb_size(struct mdp_backup_super *b)
+{
+	/* how much of a superblock of this format is meaningful */
+	switch (b->magic[15]) {
+	case '1': return offsetof(struct mdp_backup_super, pad1);
+	case '2': return offsetof(struct mdp_backup_super, slots);
+	}
+	return offsetof(struct mdp_backup_super, pad);
+}
+
 static int child_grow(int afd, struct mdinfo *sra, unsigned long blocks,
 		      int *fds, unsigned long long *offsets,
 		      int disks, int chunk, int level, int layout, int data,
@@ -427,10 +594,15 @@ static int child_shrink(int afd, struct mdinfo *sra, unsigned long blocks,
 			int disks, int chunk, int level, int layout, int data,
 			int dests, int *destfd, unsigned long long *destoffsets);
 static int child_same_size(int afd, struct mdinfo *sra, unsigned long blocks,
+			   unsigned long minstripes,
 			   int *fds, unsigned long long *offsets,
 			   unsigned long long start,
 			   int disks, int chunk, int level, int layout, int data,
 			   int dests, int *destfd, unsigned long long *destoffsets);
+static void grow_stats_begin(char *backup_file);
+static void grow_stats_end(struct mdinfo *sra, int done);
+static unsigned long grow_verify_rate(void);
+static void grow_verify_begin(int afd);
 
 int freeze_array(struct mdinfo *sra)
 {
@@ -514,7 +686,7 @@ int Grow_reshape(char *devname, int fd, int quiet, char *backup_file,
 	int nrdisks;
 	int err;
 	int frozen;
-	unsigned long a,b, blocks, stripes;
+	unsigned long a,b, blocks, stripes, minstripes;
 	unsigned long cache;
 	unsigned long long array_size;
 	int changed = 0;
@@ -915,6 +1087,18 @@ int Grow_reshape(char *devname, int fd, int quiet, char *backup_file,
 			ndata--;
 		}
 
+		/* The backup is taken in the old layout and restored in
+		 * the new one, so both must be understood.
+		 */
+		if (!layout_supported(array.level, olayout, odisks) ||
+		    !layout_supported(array.level, nlayout, ndisks)) {
+			fprintf(stderr, Name ": %s: unsupported layout for "
+				"RAID%d, cannot back up the reshape\n",
+				devname, array.level);
+			rv = 1;
+			break;
+		}
+
 		if (odata == ndata &&
 		    get_linux_version() < 2006032) {
 			fprintf(stderr, Name ": in-place reshape is not safe before 2.6.32, sorry.\n");
@@ -948,6 +1132,8 @@ int Grow_reshape(char *devname, int fd, int quiet, char *backup_file,
 		}
 		/* LCM == product / GCD */
 		blocks = (ochunk/512) * (nchunk/512) * odata * ndata / a;
+		/* windows must stay a multiple of this many stripes */
+		minstripes = blocks / (ochunk/512) / odata;
 
 		sysfs_free(sra);
 		sra = sysfs_read(fd, 0,
@@ -1162,7 +1348,8 @@ int Grow_reshape(char *devname, int fd, int quiet, char *backup_file,
 		}
 
 		memset(&bsb, 0, 512);
-		memcpy(bsb.magic, "md_backup_data-1", 16);
+		memcpy(bsb.magic, "md_backup_data-4", 16);
+		bsb.slots = __cpu_to_le32(1);
 		st->ss->uuid_from_super(st, (int*)&bsb.set_uuid);
 		bsb.mtime = __cpu_to_le64(time(0));
 		bsb.devstart2 = blocks;
@@ -1178,7 +1365,13 @@ int Grow_reshape(char *devname, int fd, int quiet, char *backup_file,
 				fd = open(devname, O_RDONLY | O_DIRECT);
 			else
 				fd = -1;
+			/* Sampling gets its own descriptor: the children
+			 * run the full validate() whenever they get one.
+			 */
+			grow_verify_begin(grow_verify_rate() ?
+					  open(devname, O_RDONLY | O_DIRECT) : -1);
 			mlockall(MCL_FUTURE);
+			grow_stats_begin(backup_file);
 
 			if (odata < ndata)
 				done = child_grow(fd, sra, stripes,
@@ -1191,11 +1384,12 @@ int Grow_reshape(char *devname, int fd, int quiet, char *backup_file,
 						    odisks, ochunk, array.level, olayout, odata,
 						    d - odisks, fdlist+odisks, offsets+odisks);
 			else
-				done = child_same_size(fd, sra, stripes,
+				done = child_same_size(fd, sra, stripes, minstripes,
 						       fdlist, offsets,
 						       0,
 						       odisks, ochunk, array.level, olayout, odata,
 						       d - odisks, fdlist+odisks, offsets+odisks);
+			grow_stats_end(sra, done);
 			if (backup_file && done)
 				unlink(backup_file);
 			if (level != UnSet && level != array.level) {
@@ -1266,6 +1460,332 @@ int Grow_reshape(char *devname, int fd, int quiet, char *backup_file,
  */
 
 /* FIXME return status is never checked */
+static struct io_pool *backup_pool;
+static pid_t backup_pool_pid;
+
+/* keeps the reshape out of the way of applications, see throttle.c */
+static struct throttle *grow_throttle;
+/* default latency target for that, MDADM_SYNC_LATENCY overrides */
+#define GROW_SYNC_LATENCY_MS 20
+
+/* Where the reshape child spends its time, so that a slow reshape can
+ * be put down to the backup reads, writes, flushes, or to the kernel.
+ * All times are in microseconds.
+ */
+static struct grow_stats {
+	char *file;		/* JSON status file, or NULL */
+	unsigned long long start, written; /* when we began, last wrote 'file' */
+	unsigned long long windows;	/* sections backed up */
+	unsigned long long bytes;	/* array data backed up */
+	unsigned long long progress;	/* per-device sector backed up to */
+	unsigned long long suspend;	/* suspending and checking the array */
+	unsigned long long read, parity, write; /* in save_stripes */
+	unsigned long long sync;	/* writing and flushing the bsb */
+	unsigned long long wait;	/* waiting for sync_completed */
+	unsigned long long verify;	/* checking samples of the backup */
+	unsigned long long verified, mismatched; /* chunks sampled */
+	unsigned long long unread;	/* samples the array would not give */
+	unsigned long long win_bytes, win_usec; /* the latest window */
+} gstats;
+
+/* how often the status file is rewritten */
+#define GROW_STATS_INTERVAL 1000000ULL
+
+static void grow_stats_begin(char *backup_file)
+{
+	memset(&gstats, 0, sizeof(gstats));
+	gstats.start = now_usec();
+	if (backup_file) {
+		gstats.file = malloc(strlen(backup_file) + 6);
+		if (gstats.file)
+			sprintf(gstats.file, "%s.json", backup_file);
+	}
+}
+
+struct grow_stats_file {
+	struct mdinfo *sra;
+	char *state;
+};
+
+static void grow_stats_fill(FILE *f, void *arg)
+{
+	struct grow_stats_file *gs = arg;
+	unsigned long long elapsed = gstats.written - gstats.start;
+
+	fprintf(f, "{\n");
+	fprintf(f, "  \"array\": \"%s\",\n", gs->sra->sys_name);
+	fprintf(f, "  \"state\": \"%s\",\n", gs->state);
+	fprintf(f, "  \"time\": %ld,\n", (long)time(0));
+	fprintf(f, "  \"elapsed_usec\": %llu,\n", elapsed);
+	fprintf(f, "  \"windows\": %llu,\n", gstats.windows);
+	fprintf(f, "  \"bytes\": %llu,\n", gstats.bytes);
+	fprintf(f, "  \"progress_sectors\": %llu,\n", gstats.progress);
+	fprintf(f, "  \"MB_per_sec\": %llu,\n", gstats.bytes / (elapsed + 1));
+	fprintf(f, "  \"usec\": {\n");
+	fprintf(f, "    \"suspend\": %llu,\n", gstats.suspend);
+	fprintf(f, "    \"read\": %llu,\n", gstats.read);
+	fprintf(f, "    \"parity\": %llu,\n", gstats.parity);
+	fprintf(f, "    \"write\": %llu,\n", gstats.write);
+	fprintf(f, "    \"fsync\": %llu,\n", gstats.sync);
+	fprintf(f, "    \"wait\": %llu,\n", gstats.wait);
+	fprintf(f, "    \"verify\": %llu\n", gstats.verify);
+	fprintf(f, "  },\n");
+	fprintf(f, "  \"verified_chunks\": %llu,\n", gstats.verified);
+	fprintf(f, "  \"mismatched_chunks\": %llu,\n", gstats.mismatched);
+	fprintf(f, "  \"unread_chunks\": %llu,\n", gstats.unread);
+	fprintf(f, "  \"last_window\": { \"bytes\": %llu, \"usec\": %llu }\n",
+		gstats.win_bytes, gstats.win_usec);
+	fprintf(f, "}\n");
+}
+
+static void grow_stats_write(struct mdinfo *sra, char *state)
+{
+	struct grow_stats_file gs = { sra, state };
+
+	gstats.written = now_usec();
+	if (gstats.file)
+		write_file_atomic(gstats.file, grow_stats_fill, &gs);
+}
+
+static void grow_stats_update(struct mdinfo *sra)
+{
+	if (now_usec() - gstats.written >= GROW_STATS_INTERVAL)
+		grow_stats_write(sra, "reshape");
+}
+
+static void grow_stats_end(struct mdinfo *sra, int done)
+{
+	unsigned long long elapsed = now_usec() - gstats.start;
+
+	grow_stats_write(sra, done ? "finished" : "failed");
+	fprintf(stderr, Name ": %s: backed up %lluK in %llu windows over "
+		"%llu.%03llus (%llu MB/s)\n", sra->sys_name, gstats.bytes/1024,
+		gstats.windows, elapsed/1000000, (elapsed/1000)%1000,
+		gstats.bytes / (elapsed + 1));
+	fprintf(stderr, Name ": %s: suspend %llums, read %llums, "
+		"parity %llums, write %llums, fsync %llums, "
+		"waiting for reshape %llums\n", sra->sys_name,
+		gstats.suspend/1000, gstats.read/1000, gstats.parity/1000,
+		gstats.write/1000, gstats.sync/1000, gstats.wait/1000);
+	if (gstats.verified || gstats.unread)
+		fprintf(stderr, Name ": %s: checked %llu chunks of the backup "
+			"against the array in %llums, %llu mismatched, "
+			"%llu could not be read\n",
+			sra->sys_name, gstats.verified, gstats.verify/1000,
+			gstats.mismatched, gstats.unread);
+	free(gstats.file);
+	gstats.file = NULL;
+}
+
+/* size of a backup-super-block write */
+#define BSB_IO 4096
+
+/* Sampled checking of each section of the backup against the array.
+ * MDADM_GROW_VERIFY_SAMPLE gives the percentage of chunks checked.
+ */
+static struct {
+	int afd;		/* the array, or -1 */
+	unsigned long ppm;	/* chunks checked per million */
+	char *buf;
+	int buflen;
+} gverify = { -1, 0, NULL, 0 };
+
+static unsigned long grow_verify_rate(void)
+{
+	char *env = getenv("MDADM_GROW_VERIFY_SAMPLE");
+	char *ep;
+	double pct;
+
+	if (!env || !*env)
+		return 0;
+	pct = strtod(env, &ep);
+	if (*ep || pct <= 0)
+		return 0;
+	if (pct > 100)
+		pct = 100;
+	return pct * 10000;
+}
+
+static void grow_verify_begin(int afd)
+{
+	gverify.afd = afd;
+	gverify.ppm = afd >= 0 ? grow_verify_rate() : 0;
+	srandom(random32());
+}
+
+static int verify_section(int part, int chunk, int dests, int *destfd,
+			  unsigned long long *destoffsets)
+{
+	/* Pick some chunks of the section just backed up in 'part' and
+	 * check that the array and every copy of the backup agree on
+	 * them.  Only a crc of each is kept, so one buffer will do.
+	 * Returns -1 if anything disagrees.
+	 */
+	unsigned long long len = bsb_length(&bsb, part) * 512;
+	unsigned long long n, k, i, c;
+	unsigned long long t0 = now_usec();
+	int rv = 0;
+	int d;
+
+	if (!gverify.ppm || len < (unsigned long long)chunk)
+		return 0;
+	if (gverify.buflen < chunk) {
+		free(gverify.buf);
+		gverify.buflen = 0;
+		if (posix_memalign((void**)&gverify.buf, 4096, chunk))
+			return 0;
+		gverify.buflen = chunk;
+	}
+	n = len / chunk;
+	k = (n * gverify.ppm + 999999) / 1000000;
+	if (k > n)
+		k = n;
+	for (i = 0; i < k && rv == 0; i++) {
+		unsigned long long where;
+		__u32 want;
+
+		c = k == n ? i : (unsigned long long)random() % n;
+		where = bsb_start(&bsb, part) * 512 + c * chunk;
+		if (pread(gverify.afd, gverify.buf, chunk, where) != chunk) {
+			/* that is not a bad backup, but say so */
+			if (!gstats.unread++)
+				fprintf(stderr, Name ": cannot read array sector "
+					"%llu to check the backup: %s\n",
+					where / 512, strerror(errno));
+			continue;
+		}
+		want = crc32c(0, gverify.buf, chunk);
+		for (d = 0; d < dests; d++) {
+			unsigned long long off = destoffsets[d] +
+				part * __le64_to_cpu(bsb.devstart2) * 512 +
+				c * chunk;
+			if (pread(destfd[d], gverify.buf, chunk, off) != chunk ||
+			    crc32c(0, gverify.buf, chunk) != want) {
+				fprintf(stderr, Name ": backup of array sector "
+					"%llu does not match the array\n",
+					where / 512);
+				gstats.mismatched++;
+				rv = -1;
+				break;
+			}
+		}
+		gstats.verified++;
+	}
+	gstats.verify += now_usec() - t0;
+	return rv;
+}
+
+static void grow_direct_io(int *fds, unsigned long long *offsets, int cnt)
+{
+	/* A long reshape reading members and writing the backup through
+	 * the page cache pushes everything else out of it, so switch
+	 * to O_DIRECT where the device or file allows it.  Everything
+	 * we transfer is a multiple of 4K and 4K aligned in memory, so
+	 * it is enough that the offset is too.  Anything left buffered
+	 * has its cache dropped by grow_drop_cache() instead.
+	 * MDADM_GROW_BUFFERED keeps the old behaviour.
+	 */
+	int i;
+
+	if (check_env("MDADM_GROW_BUFFERED"))
+		return;
+	for (i = 0; i < cnt; i++) {
+		int fl;
+
+		if (fds[i] < 0 || offsets[i] % 4096)
+			continue;
+		fl = fcntl(fds[i], F_GETFL);
+		if (fl >= 0)
+			fcntl(fds[i], F_SETFL, fl | O_DIRECT);
+	}
+}
+
+static void grow_drop_cache(int fd, unsigned long long offset,
+			    unsigned long long len)
+{
+	int fl;
+
+	if (fd < 0)
+		return;
+	fl = fcntl(fd, F_GETFL);
+	if (fl < 0 || (fl & O_DIRECT))
+		return;
+	posix_fadvise(fd, offset, len, POSIX_FADV_DONTNEED);
+}
+
+static int write_bsb(int dests, int *destfd, unsigned long long *destoffsets,
+		     unsigned long long trailer)
+{
+	/* Write 'bsb' 4K before the data on each destination, and
+	 * 'trailer' bytes after it too if the destination is a spare,
+	 * then make it all durable.  The destinations are written and
+	 * flushed concurrently, and we only report success once every
+	 * one of them is durable.  fdatasync is enough: all that
+	 * matters is that the data and the file size are stable.
+	 */
+	char *sb;
+	struct io_req reqs[dests * 2];
+	int nreqs = 0;
+	int rv = 0;
+	int i;
+
+	/* Each copy goes out as a whole, zero-padded, 4K block so that
+	 * it can be written with O_DIRECT.  The 4K before the data is
+	 * reserved for it, as is the 4K after it on a spare.
+	 */
+	if (posix_memalign((void**)&sb, 4096, dests * BSB_IO))
+		return -1;
+	memset(sb, 0, dests * BSB_IO);
+
+	if (dests > 1 &&
+	    (!backup_pool || backup_pool_pid != getpid())) {
+		/* A pool inherited across fork() has no threads behind it */
+		backup_pool = io_pool_create(2 * dests);
+		backup_pool_pid = getpid();
+	}
+	for (i = 0; i < dests; i++) {
+		struct io_req *r;
+
+		bsb.devstart = __cpu_to_le64(destoffsets[i]/512);
+		bsb_set_csums();
+		memcpy(sb + i * BSB_IO, &bsb, sizeof(bsb));
+
+		r = &reqs[nreqs++];
+		memset(r, 0, sizeof(*r));
+		r->op = IO_WRITE;
+		r->fd = destfd[i];
+		r->buf = sb + i * BSB_IO;
+		r->len = BSB_IO;
+		r->offset = destoffsets[i] - 4096;
+		io_pool_submit(backup_pool, r);
+		if (trailer && destoffsets[i] > 4096) {
+			r = &reqs[nreqs++];
+			*r = reqs[nreqs-2];
+			r->offset = destoffsets[i] + trailer;
+			io_pool_submit(backup_pool, r);
+		}
+	}
+	io_pool_wait_reqs(backup_pool, reqs, nreqs);
+	for (i = 0; i < nreqs; i++)
+		if (reqs[i].rv != BSB_IO)
+			rv = -1;
+	free(sb);
+
+	/* flush even after a failure so that what did land is stable */
+	for (i = 0; i < dests; i++) {
+		struct io_req *r = &reqs[i];
+		memset(r, 0, sizeof(*r));
+		r->op = IO_FDATASYNC;
+		r->fd = destfd[i];
+		io_pool_submit(backup_pool, r);
+	}
+	io_pool_wait_reqs(backup_pool, reqs, dests);
+	for (i = 0; i < dests; i++)
+		if (reqs[i].rv < 0)
+			rv = -1;
+	return rv;
+}
+
 int grow_backup(struct mdinfo *sra,
 		unsigned long long offset, /* per device */
 		unsigned long stripes, /* per device */
@@ -1279,18 +1799,23 @@ int grow_backup(struct mdinfo *sra,
 	 * to storage 'destfd' (offset 'destoffsets'), after first
 	 * suspending IO.  Then allow resync to continue
 	 * over the suspended section.
-	 * Use part 'part' of the backup-super-block.
+	 * Use section 'part' of the backup-super-block.
 	 */
 	int odata = disks;
 	int rv = 0;
 	int i;
 	unsigned long long ll;
 	int new_degraded;
+	unsigned long long t0, t1, t2;
+	struct save_stats ss;
+	__u32 crc;
+	int tries;
 	//printf("offset %llu\n", offset);
 	if (level >= 4)
 		odata--;
 	if (level == 6)
 		odata--;
+	t0 = now_usec();
 	sysfs_set_num(sra, NULL, "suspend_hi", (offset + stripes * (chunk/512)) * odata);
 	/* Check that array hasn't become degraded, else we might backup the wrong data */
 	sysfs_get_ll(sra, NULL, "degraded", &ll);
@@ -1318,55 +1843,59 @@ int grow_backup(struct mdinfo *sra,
 		}
 		*degraded = new_degraded;
 	}
-	if (part) {
-		bsb.arraystart2 = __cpu_to_le64(offset * odata);
-		bsb.length2 = __cpu_to_le64(stripes * (chunk/512) * odata);
-	} else {
-		bsb.arraystart = __cpu_to_le64(offset * odata);
-		bsb.length = __cpu_to_le64(stripes * (chunk/512) * odata);
-	}
-	if (part)
-		bsb.magic[15] = '2';
-	for (i = 0; i < dests; i++)
-		if (part)
-			lseek64(destfd[i], destoffsets[i] + __le64_to_cpu(bsb.devstart2)*512, 0);
-		else
-			lseek64(destfd[i], destoffsets[i], 0);
-
-	rv = save_stripes(sources, offsets, 
-			  disks, chunk, level, layout,
-			  dests, destfd,
-			  offset*512*odata, stripes * chunk * odata,
-			  buf);
-
-	if (rv)
-		return rv;
-	bsb.mtime = __cpu_to_le64(time(0));
-	for (i = 0; i < dests; i++) {
-		bsb.devstart = __cpu_to_le64(destoffsets[i]/512);
-
-		bsb.sb_csum = bsb_csum((char*)&bsb, ((char*)&bsb.sb_csum)-((char*)&bsb));
-		if (memcmp(bsb.magic, "md_backup_data-2", 16) == 0)
-			bsb.sb_csum2 = bsb_csum((char*)&bsb,
-						((char*)&bsb.sb_csum2)-((char*)&bsb));
-
-		rv = -1;
-		if ((unsigned long long)lseek64(destfd[i], destoffsets[i] - 4096, 0)
-		    != destoffsets[i] - 4096)
-			break;
-		if (write(destfd[i], &bsb, 512) != 512)
+	bsb_set_slot(part, offset * odata, stripes * (chunk/512) * odata);
+	t1 = now_usec();
+	gstats.suspend += t1 - t0;
+	for (tries = 0; ; tries++) {
+		for (i = 0; i < dests; i++)
+			lseek64(destfd[i], destoffsets[i] +
+				part * __le64_to_cpu(bsb.devstart2)*512, 0);
+
+		ss = save_stats;
+		crc = 0;
+		rv = save_stripes(sources, offsets, 
+				  disks, chunk, level, layout,
+				  dests, destfd,
+				  offset*512*odata, stripes * chunk * odata,
+				  buf, &crc);
+		bsb.data_crc[part] = __cpu_to_le32(crc);
+		gstats.read += save_stats.read_usec - ss.read_usec;
+		gstats.parity += save_stats.parity_usec - ss.parity_usec;
+		gstats.write += save_stats.write_usec - ss.write_usec;
+
+		if (rv)
+			return rv;
+		bsb.mtime = __cpu_to_le64(time(0));
+		t1 = now_usec();
+		rv = write_bsb(dests, destfd, destoffsets,
+			       (unsigned long long)stripes*chunk*odata);
+		t2 = now_usec();
+		gstats.sync += t2 - t1;
+		if (rv || verify_section(part, chunk, dests, destfd,
+					 destoffsets) == 0)
 			break;
-		if (destoffsets[i] > 4096) {
-			if ((unsigned long long)lseek64(destfd[i], destoffsets[i]+stripes*chunk*odata, 0) !=
-			    destoffsets[i]+stripes*chunk*odata)
-				break;
-			if (write(destfd[i], &bsb, 512) != 512)
-				break;
+		if (tries) {
+			fprintf(stderr, Name ": %s: backup still does not "
+				"match the array, giving up\n", sra->sys_name);
+			return -1;
 		}
-		fsync(destfd[i]);
-		rv = 0;
+		fprintf(stderr, Name ": %s: backing up section again\n",
+			sra->sys_name);
 	}
-
+	gstats.windows++;
+	gstats.win_bytes = (unsigned long long)stripes * chunk * odata;
+	gstats.win_usec = t2 - t0;
+	gstats.bytes += gstats.win_bytes;
+	gstats.progress = offset + stripes * (chunk/512);
+	grow_stats_update(sra);
+	/* Now that it is all stable, the buffered copies can go */
+	for (i = 0; i < disks; i++)
+		grow_drop_cache(sources[i], offsets[i] + offset*512,
+				(unsigned long long)stripes*chunk);
+	for (i = 0; i < dests; i++)
+		grow_drop_cache(destfd[i], destoffsets[i] +
+				part * __le64_to_cpu(bsb.devstart2)*512,
+				(unsigned long long)stripes*chunk*odata);
 	return rv;
 }
 
@@ -1393,11 +1922,12 @@ int wait_backup(struct mdinfo *sra,
 	 */
 	int fd = sysfs_get_fd(sra, NULL, "sync_completed");
 	unsigned long long completed;
-	int i;
+	unsigned long long t0, t1;
 	int rv;
 
 	if (fd < 0)
 		return -1;
+	t0 = now_usec();
 	sysfs_set_num(sra, NULL, "sync_max", offset + blocks + blocks2);
 	if (offset == 0)
 		sysfs_set_str(sra, NULL, "sync_action", "reshape");
@@ -1406,7 +1936,15 @@ int wait_backup(struct mdinfo *sra,
 		fd_set rfds;
 		FD_ZERO(&rfds);
 		FD_SET(fd, &rfds);
-		select(fd+1, NULL, NULL, &rfds, NULL);
+		if (grow_throttle) {
+			/* wake up now and then to adjust the speed */
+			struct timeval tv;
+			tv.tv_sec = 0;
+			tv.tv_usec = 500000;
+			select(fd+1, NULL, NULL, &rfds, &tv);
+			throttle_poll(grow_throttle);
+		} else
+			select(fd+1, NULL, NULL, &rfds, NULL);
 		if (sysfs_fd_get_ll(fd, &completed) < 0) {
 			close(fd);
 			return -1;
@@ -1418,29 +1956,13 @@ int wait_backup(struct mdinfo *sra,
 	} while (completed < offset + blocks);
 	close(fd);
 
-	if (part) {
-		bsb.arraystart2 = __cpu_to_le64(0);
-		bsb.length2 = __cpu_to_le64(0);
-	} else {
-		bsb.arraystart = __cpu_to_le64(0);
-		bsb.length = __cpu_to_le64(0);
-	}
+	t1 = now_usec();
+	gstats.wait += t1 - t0;
+	bsb_set_slot(part, 0, 0);
 	bsb.mtime = __cpu_to_le64(time(0));
-	rv = 0;
-	for (i = 0; i < dests; i++) {
-		bsb.devstart = __cpu_to_le64(destoffsets[i]/512);
-		bsb.sb_csum = bsb_csum((char*)&bsb, ((char*)&bsb.sb_csum)-((char*)&bsb));
-		if (memcmp(bsb.magic, "md_backup_data-2", 16) == 0)
-			bsb.sb_csum2 = bsb_csum((char*)&bsb,
-						((char*)&bsb.sb_csum2)-((char*)&bsb));
-		if ((unsigned long long)lseek64(destfd[i], destoffsets[i]-4096, 0) !=
-		    destoffsets[i]-4096)
-			rv = -1;
-		if (rv == 0 && 
-		    write(destfd[i], &bsb, 512) != 512)
-			rv = -1;
-		fsync(destfd[i]);
-	}
+	rv = write_bsb(dests, destfd, destoffsets, 0);
+	gstats.sync += now_usec() - t1;
+	grow_stats_update(sra);
 	return rv;
 }
 
@@ -1449,6 +1971,8 @@ static void fail(char *msg)
 	int rv;
 	rv = (write(2, msg, strlen(msg)) != (int)strlen(msg));
 	rv |= (write(2, "\n", 1) != 1);
+	/* don't leave the sync speed pinned */
+	throttle_stop(grow_throttle);
 	exit(rv ? 1 : 2);
 }
 
@@ -1460,27 +1984,33 @@ static void validate(int afd, int bfd, unsigned long long offset)
 	 * This is only used for regression testing and should not
 	 * be used while the array is active
 	 */
+	int slot;
+	char *sb, *bad;
+
 	if (afd < 0)
 		return;
-	lseek64(bfd, offset - 4096, 0);
-	if (read(bfd, &bsb2, 512) != 512)
+	/* bfd may be O_DIRECT, so read the whole block */
+	if (posix_memalign((void**)&sb, 4096, BSB_IO))
+		return;
+	if (pread(bfd, sb, BSB_IO, offset - 4096) != BSB_IO)
 		fail("cannot read bsb");
-	if (bsb2.sb_csum != bsb_csum((char*)&bsb2,
-				     ((char*)&bsb2.sb_csum)-((char*)&bsb2)))
-		fail("first csum bad");
-	if (memcmp(bsb2.magic, "md_backup_data", 14) != 0)
-		fail("magic is bad");
-	if (memcmp(bsb2.magic, "md_backup_data-2", 16) == 0 &&
-	    bsb2.sb_csum2 != bsb_csum((char*)&bsb2,
-				     ((char*)&bsb2.sb_csum2)-((char*)&bsb2)))
-		fail("second csum bad");
+	memcpy(&bsb2, sb, sizeof(bsb2));
+	free(sb);
+	bad = bsb_bad(&bsb2);
+	if (bad) {
+		char msg[40];
+		snprintf(msg, sizeof(msg), "bsb %s is bad", bad);
+		fail(msg);
+	}
 
 	if (__le64_to_cpu(bsb2.devstart)*512 != offset)
 		fail("devstart is wrong");
 
-	if (bsb2.length) {
-		unsigned long long len = __le64_to_cpu(bsb2.length)*512;
+	for (slot = 0; slot < bsb_nslots(&bsb2); slot++) {
+		unsigned long long len = bsb_length(&bsb2, slot)*512;
 
+		if (!len)
+			continue;
 		if (abuflen < len) {
 			free(abuf);
 			free(bbuf);
@@ -1493,47 +2023,17 @@ static void validate(int afd, int bfd, unsigned long long offset)
 			}
 		}
 
-		lseek64(bfd, offset, 0);
-		if ((unsigned long long)read(bfd, bbuf, len) != len) {
-			//printf("len %llu\n", len);
-			fail("read first backup failed");
-		}
-		lseek64(afd, __le64_to_cpu(bsb2.arraystart)*512, 0);
-		if ((unsigned long long)read(afd, abuf, len) != len)
-			fail("read first from array failed");
-		if (memcmp(bbuf, abuf, len) != 0) {
-			#if 0
-			int i;
-			printf("offset=%llu len=%llu\n",
-			       (unsigned long long)__le64_to_cpu(bsb2.arraystart)*512, len);
-			for (i=0; i<len; i++)
-				if (bbuf[i] != abuf[i]) {
-					printf("first diff byte %d\n", i);
-					break;
-				}
-			#endif
-			fail("data1 compare failed");
-		}
-	}
-	if (bsb2.length2) {
-		unsigned long long len = __le64_to_cpu(bsb2.length2)*512;
-
-		if (abuflen < len) {
-			free(abuf);
-			free(bbuf);
-			abuflen = len;
-			abuf = malloc(abuflen);
-			bbuf = malloc(abuflen);
-		}
-
-		lseek64(bfd, offset+__le64_to_cpu(bsb2.devstart2)*512, 0);
+		lseek64(bfd, offset + slot * __le64_to_cpu(bsb2.devstart2)*512, 0);
 		if ((unsigned long long)read(bfd, bbuf, len) != len)
-			fail("read second backup failed");
-		lseek64(afd, __le64_to_cpu(bsb2.arraystart2)*512, 0);
+			fail("read backup failed");
+		lseek64(afd, bsb_start(&bsb2, slot)*512, 0);
 		if ((unsigned long long)read(afd, abuf, len) != len)
-			fail("read second from array failed");
+			fail("read from array failed");
 		if (memcmp(bbuf, abuf, len) != 0)
-			fail("data2 compare failed");
+			fail("data compare failed");
+		if (bsb2.magic[15] >= '4' &&
+		    crc32c(0, bbuf, len) != __le32_to_cpu(bsb2.data_crc[slot]))
+			fail("data crc is wrong");
 	}
 }
 
@@ -1548,6 +2048,8 @@ static int child_grow(int afd, struct mdinfo *sra, unsigned long stripes,
 	if (posix_memalign((void**)&buf, 4096, disks * chunk))
 		/* Don't start the 'reshape' */
 		return 0;
+	grow_direct_io(fds, offsets, disks);
+	grow_direct_io(destfd, destoffsets, dests);
 	sysfs_set_num(sra, NULL, "suspend_hi", 0);
 	sysfs_set_num(sra, NULL, "suspend_lo", 0);
 	grow_backup(sra, 0, stripes,
@@ -1577,6 +2079,8 @@ static int child_shrink(int afd, struct mdinfo *sra, unsigned long stripes,
 
 	if (posix_memalign((void**)&buf, 4096, disks * chunk))
 		return 0;
+	grow_direct_io(fds, offsets, disks);
+	grow_direct_io(destfd, destoffsets, dests);
 	start = sra->component_size - stripes * (chunk/512);
 	sysfs_set_num(sra, NULL, "sync_max", start);
 	sysfs_set_str(sra, NULL, "sync_action", "reshape");
@@ -1601,74 +2105,178 @@ static int child_shrink(int afd, struct mdinfo *sra, unsigned long stripes,
 	return 1;
 }
 
+/* Default limit on how long any part of the array may stay suspended
+ * while child_same_size() backs it up and waits for the reshape to
+ * pass it.  MDADM_GROW_MAX_SUSPEND (milliseconds) overrides this.
+ */
+#define GROW_MAX_SUSPEND_MS 1000
+/* Sections in the backup ring used by child_same_size() */
+#define GROW_SLOTS 3
+
 static int child_same_size(int afd, struct mdinfo *sra, unsigned long stripes,
+			   unsigned long minstripes,
 			   int *fds, unsigned long long *offsets,
 			   unsigned long long start,
 			   int disks, int chunk, int level, int layout, int data,
 			   int dests, int *destfd, unsigned long long *destoffsets)
 {
+	/* The backup is a ring of GROW_SLOTS sections.  The kernel may
+	 * reshape anything that is backed up, so sync_max is always
+	 * the end of the newest section.  We wait only for the oldest
+	 * section to be reshaped, then back up the next window into
+	 * its slot while the kernel carries on with the others.
+	 *
+	 * 'stripes' is the space reserved for each section, so no
+	 * window may be larger than that.  Within that limit we size
+	 * each window from what the previous ones cost: the time to
+	 * back them up (including the fsync) and the time spent
+	 * waiting for the kernel to reshape them.  A window stays
+	 * suspended from when it is backed up until the reshape has
+	 * passed it, which is about one round of the ring, so choose
+	 * the largest window which keeps that under the limit.
+	 * The fsync cost is per window, so a small window costs more per
+	 * stripe and the estimate settles where the limit is just met.
+	 */
 	unsigned long long size;
-	unsigned long tailstripes = stripes;
-	int part;
+	unsigned long long pstart[GROW_SLOTS];	/* per-device stripe of each slot */
+	unsigned long plen[GROW_SLOTS];		/* and its length in stripes */
+	unsigned long window = stripes;
+	unsigned long long cost = 0;	/* usec per stripe, backup + reshape */
+	unsigned long long bcost = 0;	/* usec per stripe of the last backup */
+	unsigned long long max_suspend = GROW_MAX_SUSPEND_MS * 1000ULL;
+	unsigned long long wusec, filled;
+	unsigned long long t0, t1;
+	char *env;
+	int slot, next, i;
 	char *buf;
 	unsigned long long speed;
 	int degraded = 0;
+	int rv = 0;
 
+	if (minstripes == 0 || minstripes > stripes)
+		minstripes = stripes;
+	env = getenv("MDADM_GROW_MAX_SUSPEND");
+	if (env && *env) {
+		char *ep;
+		unsigned long ms = strtoul(env, &ep, 10);
+		if (*ep == 0 && ms > 0)
+			max_suspend = ms * 1000ULL;
+	}
 
 	if (posix_memalign((void**)&buf, 4096, disks * chunk))
 		return 0;
+	grow_direct_io(fds, offsets, disks);
+	grow_direct_io(destfd, destoffsets, dests);
+
+	bsb.slots = __cpu_to_le32(GROW_SLOTS);
+	memcpy(bsb.magic, "md_backup_data-4", 16);
 
 	sysfs_set_num(sra, NULL, "suspend_lo", 0);
 	sysfs_set_num(sra, NULL, "suspend_hi", 0);
 
-	sysfs_get_ll(sra, NULL, "sync_speed_min", &speed);
-	sysfs_set_num(sra, NULL, "sync_speed_min", 200000);
+	grow_throttle = throttle_start(sra->sys_name,
+				       throttle_target(GROW_SYNC_LATENCY_MS));
+	if (!grow_throttle) {
+		/* No controller, so just make sure the reshape keeps up */
+		sysfs_get_ll(sra, NULL, "sync_speed_min", &speed);
+		sysfs_set_num(sra, NULL, "sync_speed_min", 200000);
+	}
 
-	grow_backup(sra, start, stripes,
-		    fds, offsets,
-		    disks, chunk, level, layout,
-		    dests, destfd, destoffsets,
-		    0, &degraded, buf);
-	grow_backup(sra, (start + stripes) * (chunk/512), stripes,
-		    fds, offsets,
-		    disks, chunk, level, layout,
-		    dests, destfd, destoffsets,
-		    1, &degraded, buf);
-	validate(afd, destfd[0], destoffsets[0]);
-	part = 0;
-	start += stripes * 2; /* where to read next */
 	size = sra->component_size / (chunk/512);
+	/* Nothing has been measured yet, so fill the ring with
+	 * windows as large as the backup allows.
+	 */
+	filled = 0;
+	t0 = now_usec();
+	for (slot = 0; slot < GROW_SLOTS; slot++) {
+		pstart[slot] = start;
+		plen[slot] = window;
+		if (start + plen[slot] > size)
+			plen[slot] = size - start;
+		if (plen[slot] &&
+		    grow_backup(sra, start*(chunk/512), plen[slot],
+				fds, offsets,
+				disks, chunk, level, layout,
+				dests, destfd, destoffsets,
+				slot, &degraded, buf) < 0)
+			goto out;
+		start += plen[slot];
+		filled += plen[slot];
+	}
+	t1 = now_usec();
+	if (filled)
+		bcost = (t1 - t0) / filled;
+	validate(afd, destfd[0], destoffsets[0]);
+	slot = 0; /* the oldest section */
 	while (start < size) {
-		if (wait_backup(sra, (start-stripes*2)*(chunk/512),
-				stripes*(chunk/512), 0,
+		next = (slot + 1) % GROW_SLOTS;
+		t0 = now_usec();
+		if (wait_backup(sra, pstart[slot]*(chunk/512),
+				plen[slot]*(chunk/512),
+				(start - pstart[slot] - plen[slot])*(chunk/512),
 				dests, destfd, destoffsets,
-				part) < 0)
-			return 0;
-		sysfs_set_num(sra, NULL, "suspend_lo", start*(chunk/512) * data);
-		if (start + stripes > size)
-			tailstripes = (size - start);
-
-		grow_backup(sra, start*(chunk/512), tailstripes,
-			    fds, offsets,
-			    disks, chunk, level, layout,
-			    dests, destfd, destoffsets,
-			    part, &degraded, buf);
-		start += stripes;
-		part = 1 - part;
+				slot) < 0)
+			goto out;
+		t1 = now_usec();
+		wusec = t1 - t0;
+		/* The oldest section is done, the next is now the oldest */
+		sysfs_set_num(sra, NULL, "suspend_lo",
+			      pstart[next]*(chunk/512) * data);
+
+		if (plen[slot]) {
+			unsigned long long c = bcost + wusec / plen[slot];
+			cost = cost ? (cost * 3 + c) / 4 : c;
+		}
+		window = stripes;
+		if (cost && max_suspend / GROW_SLOTS / cost < window)
+			window = max_suspend / GROW_SLOTS / cost;
+		window -= window % minstripes;
+		if (window < minstripes)
+			window = minstripes;
+		if (start + window > size)
+			window = size - start;
+
+		pstart[slot] = start;
+		plen[slot] = window;
+		t0 = now_usec();
+		if (grow_backup(sra, start*(chunk/512), window,
+				fds, offsets,
+				disks, chunk, level, layout,
+				dests, destfd, destoffsets,
+				slot, &degraded, buf) < 0)
+			goto out;
+		t1 = now_usec();
+		bcost = (t1 - t0) / window;
+		start += window;
+		slot = next;
 		validate(afd, destfd[0], destoffsets[0]);
 	}
-	if (wait_backup(sra, (start-stripes*2) * (chunk/512), stripes * (chunk/512), 0,
-			dests, destfd, destoffsets,
-			part) < 0)
-		return 0;
-	sysfs_set_num(sra, NULL, "suspend_lo", ((start-stripes)*(chunk/512)) * data);
-	wait_backup(sra, (start-stripes) * (chunk/512), tailstripes * (chunk/512), 0,
-		    dests, destfd, destoffsets,
-		    1-part);
+	/* Let the reshape finish, oldest section first */
+	for (i = 0; i < GROW_SLOTS; i++) {
+		next = (slot + 1) % GROW_SLOTS;
+		if (plen[slot] &&
+		    wait_backup(sra, pstart[slot]*(chunk/512),
+				plen[slot]*(chunk/512),
+				(start - pstart[slot] - plen[slot])*(chunk/512),
+				dests, destfd, destoffsets,
+				slot) < 0)
+			goto out;
+		if (i < GROW_SLOTS - 1)
+			sysfs_set_num(sra, NULL, "suspend_lo",
+				      pstart[next]*(chunk/512) * data);
+		slot = next;
+	}
 	sysfs_set_num(sra, NULL, "suspend_lo", (size*(chunk/512)) * data);
-	sysfs_set_num(sra, NULL, "sync_speed_min", speed);
+	rv = 1;
+out:
+	/* however we leave, don't leave the sync speed pinned */
+	if (grow_throttle) {
+		throttle_stop(grow_throttle);
+		grow_throttle = NULL;
+	} else
+		sysfs_set_num(sra, NULL, "sync_speed_min", speed);
 	free(buf);
-	return 1;
+	return rv;
 }
 
 /*
@@ -1676,6 +2284,146 @@ static int child_same_size(int afd, struct mdinfo *sra, unsigned long stripes,
  * write that data into the array and update the super blocks with
  * the new reshape_progress
  */
+/* One place a backup might be found, probed by probe_backup() */
+struct backup_probe {
+	struct supertype *st;	/* our own, as load_super() sets st->sb */
+	struct mdinfo *info;
+	int fd;			/* -1 if it couldn't be opened */
+	int close_fd;		/* we opened it, so we close it */
+	char *devname, namebuf[20];
+	int verbose;
+	int ok;			/* holds a backup we could restore */
+	char msg[200];		/* why not, or any other comment */
+	int loud;		/* print 'msg' even if not verbose */
+	struct mdp_backup_super bsb;
+};
+
+static int probe_backup(struct io_req *r)
+{
+	/* Load and check the backup-super-block at one location.
+	 * This runs in parallel with the other probes so it only uses
+	 * pread() and its own buffers, and leaves messages to be printed
+	 * afterwards.
+	 */
+	struct backup_probe *p = r->data;
+	struct mdinfo *info = p->info;
+	struct mdp_backup_super *b = &p->bsb;
+	char *blk, *bad;
+	unsigned long long where;
+	int nslots, slot;
+
+	if (p->fd < 0)
+		return -1;
+	if (p->close_fd) {
+		where = 0;
+	} else {
+		struct mdinfo dinfo;
+		if (p->st->ss->load_super(p->st, p->fd, NULL))
+			return -1;
+		p->st->ss->getinfo_super(p->st, &dinfo);
+		p->st->ss->free_super(p->st);
+		where = (dinfo.data_offset + dinfo.component_size - 8) << 9;
+	}
+	if (posix_memalign((void**)&blk, 4096, 4096))
+		return -1;
+	if (pread(p->fd, blk, sizeof(*b), where) != sizeof(*b)) {
+		snprintf(p->msg, sizeof(p->msg), "Cannot read from %s", p->devname);
+		goto out;
+	}
+	memcpy(b, blk, sizeof(*b));
+	bad = bsb_bad(b);
+	if (bad && strcmp(bad, "magic") == 0) {
+		snprintf(p->msg, sizeof(p->msg), "No backup metadata on %s", p->devname);
+		goto out;
+	}
+	if (bad) {
+		snprintf(p->msg, sizeof(p->msg), "Bad backup-metadata %s on %s",
+			 bad, p->devname);
+		goto out;
+	}
+	nslots = bsb_nslots(b);
+	if (memcmp(b->set_uuid, info->uuid, 16) != 0) {
+		snprintf(p->msg, sizeof(p->msg), "Wrong uuid on backup-metadata on %s", p->devname);
+		goto out;
+	}
+
+	/* array utime and backup-mtime should be updated at much the same time, but it seems that
+	 * sometimes they aren't... So allow considerable flexability in matching, and allow
+	 * this test to be overridden by an environment variable.
+	 */
+	if (info->array.utime > (int)__le64_to_cpu(b->mtime) + 2*60*60 ||
+	    info->array.utime < (int)__le64_to_cpu(b->mtime) - 10*60) {
+		if (check_env("MDADM_GROW_ALLOW_OLD")) {
+			snprintf(p->msg, sizeof(p->msg),
+				 "accepting backup with timestamp %lu "
+				 "for array with timestamp %lu",
+				 (unsigned long)__le64_to_cpu(b->mtime),
+				 (unsigned long)info->array.utime);
+			p->loud = 1;
+		} else {
+			snprintf(p->msg, sizeof(p->msg), "too-old timestamp on "
+				 "backup-metadata on %s", p->devname);
+			goto out;
+		}
+	}
+
+	/* Is any section ahead of where the reshape got to? */
+	for (slot = 0; slot < nslots; slot++) {
+		if (info->delta_disks >= 0) {
+			/* reshape_progress is increasing */
+			if (bsb_start(b, slot) + bsb_length(b, slot) >=
+			    info->reshape_progress)
+				break;
+		} else {
+			/* reshape_progress is decreasing */
+			if (bsb_start(b, slot) < info->reshape_progress)
+				break;
+		}
+	}
+	if (slot == nslots) {
+		snprintf(p->msg, sizeof(p->msg), "backup-metadata found on %s but is not needed", p->devname);
+		p->loud = 0;
+		goto out;
+	}
+	/* There should be a duplicate backup superblock 4k before the data */
+	if (pread(p->fd, blk, sizeof(*b), __le64_to_cpu(b->devstart)*512 - 4096)
+	    != sizeof(*b) ||
+	    memcmp(blk, b, bsb_size(b)) != 0) {
+		snprintf(p->msg, sizeof(p->msg), "Failed to verify secondary backup-metadata block on %s",
+			 p->devname);
+		p->loud = 0;
+		goto out;
+	}
+	/* A format 4 backup can prove its data is intact */
+	slot = bsb_data_ok(b, p->fd, __le64_to_cpu(b->devstart)*512);
+	if (slot >= 0) {
+		snprintf(p->msg, sizeof(p->msg), "Backup data in section %d on %s "
+			 "does not match its checksum", slot, p->devname);
+		p->loud = 1;
+		goto out;
+	}
+	p->ok = 1;
+out:
+	free(blk);
+	return p->ok ? 0 : -1;
+}
+
+static unsigned long long backup_reach(struct mdp_backup_super *b, int forwards)
+{
+	/* How far the reshape will have got once this is restored */
+	unsigned long long reach = forwards ? 0 : ~0ULL;
+	int slot;
+
+	for (slot = 0; slot < bsb_nslots(b); slot++) {
+		unsigned long long e = bsb_start(b, slot);
+		if (forwards)
+			e += bsb_length(b, slot);
+		if (forwards ? e > reach : e < reach)
+			reach = e;
+	}
+	return reach;
+}
+
 int Grow_restart(struct supertype *st, struct mdinfo *info, int *fdlist, int cnt,
 		 char *backup_file, int verbose)
 {
@@ -1684,6 +2432,10 @@ int Grow_restart(struct supertype *st, struct mdinfo *info, int *fdlist, int cnt
 	unsigned long long *offsets;
 	unsigned long long  nstripe, ostripe;
 	int ndata, odata;
+	int first, nprobes;
+	struct backup_probe *probes, *best;
+	struct io_req *reqs;
+	struct io_pool *pool;
 
 	if (info->new_level != info->array.level)
 		return 1; /* Cannot handle level changes (they are instantaneous) */
@@ -1700,143 +2452,86 @@ int Grow_restart(struct supertype *st, struct mdinfo *info, int *fdlist, int cnt
 		 * been used
 		 */
 		old_disks = cnt;
-	for (i=old_disks-(backup_file?1:0); i<cnt; i++) {
-		struct mdinfo dinfo;
-		int fd;
-		int bsbsize;
-		char *devname, namebuf[20];
-
-		/* This was a spare and may have some saved data on it.
-		 * Load the superblock, find and load the
-		 * backup_super_block.
-		 * If either fail, go on to next device.
-		 * If the backup contains no new info, just return
-		 * else restore data and update all superblocks
-		 */
-		if (i == old_disks-1) {
-			fd = open(backup_file, O_RDONLY);
-			if (fd<0) {
-				fprintf(stderr, Name ": backup file %s inaccessible: %s\n",
-					backup_file, strerror(errno));
-				continue;
-			}
-			devname = backup_file;
-		} else {
-			fd = fdlist[i];
-			if (fd < 0)
-				continue;
-			if (st->ss->load_super(st, fd, NULL))
-				continue;
 
-			st->ss->getinfo_super(st, &dinfo);
-			st->ss->free_super(st);
-
-			if (lseek64(fd,
-				    (dinfo.data_offset + dinfo.component_size - 8) <<9,
-				    0) < 0) {
-				fprintf(stderr, Name ": Cannot seek on device %d\n", i);
-				continue; /* Cannot seek */
+	/* Any spare, and the backup file, may have some saved data.
+	 * Probe them all at once - at boot there may be a lot of arrays
+	 * to get through - and use the newest backup that is valid and
+	 * still needed.
+	 */
+	first = old_disks-(backup_file?1:0);
+	nprobes = cnt > first ? cnt - first : 0;
+	probes = calloc(nprobes ? nprobes : 1, sizeof(*probes));
+	reqs = calloc(nprobes ? nprobes : 1, sizeof(*reqs));
+	if (!probes || !reqs) {
+		free(probes);
+		free(reqs);
+		return 1;
+	}
+	pool = nprobes > 1 ? io_pool_create(nprobes) : NULL;
+	for (i = 0; i < nprobes; i++) {
+		struct backup_probe *p = &probes[i];
+
+		p->info = info;
+		p->verbose = verbose;
+		if (first + i == old_disks-1) {
+			p->fd = open(backup_file, O_RDONLY);
+			if (p->fd < 0) {
+				snprintf(p->msg, sizeof(p->msg),
+					 "backup file %s inaccessible: %s",
+					 backup_file, strerror(errno));
+				p->loud = 1;
 			}
-			sprintf(namebuf, "device-%d", i);
-			devname = namebuf;
-		}
-		if (read(fd, &bsb, sizeof(bsb)) != sizeof(bsb)) {
-			if (verbose)
-				fprintf(stderr, Name ": Cannot read from %s\n", devname);
-			continue; /* Cannot read */
-		}
-		if (memcmp(bsb.magic, "md_backup_data-1", 16) != 0 &&
-		    memcmp(bsb.magic, "md_backup_data-2", 16) != 0) {
-			if (verbose)
-				fprintf(stderr, Name ": No backup metadata on %s\n", devname);
+			p->close_fd = 1;
+			p->devname = backup_file;
+		} else {
+			p->fd = fdlist[first + i];
+			sprintf(p->namebuf, "device-%d", first + i);
+			p->devname = p->namebuf;
+			p->st = dup_super(st);
+			if (!p->st)
+				p->fd = -1;
+		}
+		reqs[i].op = IO_CALL;
+		reqs[i].fn = probe_backup;
+		reqs[i].data = p;
+		io_pool_submit(pool, &reqs[i]);
+	}
+	io_pool_wait(pool);
+	io_pool_destroy(pool);
+	free(reqs);
+
+	best = NULL;
+	for (i = 0; i < nprobes; i++) {
+		struct backup_probe *p = &probes[i];
+		int fwd = info->delta_disks >= 0;
+
+		if (p->msg[0] && (p->loud || verbose))
+			fprintf(stderr, Name ": %s\n", p->msg);
+		free(p->st);
+		if (!p->ok)
 			continue;
-		}
-		if (bsb.sb_csum != bsb_csum((char*)&bsb, ((char*)&bsb.sb_csum)-((char*)&bsb))) {
-			if (verbose)
-				fprintf(stderr, Name ": Bad backup-metadata checksum on %s\n", devname);
-			continue; /* bad checksum */
-		}
-		if (memcmp(bsb.magic, "md_backup_data-2", 16) == 0 &&
-		    bsb.sb_csum2 != bsb_csum((char*)&bsb, ((char*)&bsb.sb_csum2)-((char*)&bsb))) {
-			if (verbose)
-				fprintf(stderr, Name ": Bad backup-metadata checksum2 on %s\n", devname);
-			continue; /* Bad second checksum */
-		}
-		if (memcmp(bsb.set_uuid,info->uuid, 16) != 0) {
-			if (verbose)
-				fprintf(stderr, Name ": Wrong uuid on backup-metadata on %s\n", devname);
-			continue; /* Wrong uuid */
-		}
-
-		/* array utime and backup-mtime should be updated at much the same time, but it seems that
-		 * sometimes they aren't... So allow considerable flexability in matching, and allow
-		 * this test to be overridden by an environment variable.
-		 */
-		if (info->array.utime > (int)__le64_to_cpu(bsb.mtime) + 2*60*60 ||
-		    info->array.utime < (int)__le64_to_cpu(bsb.mtime) - 10*60) {
-			if (check_env("MDADM_GROW_ALLOW_OLD")) {
-				fprintf(stderr, Name ": accepting backup with timestamp %lu "
-					"for array with timestamp %lu\n",
-					(unsigned long)__le64_to_cpu(bsb.mtime),
-					(unsigned long)info->array.utime);
-			} else {
-				if (verbose)
-					fprintf(stderr, Name ": too-old timestamp on "
-						"backup-metadata on %s\n", devname);
-				continue; /* time stamp is too bad */
-			}
-		}
+		if (!best ||
+		    __le64_to_cpu(p->bsb.mtime) > __le64_to_cpu(best->bsb.mtime) ||
+		    (__le64_to_cpu(p->bsb.mtime) == __le64_to_cpu(best->bsb.mtime) &&
+		     (fwd ? backup_reach(&p->bsb, 1) > backup_reach(&best->bsb, 1)
+		      : backup_reach(&p->bsb, 0) < backup_reach(&best->bsb, 0))))
+			best = p;
+	}
+	for (i = 0; i < nprobes; i++)
+		if (probes[i].close_fd && probes[i].fd >= 0 &&
+		    &probes[i] != best)
+			close(probes[i].fd);
+	if (!best)
+		free(probes);
+
+	if (best) {
+		struct mdinfo dinfo;
+		int fd = best->fd;
+		char *devname = best->devname;
+		int nslots, slot;
 
-		if (bsb.magic[15] == '1') {
-		if (info->delta_disks >= 0) {
-			/* reshape_progress is increasing */
-			if (__le64_to_cpu(bsb.arraystart) + __le64_to_cpu(bsb.length) <
-			    info->reshape_progress) {
-			nonew:
-				if (verbose)
-					fprintf(stderr, Name ": backup-metadata found on %s but is not needed\n", devname);
-				continue; /* No new data here */
-			}
-		} else {
-			/* reshape_progress is decreasing */
-			if (__le64_to_cpu(bsb.arraystart) >=
-			    info->reshape_progress)
-				goto nonew; /* No new data here */
-		}
-		} else {
-		if (info->delta_disks >= 0) {
-			/* reshape_progress is increasing */
-			if (__le64_to_cpu(bsb.arraystart) + __le64_to_cpu(bsb.length) <
-			    info->reshape_progress &&
-			    __le64_to_cpu(bsb.arraystart2) + __le64_to_cpu(bsb.length2) <
-			    info->reshape_progress)
-				goto nonew; /* No new data here */
-		} else {
-			/* reshape_progress is decreasing */
-			if (__le64_to_cpu(bsb.arraystart) >=
-			    info->reshape_progress &&
-			    __le64_to_cpu(bsb.arraystart2) >=
-			    info->reshape_progress)
-				goto nonew; /* No new data here */
-		}
-		}
-		if (lseek64(fd, __le64_to_cpu(bsb.devstart)*512, 0)< 0) {
-		second_fail:
-			if (verbose)
-				fprintf(stderr, Name ": Failed to verify secondary backup-metadata block on %s\n",
-					devname);
-			continue; /* Cannot seek */
-		}
-		/* There should be a duplicate backup superblock 4k before here */
-		if (lseek64(fd, -4096, 1) < 0 ||
-		    read(fd, &bsb2, sizeof(bsb2)) != sizeof(bsb2))
-			goto second_fail; /* Cannot find leading superblock */
-		if (bsb.magic[15] == '1')
-			bsbsize = offsetof(struct mdp_backup_super, pad1);
-		else
-			bsbsize = offsetof(struct mdp_backup_super, pad);
-		if (memcmp(&bsb2, &bsb, bsbsize) != 0)
-			goto second_fail; /* Cannot find leading superblock */
+		bsb = best->bsb;
+		nslots = bsb_nslots(&bsb);
 
 		/* Now need the data offsets for all devices. */
 		offsets = malloc(sizeof(*offsets)*info->array.raid_disks);
@@ -1850,56 +2545,62 @@ int Grow_restart(struct supertype *st, struct mdinfo *info, int *fdlist, int cnt
 			st->ss->free_super(st);
 			offsets[j] = dinfo.data_offset * 512;
 		}
-		printf(Name ": restoring critical section\n");
-
-		if (restore_stripes(fdlist, offsets,
-				    info->array.raid_disks,
-				    info->new_chunk,
-				    info->new_level,
-				    info->new_layout,
-				    fd, __le64_to_cpu(bsb.devstart)*512,
-				    __le64_to_cpu(bsb.arraystart)*512,
-				    __le64_to_cpu(bsb.length)*512)) {
-			/* didn't succeed, so giveup */
-			if (verbose)
-				fprintf(stderr, Name ": Error restoring backup from %s\n",
-					devname);
-			return 1;
-		}
-		
-		if (bsb.magic[15] == '2' &&
-		    restore_stripes(fdlist, offsets,
-				    info->array.raid_disks,
-				    info->new_chunk,
-				    info->new_level,
-				    info->new_layout,
-				    fd, __le64_to_cpu(bsb.devstart)*512 +
-				    __le64_to_cpu(bsb.devstart2)*512,
-				    __le64_to_cpu(bsb.arraystart2)*512,
-				    __le64_to_cpu(bsb.length2)*512)) {
-			/* didn't succeed, so giveup */
-			if (verbose)
-				fprintf(stderr, Name ": Error restoring second backup from %s\n",
-					devname);
+		if (!layout_supported(info->new_level, info->new_layout,
+				      info->array.raid_disks)) {
+			fprintf(stderr, Name ": unsupported layout %d for "
+				"RAID%d, cannot restore backup from %s\n",
+				info->new_layout, info->new_level, devname);
+			if (best->close_fd)
+				close(fd);
+			free(probes);
+			free(offsets);
 			return 1;
 		}
+		printf(Name ": restoring critical section\n");
 
+		for (slot = 0; slot < nslots; slot++) {
+			if (slot && !bsb_length(&bsb, slot))
+				continue;
+			if (restore_stripes(fdlist, offsets,
+					    info->array.raid_disks,
+					    info->new_chunk,
+					    info->new_level,
+					    info->new_layout,
+					    fd, __le64_to_cpu(bsb.devstart)*512 +
+					    slot * __le64_to_cpu(bsb.devstart2)*512,
+					    bsb_start(&bsb, slot)*512,
+					    bsb_length(&bsb, slot)*512)) {
+				/* didn't succeed, so giveup */
+				if (verbose)
+					fprintf(stderr, Name ": Error restoring backup section %d from %s\n",
+						slot, devname);
+				if (best->close_fd)
+					close(fd);
+				free(probes);
+				free(offsets);
+				return 1;
+			}
+		}
+		if (best->close_fd)
+			close(fd);
+		free(probes);
+		free(offsets);
 
 		/* Ok, so the data is restored. Let's update those superblocks. */
 
 		if (info->delta_disks >= 0) {
-			info->reshape_progress = __le64_to_cpu(bsb.arraystart) +
-				__le64_to_cpu(bsb.length);
-			if (bsb.magic[15] == '2') {
-				unsigned long long p2 = __le64_to_cpu(bsb.arraystart2) +
-					__le64_to_cpu(bsb.length2);
+			info->reshape_progress = bsb_start(&bsb, 0) +
+				bsb_length(&bsb, 0);
+			for (slot = 1; slot < nslots; slot++) {
+				unsigned long long p2 = bsb_start(&bsb, slot) +
+					bsb_length(&bsb, slot);
 				if (p2 > info->reshape_progress)
 					info->reshape_progress = p2;
 			}
 		} else {
-			info->reshape_progress = __le64_to_cpu(bsb.arraystart);
-			if (bsb.magic[15] == '2') {
-				unsigned long long p2 = __le64_to_cpu(bsb.arraystart2);
+			info->reshape_progress = bsb_start(&bsb, 0);
+			for (slot = 1; slot < nslots; slot++) {
+				unsigned long long p2 = bsb_start(&bsb, slot);
 				if (p2 < info->reshape_progress)
 					info->reshape_progress = p2;
 			}
@@ -1975,7 +2676,7 @@ int Grow_continue(int mdfd, struct supertype *st, struct mdinfo *info,
 	int backup_list[1];
 	unsigned long long backup_offsets[1];
 	int odisks, ndisks, ochunk, nchunk,odata,ndata;
-	unsigned long a,b,blocks,stripes;
+	unsigned long a,b,blocks,stripes,minstripes;
 	int backup_fd;
 	int *fds;
 	unsigned long long *offsets;
@@ -2022,6 +2723,7 @@ int Grow_continue(int mdfd, struct supertype *st, struct mdinfo *info,
 	}
 	/* LCM == product / GCD */
 	blocks = (ochunk/512) * (nchunk/512) * odata * ndata / a;
+	minstripes = blocks / (ochunk/512) / odata;
 
 	if (ndata == odata)
 		while (blocks * 32 < sra->component_size &&
@@ -2042,7 +2744,8 @@ int Grow_continue(int mdfd, struct supertype *st, struct mdinfo *info,
 			      cache+1);
 
 	memset(&bsb, 0, 512);
-	memcpy(bsb.magic, "md_backup_data-1", 16);
+	memcpy(bsb.magic, "md_backup_data-4", 16);
+	bsb.slots = __cpu_to_le32(1);
 	memcpy(&bsb.set_uuid, info->uuid, 16);
 	bsb.mtime = __cpu_to_le64(time(0));
 	bsb.devstart2 = blocks;
@@ -2078,6 +2781,7 @@ int Grow_continue(int mdfd, struct supertype *st, struct mdinfo *info,
 	case 0:
 		close(mdfd);
 		mlockall(MCL_FUTURE);
+		grow_stats_begin(backup_file);
 		if (info->delta_disks < 0)
 			done = child_shrink(-1, info, stripes,
 					    fds, offsets,
@@ -2093,7 +2797,7 @@ int Grow_continue(int mdfd, struct supertype *st, struct mdinfo *info,
 			 */
 			unsigned long long start = info->reshape_progress / ndata;
 			start /= (info->array.chunk_size/512);
-			done = child_same_size(-1, info, stripes,
+			done = child_same_size(-1, info, stripes, minstripes,
 					       fds, offsets,
 					       start,
 					       info->array.raid_disks,
@@ -2102,6 +2806,7 @@ int Grow_continue(int mdfd, struct supertype *st, struct mdinfo *info,
 					       odata,
 					       1, backup_list, backup_offsets);
 		}
+		grow_stats_end(info, done);
 		if (backup_file && done)
 			unlink(backup_file);
 		/* FIXME should I intuit a level change */
@@ -29,15 +29,196 @@
 #include	<signal.h>
 #include	<limits.h>
 #include	<syslog.h>
+#include	<dirent.h>
+#include	<poll.h>
+#include	<sys/resource.h>
 
 static void alert(char *event, char *dev, char *disc, char *mailaddr, char *mailfrom,
 		  char *cmd, int dosyslog);
+static void alert_flush(int wait);
+static int alert_wait(int period);
 
 /* The largest number of disks current arrays can manage is 384
  * This really should be dynamically, but that will have to wait
  * At least it isn't MD_SB_DISKS.
  */
 #define MaxDisks 384
+
+/* Between sweeps we wait for md to tell us something changed: it
+ * signals POLLPRI on /proc/mdstat, and on these sysfs attributes, which
+ * cover changes that don't show in /proc/mdstat.  Each array we look
+ * after has its attributes open, and 'fired' is set when one of them
+ * changes so the array is looked at again even though its mdstat
+ * entry is the same.  Watches stay WATCH_RESERVE descriptors below
+ * RLIMIT_NOFILE, so there are always enough left to open the arrays
+ * and run alerts.  Member attributes are given up first; arrays that
+ * still don't fit go unwatched, and are only noticed through
+ * /proc/mdstat.
+ */
+#define WATCH_RESERVE 64
+
+struct md_watch {
+	int *fds;
+	int cnt;
+	int fired;
+	struct md_watch *next;
+};
+static struct md_watch *watchlist;
+static int watch_fds;
+
+static int watch_budget(void)
+{
+	static int budget = -1;
+	struct rlimit rl;
+
+	if (budget < 0) {
+		if (getrlimit(RLIMIT_NOFILE, &rl) != 0)
+			rl.rlim_cur = 1024;
+		if (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > INT_MAX)
+			rl.rlim_cur = INT_MAX;
+		budget = (int)rl.rlim_cur - WATCH_RESERVE;
+		if (budget < 0)
+			budget = 0;
+	}
+	return budget;
+}
+
+static void watch_close(struct md_watch *w)
+{
+	while (w->cnt > 0) {
+		close(w->fds[--w->cnt]);
+		watch_fds--;
+	}
+}
+
+static void watch_add(struct md_watch *w, char *path, int max)
+{
+	char buf[64];
+	int fd;
+
+	if (w->cnt >= max || watch_fds >= watch_budget())
+		return;
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	/* sysfs only notifies once the attribute has been read */
+	if (pread(fd, buf, sizeof(buf), 0) < 0) {
+		close(fd);
+		return;
+	}
+	w->fds[w->cnt++] = fd;
+	watch_fds++;
+}
+
+static struct md_watch *watch_array(struct md_watch *w, int devnum)
+{
+	/* (Re)open the attributes for array 'devnum'.  Done just before
+	 * looking at the array, so any change after that will wake us.
+	 */
+	static char *attrs[] = { "array_state", "degraded", "sync_action" };
+	char dir[60], path[PATH_MAX];
+	char *name;
+	DIR *d;
+	struct dirent *de;
+	int max = 3;
+	unsigned int i;
+
+	if (!w) {
+		w = calloc(1, sizeof(*w));
+		if (!w)
+			return NULL;
+		w->next = watchlist;
+		watchlist = w;
+	}
+	watch_close(w);
+	w->fired = 0;
+	name = devnum2devname(devnum);
+	snprintf(dir, sizeof(dir), "/sys/block/%s/md", name);
+	free(name);
+	d = opendir(dir);
+	if (!d)
+		return w;
+	while ((de = readdir(d)) != NULL)
+		if (strncmp(de->d_name, "dev-", 4) == 0)
+			max++;
+	free(w->fds);
+	w->fds = malloc(max * sizeof(int));
+	if (!w->fds) {
+		closedir(d);
+		return w;
+	}
+	for (i = 0; i < sizeof(attrs)/sizeof(attrs[0]); i++) {
+		snprintf(path, sizeof(path), "%s/%s", dir, attrs[i]);
+		watch_add(w, path, max);
+	}
+	/* members too only while all watches fit in half the budget */
+	if (watch_fds + (max - 3) > watch_budget() / 2) {
+		closedir(d);
+		return w;
+	}
+	rewinddir(d);
+	while ((de = readdir(d)) != NULL)
+		if (strncmp(de->d_name, "dev-", 4) == 0) {
+			snprintf(path, sizeof(path), "%s/%s/state", dir,
+				 de->d_name);
+			watch_add(w, path, max);
+		}
+	closedir(d);
+	return w;
+}
+
+static int watch_wait(int seconds)
+{
+	/* Wait for /proc/mdstat or any watched attribute to change, or
+	 * for 'seconds' to pass.  Returns > 0 if something changed.
+	 */
+	static struct pollfd *pfd;
+	static int pfd_max;
+	struct md_watch *w;
+	int n = 0, i, rv;
+
+	for (w = watchlist; w; w = w->next)
+		n += w->cnt;
+	if (n + 1 > pfd_max) {
+		struct pollfd *p = realloc(pfd, (n + 1) * sizeof(*p));
+		if (!p)
+			return mdstat_wait(seconds);
+		pfd = p;
+		pfd_max = n + 1;
+	}
+	n = 0;
+	for (w = watchlist; w; w = w->next)
+		for (i = 0; i < w->cnt; i++) {
+			pfd[n].fd = w->fds[i];
+			pfd[n].events = POLLPRI;
+			pfd[n].revents = 0;
+			n++;
+		}
+	rv = mdstat_poll(pfd, n, seconds);
+	if (rv <= 0)
+		return rv;
+	n = 0;
+	for (w = watchlist; w; w = w->next)
+		for (i = 0; i < w->cnt; i++, n++)
+			/* watch_array() re-arms it when the array is
+			 * looked at
+			 */
+			if (pfd[n].revents)
+				w->fired = 1;
+	return rv;
+}
+
+/* Set by SIGTERM or SIGINT while we are changing sync speeds, so the
+ * main loop stops and puts them back before we go.
+ */
+static volatile sig_atomic_t stop_signal;
+
+static void monitor_stop(int sig)
+{
+	stop_signal = sig;
+}
+
 int Monitor(mddev_dev_t devlist,
 	    char *mailaddr, char *alert_cmd,
 	    int period, int daemonise, int scan, int oneshot,
@@ -59,6 +240,10 @@ int Monitor(mddev_dev_t devlist,
 	 * due to bugs in the md kernel module.
 	 * We also read /proc/mdstat to get rebuild percent,
 	 * and to get state on all active devices incase of kernel bug.
+	 * Once an array has been looked at, it is only looked at again
+	 * when its entry in /proc/mdstat changes (or while we are
+	 * throttling its resync), so a wake-up costs nothing for the
+	 * arrays it isn't about.
 	 *
 	 * Events are:
 	 *    Fail
@@ -96,12 +281,32 @@ int Monitor(mddev_dev_t devlist,
 		int devstate[MaxDisks];
 		unsigned devid[MaxDisks];
 		int percent;
+		struct throttle *throttle; /* while syncing, see throttle.c */
+		struct md_watch *watch;
+		time_t degraded_since;
 		struct state *next;
 	} *statelist = NULL;
 	int finished = 0;
+	struct mdstat_feed feed;
 	struct mdstat_ent *mdstat = NULL;
 	char *mailfrom = NULL;
+	/* Only keep sync out of the way of applications if asked,
+	 * and only if we will be around to undo it.
+	 */
+	unsigned long sync_latency = oneshot ? 0 : throttle_target(0);
+	int throttling;
+	struct metrics *metrics = metrics_open();
 
+	memset(&feed, 0, sizeof(feed));
+	feed.hold = !oneshot;
+	if (sync_latency) {
+		struct sigaction sa;
+
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = monitor_stop;
+		sigaction(SIGTERM, &sa, NULL);
+		sigaction(SIGINT, &sa, NULL);
+	}
 	if (!mailaddr) {
 		mailaddr = conf_get_mailaddr();
 		if (mailaddr && ! scan)
@@ -172,6 +377,9 @@ int Monitor(mddev_dev_t devlist,
 			st->err = 0;
 			st->devnum = INT_MAX;
 			st->percent = -2;
+			st->throttle = NULL;
+			st->watch = NULL;
+			st->degraded_since = 0;
 			st->expected_spares = mdlist->spare_disks;
 			if (mdlist->spare_group)
 				st->spare_group = strdup(mdlist->spare_group);
@@ -192,6 +400,9 @@ int Monitor(mddev_dev_t devlist,
 			st->err = 0;
 			st->devnum = INT_MAX;
 			st->percent = -2;
+			st->throttle = NULL;
+			st->watch = NULL;
+			st->degraded_since = 0;
 			st->expected_spares = -1;
 			st->spare_group = NULL;
 			if (mdlist) {
@@ -204,25 +415,47 @@ int Monitor(mddev_dev_t devlist,
 	}
 
 
-	while (! finished) {
+	while (! finished && !stop_signal) {
 		int new_found = 0;
 		struct state *st;
 
-		if (mdstat)
-			free_mdstat(mdstat);
-		mdstat = mdstat_read(oneshot?0:1, 0);
+		mdstat_feed_read(&feed);
+		mdstat = feed.now;
 
 		for (st=statelist; st; st=st->next) {
 			struct { int state, major, minor; } info[MaxDisks];
 			mdu_array_info_t array;
-			struct mdstat_ent *mse = NULL, *mse2;
+			struct mdstat_ent *mse = NULL;
 			char *dev = st->devname;
 			int fd;
 			int i;
 
 			if (test)
 				alert("TestMessage", dev, NULL, mailaddr, mailfrom, alert_cmd, dosyslog);
+			else if (st->utime && !st->err && !st->throttle &&
+				 !(st->watch && st->watch->fired) &&
+				 !mdstat_feed_find(&feed, st->devnum)) {
+				for (mse = mdstat; mse; mse = mse->next)
+					if (mse->devnum == st->devnum)
+						break;
+				if (mse)
+					/* nothing has changed */
+					continue;
+			}
+			/* reopened below if the array is still there */
+			if (st->watch) {
+				watch_close(st->watch);
+				st->watch->fired = 0;
+			}
 			fd = open(dev, O_RDONLY);
+			if (fd < 0 && (errno == EMFILE || errno == ENFILE)) {
+				/* that says nothing about the array: look
+				 * again next time
+				 */
+				if (st->watch)
+					st->watch->fired = 1;
+				continue;
+			}
 			if (fd < 0) {
 				if (!st->err)
 					alert("DeviceDisappeared", dev, NULL,
@@ -264,17 +497,36 @@ int Monitor(mddev_dev_t devlist,
 						st->devnum = -1- (minor(stb.st_rdev)>>6);
 				}
 			}
+			if (!oneshot && st->devnum != INT_MAX)
+				st->watch = watch_array(st->watch, st->devnum);
 
-			for (mse2 = mdstat ; mse2 ; mse2=mse2->next)
-				if (mse2->devnum == st->devnum) {
-					mse2->devnum = INT_MAX; /* flag it as "used" */
-					mse = mse2;
-				}
+			for (mse = mdstat ; mse ; mse = mse->next)
+				if (mse->devnum == st->devnum)
+					break;
 
 			if (array.utime == 0)
 				/* external arrays don't update utime */
 				array.utime = time(0);
 
+			if (sync_latency && mse && mse->percent >= 0 &&
+			    !st->throttle) {
+				/* A reshape is looked after by the mdadm
+				 * that started it.
+				 */
+				struct mdinfo *sra = sysfs_read(-1, st->devnum, 0);
+				char action[20];
+				if (sra &&
+				    sysfs_get_str(sra, NULL, "sync_action",
+						  action, sizeof(action)) > 0 &&
+				    strncmp(action, "reshape", 7) != 0)
+					st->throttle = throttle_start(sra->sys_name,
+								      sync_latency);
+				sysfs_free(sra);
+			} else if (st->throttle && (!mse || mse->percent < 0)) {
+				throttle_stop(st->throttle);
+				st->throttle = NULL;
+			}
+
 			if (st->utime == array.utime &&
 			    st->failed == array.failed_disks &&
 			    st->working == array.working_disks &&
@@ -408,12 +660,20 @@ int Monitor(mddev_dev_t devlist,
 			st->utime = array.utime;
 			st->raid = array.raid_disks;
 			st->err = 0;
+			if (st->active >= st->raid)
+				st->degraded_since = 0;
+			else if (!st->degraded_since)
+				st->degraded_since = time(0);
 		}
 		/* now check if there are any new devices found in mdstat */
 		if (scan) {
 			struct mdstat_ent *mse;
-			for (mse=mdstat; mse; mse=mse->next)
-				if (mse->devnum != INT_MAX &&
+			for (mse=mdstat; mse; mse=mse->next) {
+				struct state *st2;
+				for (st2 = statelist; st2; st2 = st2->next)
+					if (st2->devnum == mse->devnum)
+						break;
+				if (st2 == NULL &&
 				    mse->level &&
 				    (strcmp(mse->level, "raid0")!=0 &&
 				     strcmp(mse->level, "linear")!=0)
@@ -439,6 +699,9 @@ int Monitor(mddev_dev_t devlist,
 					st->err = 1;
 					st->devnum = mse->devnum;
 					st->percent = -2;
+					st->throttle = NULL;
+					st->watch = NULL;
+					st->degraded_since = 0;
 					st->spare_group = NULL;
 					st->expected_spares = -1;
 					statelist = st;
@@ -447,6 +710,7 @@ int Monitor(mddev_dev_t devlist,
 					alert("NewArray", st->devname, NULL, mailaddr, mailfrom, alert_cmd, dosyslog);
 					new_found = 1;
 				}
+			}
 		}
 		/* If an array has active < raid && spare == 0 && spare_group != NULL
 		 * Look for another array with spare > 0 and active == raid and same spare_group
@@ -506,31 +770,185 @@ int Monitor(mddev_dev_t devlist,
 						close(fd2);
 					}
 			}
+		if (metrics) {
+			for (st = statelist; st; st = st->next)
+				if (!st->err && st->utime &&
+				    st->devnum != INT_MAX)
+					metrics_array(metrics, st->devnum,
+						      st->active, st->working,
+						      st->failed, st->spare,
+						      st->raid,
+						      st->degraded_since ?
+						      time(0) - st->degraded_since
+						      : 0);
+			metrics_write(metrics);
+		}
+		alert_flush(0);
+		throttling = 0;
+		for (st = statelist; st; st = st->next)
+			if (st->throttle)
+				throttling = 1;
 		if (!new_found) {
 			if (oneshot)
 				break;
-			else
-				mdstat_wait(period);
+			else if (throttling) {
+				/* Adjust sync speeds every second until
+				 * something changes or it is time to look
+				 * at everything again.
+				 */
+				int waited;
+				for (waited = 0; waited < period && !stop_signal;
+				     waited++) {
+					if (watch_wait(1) > 0)
+						break;
+					for (st = statelist; st; st = st->next)
+						throttle_poll(st->throttle);
+					alert_flush(0);
+				}
+			} else
+				watch_wait(alert_wait(period));
 		}
 		test = 0;
 	}
+	alert_flush(1);
+	mdstat_feed_free(&feed);
+	metrics_close(metrics);
+	while (statelist) {
+		throttle_stop(statelist->throttle);
+		statelist->throttle = NULL;
+		statelist = statelist->next;
+	}
+	while (watchlist) {
+		struct md_watch *w = watchlist;
+		watchlist = w->next;
+		watch_close(w);
+		free(w->fds);
+		free(w);
+	}
 	if (pidfile)
 		unlink(pidfile);
+	if (stop_signal) {
+		signal(stop_signal, SIG_DFL);
+		raise(stop_signal);
+	}
 	return 0;
 }
 
 
-static void alert(char *event, char *dev, char *disc, char *mailaddr, char *mailfrom, char *cmd,
-		  int dosyslog)
+/* Running the alert program and sending mail can take a while, and
+ * must not hold up noticing the next change: when a controller dies
+ * every member fails at once.  So alert() only prints and logs, and
+ * queues the event.  The queue is handed to a child process which runs
+ * the program for each event in turn, as before, and sends one mail
+ * per array covering all of that array's events.  Events are collected
+ * for MDADM_ALERT_COALESCE seconds (default 0: just those found in one
+ * pass) and while the previous child is still busy, so a burst turns
+ * into one mail.  If more than ALERT_MAX are waiting the rest are
+ * counted but not kept.
+ */
+#define ALERT_MAX 256
+
+static struct {
+	struct alert_ev {
+		char *event, *dev, *disc;
+	} ev[ALERT_MAX];
+	int cnt;
+	int dropped;
+	time_t first;		/* when ev[0] was queued */
+	pid_t worker;		/* child sending the last lot, or 0 */
+	char *cmd, *mailaddr, *mailfrom;
+} aq;
+
+static int alert_window(void)
 {
-	int priority;
+	char *env = getenv("MDADM_ALERT_COALESCE");
+	char *ep;
+	long secs;
 
-	if (!cmd && !mailaddr) {
-		time_t now = time(0);
+	if (!env || !*env)
+		return 0;
+	secs = strtol(env, &ep, 10);
+	if (*ep || secs < 0)
+		return 0;
+	return secs;
+}
 
-		printf("%1.15s: %s on %s %s\n", ctime(&now)+4, event, dev, disc?disc:"unknown device");
+static int alert_mailable(char *event)
+{
+	return strncmp(event, "Fail", 4)==0 ||
+		strncmp(event, "Test", 4)==0 ||
+		strncmp(event, "Spares", 6)==0 ||
+		strncmp(event, "Degrade", 7)==0;
+}
+
+static void alert_mail(int first, int dropped)
+{
+	/* One message for the events in aq.ev[first..] on that device */
+	char *dev = aq.ev[first].dev;
+	FILE *mp = popen(Sendmail, "w");
+	FILE *mdstat;
+	char hname[256];
+	int i, cnt = 0;
+
+	if (!mp)
+		return;
+	for (i = first; i < aq.cnt; i++)
+		if (strcmp(aq.ev[i].dev, dev) == 0 &&
+		    alert_mailable(aq.ev[i].event))
+			cnt++;
+	gethostname(hname, sizeof(hname));
+	signal(SIGPIPE, SIG_IGN);
+	if (aq.mailfrom)
+		fprintf(mp, "From: %s\n", aq.mailfrom);
+	else
+		fprintf(mp, "From: " Name " monitoring <root>\n");
+	fprintf(mp, "To: %s\n", aq.mailaddr);
+	if (cnt == 1)
+		fprintf(mp, "Subject: %s event on %s:%s\n\n",
+			aq.ev[first].event, dev, hname);
+	else
+		fprintf(mp, "Subject: %d events on %s:%s\n\n", cnt, dev, hname);
+
+	fprintf(mp, "This is an automatically generated mail message from " Name "\n");
+	fprintf(mp, "running on %s\n\n", hname);
+
+	for (i = first; i < aq.cnt; i++) {
+		char *disc = aq.ev[i].disc;
+		if (strcmp(aq.ev[i].dev, dev) != 0 ||
+		    !alert_mailable(aq.ev[i].event))
+			continue;
+		fprintf(mp, "A %s event had been detected on md device %s.\n\n",
+			aq.ev[i].event, dev);
+
+		if (disc && disc[0] != ' ')
+			fprintf(mp, "It could be related to component device %s.\n\n", disc);
+		if (disc && disc[0] == ' ')
+			fprintf(mp, "Extra information:%s.\n\n", disc);
+	}
+	if (dropped)
+		fprintf(mp, "%d more events, on this or other devices, came too "
+			"fast to be recorded.\n\n", dropped);
+
+	fprintf(mp, "Faithfully yours, etc.\n");
+
+	mdstat = fopen("/proc/mdstat", "r");
+	if (mdstat) {
+		char buf[8192];
+		int n;
+		fprintf(mp, "\nP.S. The /proc/mdstat file currently contains the following:\n\n");
+		while ( (n=fread(buf, 1, sizeof(buf), mdstat)) > 0)
+			n=fwrite(buf, 1, n, mp); /* yes, i don't care about the result */
+		fclose(mdstat);
 	}
-	if (cmd) {
+	pclose(mp);
+}
+
+static void alert_send(void)
+{
+	/* Deliver everything queued, in order */
+	int i, j;
+
+	for (i = 0; aq.cmd && i < aq.cnt; i++) {
 		int pid = fork();
 		switch(pid) {
 		default:
@@ -539,52 +957,116 @@ static void alert(char *event, char *dev, char *disc, char *mailaddr, char *mail
 		case -1:
 			break;
 		case 0:
-			execl(cmd, cmd, event, dev, disc, NULL);
+			execl(aq.cmd, aq.cmd, aq.ev[i].event, aq.ev[i].dev,
+			      aq.ev[i].disc, NULL);
 			exit(2);
 		}
 	}
-	if (mailaddr &&
-	    (strncmp(event, "Fail", 4)==0 ||
-	     strncmp(event, "Test", 4)==0 ||
-	     strncmp(event, "Spares", 6)==0 ||
-	     strncmp(event, "Degrade", 7)==0)) {
-		FILE *mp = popen(Sendmail, "w");
-		if (mp) {
-			FILE *mdstat;
-			char hname[256];
-			gethostname(hname, sizeof(hname));
-			signal(SIGPIPE, SIG_IGN);
-			if (mailfrom)
-				fprintf(mp, "From: %s\n", mailfrom);
-			else
-				fprintf(mp, "From: " Name " monitoring <root>\n");
-			fprintf(mp, "To: %s\n", mailaddr);
-			fprintf(mp, "Subject: %s event on %s:%s\n\n", event, dev, hname);
-
-			fprintf(mp, "This is an automatically generated mail message from " Name "\n");
-			fprintf(mp, "running on %s\n\n", hname);
-
-			fprintf(mp, "A %s event had been detected on md device %s.\n\n", event, dev);
-
-			if (disc && disc[0] != ' ')
-				fprintf(mp, "It could be related to component device %s.\n\n", disc);
-			if (disc && disc[0] == ' ')
-				fprintf(mp, "Extra information:%s.\n\n", disc);
-
-			fprintf(mp, "Faithfully yours, etc.\n");
-
-			mdstat = fopen("/proc/mdstat", "r");
-			if (mdstat) {
-				char buf[8192];
-				int n;
-				fprintf(mp, "\nP.S. The /proc/mdstat file currently contains the following:\n\n");
-				while ( (n=fread(buf, 1, sizeof(buf), mdstat)) > 0)
-					n=fwrite(buf, 1, n, mp); /* yes, i don't care about the result */
-				fclose(mdstat);
+	if (!aq.mailaddr)
+		return;
+	/* a mail for each device, in the order they first appear */
+	for (i = 0; i < aq.cnt; i++) {
+		if (!alert_mailable(aq.ev[i].event))
+			continue;
+		for (j = 0; j < i; j++)
+			if (alert_mailable(aq.ev[j].event) &&
+			    strcmp(aq.ev[j].dev, aq.ev[i].dev) == 0)
+				break;
+		if (j == i)
+			alert_mail(i, aq.dropped);
+	}
+}
+
+static void alert_flush(int wait)
+{
+	/* Hand the queue to a child if it is time and the last one has
+	 * finished.  With 'wait', send everything now and wait for it.
+	 */
+	int i;
+	pid_t pid;
+
+	if (aq.worker) {
+		if (waitpid(aq.worker, NULL, wait ? 0 : WNOHANG) == 0)
+			return;
+		aq.worker = 0;
+	}
+	if (!aq.cnt)
+		return;
+	if (!wait && time(0) < aq.first + alert_window())
+		return;
+
+	fflush(NULL);
+	pid = fork();
+	switch (pid) {
+	case 0:
+		alert_send();
+		_exit(0);
+	case -1:
+		/* do it ourselves then */
+		alert_send();
+		break;
+	default:
+		if (wait)
+			waitpid(pid, NULL, 0);
+		else
+			aq.worker = pid;
+	}
+	for (i = 0; i < aq.cnt; i++) {
+		free(aq.ev[i].event);
+		free(aq.ev[i].dev);
+		free(aq.ev[i].disc);
+	}
+	aq.cnt = 0;
+	aq.dropped = 0;
+}
+
+static int alert_wait(int period)
+{
+	/* How long we may wait before alert_flush() has work to do */
+	int left;
+
+	if (aq.worker)
+		/* check on it every second */
+		return 1;
+	if (!aq.cnt)
+		return period;
+	left = aq.first + alert_window() - time(0);
+	if (left < 1)
+		left = 1;
+	return left < period ? left : period;
+}
+
+static void alert(char *event, char *dev, char *disc, char *mailaddr, char *mailfrom, char *cmd,
+		  int dosyslog)
+{
+	int priority;
+
+	if (!cmd && !mailaddr) {
+		time_t now = time(0);
+
+		printf("%1.15s: %s on %s %s\n", ctime(&now)+4, event, dev, disc?disc:"unknown device");
+	}
+	if (cmd || (mailaddr && alert_mailable(event))) {
+		aq.cmd = cmd;
+		aq.mailaddr = mailaddr;
+		aq.mailfrom = mailfrom;
+		if (aq.cnt >= ALERT_MAX)
+			aq.dropped++;
+		else {
+			struct alert_ev *ev = &aq.ev[aq.cnt];
+			if (aq.cnt++ == 0)
+				aq.first = time(0);
+			ev->event = strdup(event);
+			ev->dev = strdup(dev);
+			ev->disc = disc ? strdup(disc) : NULL;
+			if (!ev->event || !ev->dev) {
+				free(ev->event);
+				free(ev->dev);
+				free(ev->disc);
+				aq.cnt--;
+				aq.dropped++;
 			}
-			pclose(mp);
 		}
-
 	}
 
 	/* log the event to syslog maybe */
@@ -110,6 +110,8 @@ struct option long_options[] = {
     {"detail-platform", 0, 0, DetailPlatform},
     {"kill-subarray", 1, 0, KillSubarray},
     {"update-subarray", 1, 0, UpdateSubarray},
+    {"scrub",     0, 0, ScrubArray},
+    {"copy-to",   1, 0, CopyArray},
 
     /* synonyms */
     {"monitor",   0, 0, 'F'},
@@ -167,6 +169,7 @@ struct option long_options[] = {
     {"no-degraded",0,0,  NoDegraded },
     {"wait",	  0, 0, 'W'},
     {"wait-clean", 0, 0, Waitclean },
+    {"scrub-range", 1, 0, ScrubRange},
 
     /* For Detail/Examine */
     {"brief",	  0, 0, 'b'},
@@ -481,6 +484,11 @@ char Help_misc[] =
 "  --readwrite   -w   : mark array as readwrite\n"
 "  --test        -t   : exit status 0 if ok, 1 if degrade, 2 if dead, 4 if missing\n"
 "  --wait        -W   : wait for resync/rebuild/recovery to finish\n"
+"  --scrub            : check parity by reading the components directly and\n"
+"                       report which device holds any inconsistent block\n"
+"  --scrub-range=     : START[:LENGTH] of the array to scrub, as for --size\n"
+"  --copy-to=         : copy the whole array to a file or device, with several\n"
+"                       large reads and writes in flight\n"
 ;
 
 char Help_monitor[] =
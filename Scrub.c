@@ -0,0 +1,298 @@
+/*
+ * mdadm - manage Linux "md" devices aka RAID arrays.
+ *
+ * Copyright (C) 2010 Neil Brown <neilb@suse.de>
+ *
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *    Author: Neil Brown
+ *    Email: <neilb@suse.de>
+ */
+
+/*
+ * Scrub some or all of a RAID4/5/6 array from user-space.
+ * The kernel's "check" only counts mismatches.  Here we read the
+ * members directly, one window at a time with that window suspended
+ * (suspend_lo/suspend_hi) so that nothing can change under us, and
+ * report each inconsistent stripe and, for RAID6, which member holds
+ * the bad block.  Windows are kept small so that normal I/O to the
+ * array is only held up briefly, and we report the rate achieved so
+ * hot regions can be scrubbed on their own.
+ */
+
+#include	"mdadm.h"
+#include	<sys/time.h>
+#include	<signal.h>
+
+/* bytes read from each member per window */
+#define SCRUB_WINDOW (4*1024*1024)
+
+static volatile int scrub_stop;
+
+static void scrub_sig(int sig)
+{
+	scrub_stop = 1;
+}
+
+int Scrub(char *devname, char *range, int verbose)
+{
+	/* Returns:
+	 *  0 - every stripe checked was consistent
+	 *  1 - at least one inconsistent stripe was found
+	 *  2 - the scrub could not be performed or was interrupted
+	 */
+	int fd;
+	struct mdinfo *sra, *sd;
+	int level, layout, chunk, raid_disks, data_disks;
+	int *fdlist = NULL;
+	unsigned long long *offsets = NULL;
+	char **names = NULL;
+	unsigned long long stripe_bytes, array_bytes, window;
+	unsigned long long start, end, pos;
+	unsigned long long usec = 0;
+	unsigned long long t0, t1;
+	char buf[40];
+	int mismatches = 0;
+	int suspended = 0;
+	int rv = 2;
+	int d;
+
+	fd = open_mddev(devname, 1);
+	if (fd < 0)
+		return 2;
+	sra = sysfs_read(fd, 0, GET_LEVEL|GET_LAYOUT|GET_CHUNK|GET_DISKS|
+			 GET_COMPONENT|GET_DEVS|GET_OFFSET|GET_STATE|
+			 GET_DEGRADED);
+	close(fd);
+	if (!sra) {
+		fprintf(stderr, Name ": %s: Cannot get array details from sysfs\n",
+			devname);
+		return 2;
+	}
+	level = sra->array.level;
+	layout = sra->array.layout;
+	chunk = sra->array.chunk_size;
+	raid_disks = sra->array.raid_disks;
+	if (level < 4 || level > 6) {
+		fprintf(stderr, Name ": %s: can only scrub RAID4, RAID5 or RAID6\n",
+			devname);
+		goto out;
+	}
+	if (!layout_supported(level, layout, raid_disks)) {
+		fprintf(stderr, Name ": %s: unsupported layout %d for RAID%d, "
+			"cannot scrub\n", devname, layout, level);
+		goto out;
+	}
+	if (sra->array.failed_disks) {
+		fprintf(stderr, Name ": %s: array is degraded, cannot scrub\n",
+			devname);
+		goto out;
+	}
+	if (sysfs_get_str(sra, NULL, "sync_action", buf, sizeof(buf)) <= 0 ||
+	    strncmp(buf, "idle", 4) != 0) {
+		fprintf(stderr, Name ": %s: resync or reshape in progress, "
+			"cannot scrub\n", devname);
+		goto out;
+	}
+	data_disks = raid_disks - (level == 6 ? 2 : 1);
+	stripe_bytes = (unsigned long long)chunk * data_disks;
+	array_bytes = sra->component_size / (chunk/512) * stripe_bytes;
+
+	start = 0;
+	end = array_bytes;
+	if (range) {
+		/* START[:LENGTH], as for --size */
+		char sbuf[40];
+		char *c = strchr(range, ':');
+		long long s, l = 0;
+
+		if (c && c - range < (int)sizeof(sbuf)) {
+			strncpy(sbuf, range, c - range);
+			sbuf[c - range] = 0;
+			c++;
+			l = parse_size(c);
+		} else if (c)
+			sbuf[0] = 0;
+		else {
+			strncpy(sbuf, range, sizeof(sbuf)-1);
+			sbuf[sizeof(sbuf)-1] = 0;
+		}
+		s = parse_size(sbuf);
+		if (s < 0 || (s == 0 && strcmp(sbuf, "0") != 0)) {
+			fprintf(stderr, Name ": invalid scrub start: %s\n", range);
+			goto out;
+		}
+		if (c && l <= 0) {
+			fprintf(stderr, Name ": invalid scrub length: %s\n", c);
+			goto out;
+		}
+		/* round out to whole stripes */
+		start = s * 512ULL / stripe_bytes * stripe_bytes;
+		if (c && s * 512ULL + l * 512ULL < end)
+			end = (s * 512ULL + l * 512ULL + stripe_bytes - 1)
+				/ stripe_bytes * stripe_bytes;
+		if (start >= end) {
+			fprintf(stderr, Name ": %s: scrub range is beyond the "
+				"end of the array\n", devname);
+			goto out;
+		}
+	}
+
+	fdlist = malloc(raid_disks * sizeof(int));
+	offsets = malloc(raid_disks * sizeof(offsets[0]));
+	names = calloc(raid_disks, sizeof(char*));
+	if (!fdlist || !offsets || !names) {
+		fprintf(stderr, Name ": malloc failed: scrub aborted\n");
+		goto out;
+	}
+	for (d = 0; d < raid_disks; d++)
+		fdlist[d] = -1;
+	for (sd = sra->devs; sd; sd = sd->next) {
+		char *dn;
+		int rd = sd->disk.raid_disk;
+
+		if (sd->disk.state & (1<<MD_DISK_FAULTY))
+			continue;
+		if (!(sd->disk.state & (1<<MD_DISK_SYNC)) ||
+		    rd < 0 || rd >= raid_disks)
+			continue;
+		dn = map_dev(sd->disk.major, sd->disk.minor, 1);
+		/* O_DIRECT: the member's page cache knows nothing of
+		 * what md has written to it
+		 */
+		fdlist[rd] = dev_open(dn, O_RDONLY|O_DIRECT);
+		if (fdlist[rd] < 0) {
+			fprintf(stderr, Name ": %s: cannot open component %s\n",
+				devname, dn ? dn : "-unknown-");
+			goto out;
+		}
+		offsets[rd] = sd->data_offset * 512;
+		names[rd] = strdup(dn ? dn : "-unknown-");
+	}
+	for (d = 0; d < raid_disks; d++)
+		if (fdlist[d] < 0) {
+			fprintf(stderr, Name ": %s: raid disk %d is missing, "
+				"cannot scrub\n", devname, d);
+			goto out;
+		}
+
+	window = SCRUB_WINDOW / chunk * stripe_bytes;
+	if (window < stripe_bytes)
+		window = stripe_bytes;
+
+	/* An interrupted scrub must not leave the array suspended */
+	signal(SIGINT, scrub_sig);
+	signal(SIGTERM, scrub_sig);
+	signal(SIGHUP, scrub_sig);
+
+	rv = 0;
+	for (pos = start; pos < end; pos += window) {
+		struct stripe_mismatch *found;
+		unsigned long long len = window;
+		int cnt, i;
+
+		if (scrub_stop) {
+			fprintf(stderr, Name ": %s: scrub interrupted at %lluK\n",
+				devname, pos/1024);
+			rv = 2;
+			break;
+		}
+		if (len > end - pos)
+			len = end - pos;
+
+		if (sysfs_set_num(sra, NULL, "suspend_lo", pos/512) < 0 ||
+		    sysfs_set_num(sra, NULL, "suspend_hi", (pos+len)/512) < 0) {
+			fprintf(stderr, Name ": %s: cannot suspend I/O to "
+				"the array, cannot scrub\n", devname);
+			rv = 2;
+			break;
+		}
+		suspended = 1;
+
+		t0 = now_usec();
+		cnt = check_stripes(fdlist, offsets, raid_disks, chunk,
+				    level, layout, pos, len,
+				    raid_disks, &found);
+		t1 = now_usec();
+		usec += t1 - t0;
+		if (cnt < 0) {
+			fprintf(stderr, Name ": %s: failed to read components "
+				"at %lluK\n", devname, pos/1024);
+			rv = 2;
+			break;
+		}
+
+		for (i = 0; i < cnt; i++) {
+			unsigned long long sector =
+				found[i].stripe * (stripe_bytes/512);
+			int bd = found[i].disk;
+
+			if (bd >= 0)
+				fprintf(stderr, Name ": %s: stripe at sector %llu "
+					"inconsistent, bad block on %s "
+					"(raid disk %d)\n", devname, sector,
+					names[bd], bd);
+			else
+				fprintf(stderr, Name ": %s: stripe at sector %llu "
+					"inconsistent, %s\n", devname, sector,
+					level == 6 ? "cannot locate bad block"
+					: "parity does not match");
+		}
+		free(found);
+		mismatches += cnt;
+		if (verbose > 0)
+			fprintf(stderr, Name ": %s: checked %lluK-%lluK at "
+				"%llu MB/s\n", devname, pos/1024,
+				(pos+len)/1024,
+				len / data_disks * raid_disks /
+				(t1 - t0 + 1));
+	}
+
+	if (suspended) {
+		sysfs_set_num(sra, NULL, "suspend_hi", 0);
+		sysfs_set_num(sra, NULL, "suspend_lo", 0);
+	}
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGHUP, SIG_DFL);
+
+	if (mismatches && rv == 0)
+		rv = 1;
+	if (verbose >= 0 && pos > start) {
+		/* rate is over the bytes read from all members */
+		unsigned long long done = (pos < end ? pos : end) - start;
+		unsigned long long read = done / data_disks * raid_disks;
+
+		printf("%s: scrubbed %lluK in %llu.%03llu seconds, "
+		       "%llu MB/s, %d inconsistent stripe%s\n",
+		       devname, done/1024, usec/1000000, (usec/1000)%1000,
+		       read / (usec + 1), mismatches,
+		       mismatches == 1 ? "" : "s");
+	}
+out:
+	if (fdlist)
+		for (d = 0; d < raid_disks; d++)
+			if (fdlist[d] >= 0)
+				close(fdlist[d]);
+	if (names)
+		for (d = 0; d < raid_disks; d++)
+			free(names[d]);
+	free(names);
+	free(fdlist);
+	free(offsets);
+	sysfs_free(sra);
+	return rv;
+}
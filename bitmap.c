@@ -73,6 +73,23 @@ typedef struct bitmap_info_s {
 	unsigned long long dirty_bits;
 } bitmap_info_t;
 
+/* Where the dirty bits are: runs of set bits are gathered into extents
+ * as the bitmap is read, and each is counted and passed to 'found' if
+ * that is set.
+ */
+#define DIRTY_BANDS 16
+#define NO_RUN (~0ULL)
+struct dirty_map {
+	unsigned long long total_bits;
+	unsigned long long run;		/* first bit of the open run, or NO_RUN */
+	unsigned long long extents, largest;
+	unsigned long long band[DIRTY_BANDS];	/* dirty bits in each band */
+	unsigned long long lengths[64];	/* extents by log2(length) */
+	void (*found)(struct dirty_map *m, unsigned long long start,
+		      unsigned long long len);
+	void *data;
+};
+
 /* count the dirty bits in the first num_bits of byte */
 inline int count_dirty_bits_byte(char byte, int num_bits)
 {
@@ -93,15 +110,175 @@ inline int count_dirty_bits_byte(char byte, int num_bits)
 	return num;
 }
 
-int count_dirty_bits(char *buf, int num_bits)
+/* Counting the whole bitmap of a large array with a small chunk size
+ * a bit at a time takes far too long, so whole bytes are counted by
+ * the fastest population count this CPU has: AVX-512 VPOPCNTQ, a
+ * nibble lookup with AVX2, the POPCNT instruction, or the compiler's
+ * own __builtin_popcountll(), as chosen by impl_pick().
+ */
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && __GNUC__ >= 5
+#define HAVE_X86_POPCNT 1
+#include <immintrin.h>
+#if __GNUC__ >= 8
+#define HAVE_X86_VPOPCNT 1
+#endif
+#endif
+
+typedef unsigned long long (*popcount_fn)(const unsigned char *buf, size_t len);
+
+static unsigned long long popcount_byte(const unsigned char *buf, size_t len)
 {
-	int i, num = 0;
+	unsigned long long num = 0;
+	size_t i;
 
-	for (i=0; i < num_bits / 8; i++)
+	for (i = 0; i < len; i++)
 		num += count_dirty_bits_byte(buf[i], 8);
+	return num;
+}
+
+static unsigned long long popcount_word(const unsigned char *buf, size_t len)
+{
+	unsigned long long num = 0;
+	uint64_t w;
+
+	for (; len >= 8; buf += 8, len -= 8) {
+		memcpy(&w, buf, 8);
+		num += __builtin_popcountll(w);
+	}
+	while (len--)
+		num += __builtin_popcount(*buf++);
+	return num;
+}
+
+#ifdef HAVE_X86_POPCNT
+__attribute__((target("popcnt")))
+static unsigned long long popcount_popcnt(const unsigned char *buf, size_t len)
+{
+	unsigned long long num = 0;
+	uint64_t w[4];
+
+	for (; len >= 32; buf += 32, len -= 32) {
+		memcpy(w, buf, 32);
+		num += __builtin_popcountll(w[0]) + __builtin_popcountll(w[1]) +
+			__builtin_popcountll(w[2]) + __builtin_popcountll(w[3]);
+	}
+	return num + popcount_word(buf, len);
+}
+
+__attribute__((target("avx2")))
+static unsigned long long popcount_avx2(const unsigned char *buf, size_t len)
+{
+	/* count each nibble with a 16-entry table, then sum the bytes */
+	const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3,
+					       1, 2, 2, 3, 2, 3, 3, 4,
+					       0, 1, 1, 2, 1, 2, 2, 3,
+					       1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i low = _mm256_set1_epi8(0x0f);
+	__m256i acc = _mm256_setzero_si256();
+	uint64_t part[4];
+
+	for (; len >= 32; buf += 32, len -= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)buf);
+		__m256i lo = _mm256_and_si256(v, low);
+		__m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low);
+		__m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(table, lo),
+					      _mm256_shuffle_epi8(table, hi));
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(cnt,
+						_mm256_setzero_si256()));
+	}
+	_mm256_storeu_si256((__m256i *)part, acc);
+	return part[0] + part[1] + part[2] + part[3] +
+		popcount_word(buf, len);
+}
+
+static int have_popcnt(void) { return __builtin_cpu_supports("popcnt"); }
+static int have_avx2(void) { return __builtin_cpu_supports("avx2"); }
+#endif
+
+#ifdef HAVE_X86_VPOPCNT
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static unsigned long long popcount_avx512(const unsigned char *buf, size_t len)
+{
+	__m512i acc = _mm512_setzero_si512();
+
+	for (; len >= 64; buf += 64, len -= 64)
+		acc = _mm512_add_epi64(acc,
+			_mm512_popcnt_epi64(_mm512_loadu_si512(buf)));
+	return _mm512_reduce_add_epi64(acc) + popcount_word(buf, len);
+}
+
+static int have_vpopcnt(void)
+{
+	return __builtin_cpu_supports("avx512f") &&
+		__builtin_cpu_supports("avx512vpopcntdq");
+}
+#endif
+
+static struct popcount_template {
+	struct impl impl;
+	popcount_fn fn;
+} popcount_templates[] = {
+	/* Best first.  The last entry must always be usable. */
+#ifdef HAVE_X86_VPOPCNT
+	{ { "avx512", have_vpopcnt }, popcount_avx512 },
+#endif
+#ifdef HAVE_X86_POPCNT
+	{ { "avx2", have_avx2 }, popcount_avx2 },
+	{ { "popcnt", have_popcnt }, popcount_popcnt },
+#endif
+	{ { "word64", NULL }, popcount_word },
+	{ { "byte", NULL }, popcount_byte },
+	{ { NULL, NULL }, NULL }
+};
+
+static popcount_fn popcount_impl;
+
+static int popcount_check(void *entry)
+{
+	/* Compare 'entry' with the byte count over awkward lengths
+	 * and alignments.  Return 0 if they always agree.
+	 */
+	popcount_fn fn = ((struct popcount_template *)entry)->fn;
+	static const int sizes[] = { 0, 1, 7, 33, 64, 200, 4096+77 };
+	enum { LEN = 4096+77+8 };
+	unsigned char *mem = malloc(LEN);
+	unsigned int seed = 1;
+	int rv = 0;
+	int i, s, a;
+
+	if (!mem)
+		return -1;
+	for (i = 0; i < LEN; i++) {
+		seed = seed * 1103515245 + 12345;
+		mem[i] = seed >> 16;
+	}
+	for (s = 0; s < (int)(sizeof(sizes)/sizeof(sizes[0])) && rv == 0; s++)
+		for (a = 0; a < 8 && rv == 0; a++)
+			if (fn(mem + a, sizes[s]) !=
+			    popcount_byte(mem + a, sizes[s]))
+				rv = -1;
+	free(mem);
+	return rv;
+}
+
+static void popcount_init(void)
+{
+	struct popcount_template *t = impl_pick(popcount_templates, sizeof(*t),
+						popcount_check);
+
+	popcount_impl = t->fn;
+}
+
+int count_dirty_bits(char *buf, int num_bits)
+{
+	int num;
+
+	if (!popcount_impl)
+		popcount_init();
+	num = popcount_impl((unsigned char *)buf, num_bits / 8);
 
 	if (num_bits % 8) /* not an even byte boundary */
-		num += count_dirty_bits_byte(buf[i], num_bits % 8);
+		num += count_dirty_bits_byte(buf[num_bits / 8], num_bits % 8);
 
 	return num;
 }
@@ -122,7 +299,67 @@ unsigned long bitmap_sectors(struct bitmap_super_s *bsb)
 }
 
 
-bitmap_info_t *bitmap_fd_read(int fd, int brief)
+static void dirty_map_extent(struct dirty_map *m, unsigned long long end)
+{
+	unsigned long long len = end - m->run;
+	int b = 0;
+
+	while (len >> (b+1))
+		b++;
+	m->extents++;
+	m->lengths[b]++;
+	if (len > m->largest)
+		m->largest = len;
+	if (m->found)
+		m->found(m, m->run, len);
+	m->run = NO_RUN;
+}
+
+static void dirty_map_bits(struct dirty_map *m, unsigned char *buf,
+			   unsigned long long first, unsigned long long nbits)
+{
+	/* Add bits first..first+nbits-1, held in 'buf', to the map.
+	 * Whole words that are clean outside a run, or dirty inside
+	 * one, are skipped over.
+	 */
+	unsigned long long i = 0;
+	unsigned long long per_band = (m->total_bits + DIRTY_BANDS - 1)
+		/ DIRTY_BANDS;
+
+	while (i < nbits) {
+		unsigned long long pos = first + i;
+		int dirty;
+
+		if ((i & 63) == 0 && nbits - i >= 64) {
+			uint64_t w;
+			memcpy(&w, buf + i/8, 8);
+			w = __le64_to_cpu(w);
+			if (w == 0 && m->run == NO_RUN) {
+				i += 64;
+				continue;
+			}
+			if (w == ~0ULL && m->run != NO_RUN &&
+			    pos / per_band == (pos + 63) / per_band) {
+				m->band[pos / per_band] += 64;
+				i += 64;
+				continue;
+			}
+		}
+		dirty = (buf[i/8] >> (i%8)) & 1;
+		if (dirty) {
+			m->band[pos / per_band]++;
+			if (m->run == NO_RUN)
+				m->run = pos;
+		} else if (m->run != NO_RUN)
+			dirty_map_extent(m, pos);
+		i++;
+	}
+}
+
+/* The bitmap of a large array is read this much at a time */
+#define BITMAP_READ_SIZE (1024*1024)
+
+bitmap_info_t *bitmap_fd_read(int fd, int brief, struct dirty_map *map)
 {
 	/* Note: fd might be open O_DIRECT, so we must be
 	 * careful to align reads properly
@@ -130,13 +367,15 @@ bitmap_info_t *bitmap_fd_read(int fd, int brief)
 	unsigned long long total_bits = 0, read_bits = 0, dirty_bits = 0;
 	bitmap_info_t *info;
 	void *buf;
-	unsigned int n, skip;
+	int n, skip;
 
-	if (posix_memalign(&buf, 512, 8192) != 0) {
-		fprintf(stderr, Name ": failed to allocate 8192 bytes\n");
+	if (posix_memalign(&buf, 4096, BITMAP_READ_SIZE) != 0) {
+		fprintf(stderr, Name ": failed to allocate %d bytes\n",
+			BITMAP_READ_SIZE);
 		return NULL;
 	}
-	n = read(fd, buf, 8192);
+	/* Only the superblock is wanted if 'brief' */
+	n = read(fd, buf, brief ? 4096 : BITMAP_READ_SIZE);
 
 	info = malloc(sizeof(*info));
 	if (info == NULL) {
@@ -147,13 +386,15 @@ bitmap_info_t *bitmap_fd_read(int fd, int brief)
 		fprintf(stderr, Name ": failed to allocate %zd bytes\n",
 				sizeof(*info));
 #endif
+		free(buf);
 		return NULL;
 	}
 
-	if (n < sizeof(info->sb)) {
+	if (n < (int)sizeof(info->sb)) {
 		fprintf(stderr, Name ": failed to read superblock of bitmap "
 			"file: %s\n", strerror(errno));
 		free(info);
+		free(buf);
 		return NULL;
 	}
 	memcpy(&info->sb, buf, sizeof(info->sb));
@@ -172,20 +413,28 @@ bitmap_info_t *bitmap_fd_read(int fd, int brief)
 	 *    data in the file
 	 */
 	total_bits = bitmap_bits(info->sb.sync_size, info->sb.chunksize);
+	if (map) {
+		map->total_bits = total_bits;
+		map->run = NO_RUN;
+	}
 
 	while(read_bits < total_bits) {
 		unsigned long long remaining = total_bits - read_bits;
 
 		if (n == 0) {
-			n = read(fd, buf, 8192);
+			n = read(fd, buf, BITMAP_READ_SIZE);
 			skip = 0;
 			if (n <= 0)
 				break;
 		}
-		if (remaining > (n-skip) * 8) /* we want the full buffer */
-			remaining = (n-skip) * 8;
+		if (remaining > (unsigned long long)(n-skip) * 8)
+			/* we want the full buffer */
+			remaining = (unsigned long long)(n-skip) * 8;
 
 		dirty_bits += count_dirty_bits(buf+skip, remaining);
+		if (map)
+			dirty_map_bits(map, (unsigned char *)buf + skip,
+				       read_bits, remaining);
 
 		read_bits += remaining;
 		n = 0;
@@ -197,13 +446,17 @@ bitmap_info_t *bitmap_fd_read(int fd, int brief)
 			(unsigned long long)info->sb.sync_size);
 		total_bits = read_bits;
 	}
+	if (map && map->run != NO_RUN)
+		dirty_map_extent(map, read_bits);
 out:
+	free(buf);
 	info->total_bits = total_bits;
 	info->dirty_bits = dirty_bits;
 	return info;
 }
 
-bitmap_info_t *bitmap_file_read(char *filename, int brief, struct supertype **stp)
+bitmap_info_t *bitmap_file_read(char *filename, int brief, struct supertype **stp,
+			       struct dirty_map *map)
 {
 	int fd;
 	bitmap_info_t *info;
@@ -245,7 +498,7 @@ bitmap_info_t *bitmap_file_read(char *filename, int brief, struct supertype **st
 		}
 	}
 
-	info = bitmap_fd_read(fd, brief);
+	info = bitmap_fd_read(fd, brief, map);
 	close(fd);
 	return info;
 }
@@ -262,7 +515,142 @@ __u32 swapl(__u32 l)
 	c[2] = t;
 	return l;
 }
-int ExamineBitmap(char *filename, int brief, struct supertype *st)
+/* extents listed with --verbose, all of them with more */
+#define DIRTY_LIST 20
+
+struct dirty_list {
+	unsigned long long (*ext)[2];
+	int cnt, max, limit;
+};
+
+static void dirty_list_add(struct dirty_map *m, unsigned long long start,
+			   unsigned long long len)
+{
+	struct dirty_list *l = m->data;
+
+	if (l->limit && l->cnt >= l->limit)
+		return;
+	if (l->cnt >= l->max) {
+		int max = l->max ? l->max * 2 : DIRTY_LIST;
+		void *n = realloc(l->ext, max * sizeof(l->ext[0]));
+		if (!n)
+			return;
+		l->ext = n;
+		l->max = max;
+	}
+	l->ext[l->cnt][0] = start;
+	l->ext[l->cnt][1] = len;
+	l->cnt++;
+}
+
+static char *human_time(unsigned long long secs)
+{
+	static char buf[40];
+
+	if (secs >= 3600)
+		snprintf(buf, sizeof(buf), "%lluh%02llum", secs / 3600,
+			 (secs / 60) % 60);
+	else if (secs >= 60)
+		snprintf(buf, sizeof(buf), "%llum%02llus", secs / 60, secs % 60);
+	else
+		snprintf(buf, sizeof(buf), "%llus", secs);
+	return buf;
+}
+
+static void resync_estimate(bitmap_info_t *info, __u32 uuid32[4])
+{
+	/* The resync only has to cover the dirty chunks.  If the array
+	 * is running and syncing, its current speed says how long that
+	 * will take; otherwise give the range that sync_speed_min and
+	 * sync_speed_max allow.
+	 */
+	unsigned long long kb = info->dirty_bits *
+		(unsigned long long)(info->sb.chunksize / 1024);
+	unsigned long long speed = 0, min = 0, max = 0;
+	struct map_ent *map = NULL, *me;
+	struct mdinfo *sra = NULL;
+	char *name = NULL;
+	char buf[1024];
+	int uuid[4];
+
+	memcpy(uuid, uuid32, 16);
+	map_read(&map);
+	me = map_by_uuid(&map, uuid);
+	if (me)
+		sra = sysfs_read(-1, me->devnum, 0);
+	if (sra) {
+		name = sra->sys_name;
+		if (sysfs_get_ll(sra, NULL, "sync_speed", &speed) < 0)
+			speed = 0;
+		sysfs_get_ll(sra, NULL, "sync_speed_min", &min);
+		sysfs_get_ll(sra, NULL, "sync_speed_max", &max);
+	}
+	if (!min && load_sys("/proc/sys/dev/raid/speed_limit_min", buf) == 0)
+		min = strtoull(buf, NULL, 10);
+	if (!max && load_sys("/proc/sys/dev/raid/speed_limit_max", buf) == 0)
+		max = strtoull(buf, NULL, 10);
+
+	if (kb == 0)
+		printf("          Resync : nothing to do\n");
+	else if (speed)
+		printf("          Resync : about %s for %lluK at %lluK/sec "
+		       "(%s now)\n", human_time(kb / speed), kb, speed, name);
+	else if (min && max)
+		printf("          Resync : %s to %s for %lluK at %lluK/sec "
+		       "to %lluK/sec%s%s\n", human_time(kb / max),
+		       human_time(kb / min), kb, max, min,
+		       name ? " for " : "", name ? name : "");
+	else
+		printf("          Resync : %lluK\n", kb);
+	sysfs_free(sra);
+	map_free(map);
+}
+
+static void print_dirty_map(bitmap_info_t *info, struct dirty_map *m,
+			    struct dirty_list *l)
+{
+	unsigned long long sectors = info->sb.chunksize / 512;
+	unsigned long long per_band = (m->total_bits + DIRTY_BANDS - 1)
+		/ DIRTY_BANDS;
+	int i, b;
+
+	printf("   Dirty Extents : %llu, largest %llu chunks%s\n",
+	       m->extents, m->largest,
+	       m->largest ? human_size(m->largest * info->sb.chunksize) : "");
+	for (i = 0; i < l->cnt; i++)
+		printf("                   sector %llu for %llu%s\n",
+		       l->ext[i][0] * sectors, l->ext[i][1] * sectors,
+		       human_size(l->ext[i][1] * info->sb.chunksize));
+	if (m->extents > (unsigned long long)l->cnt)
+		printf("                   ... %llu more\n",
+		       m->extents - l->cnt);
+	if (!info->dirty_bits)
+		return;
+
+	printf("  Dirty by Place : (sectors from start of each device)\n");
+	for (b = 0; b < DIRTY_BANDS; b++) {
+		unsigned long long first = b * per_band;
+		unsigned long long bits = per_band;
+		int pct, bar;
+
+		if (first >= m->total_bits)
+			break;
+		if (first + bits > m->total_bits)
+			bits = m->total_bits - first;
+		pct = m->band[b] * 100 / bits;
+		bar = (m->band[b] * 40 + bits - 1) / bits;
+		printf("   %14llu : %3d%% %.*s\n", first * sectors, pct, bar,
+		       "########################################");
+	}
+
+	printf(" Extent Lengths : (chunks)\n");
+	for (b = 0; b < 64; b++)
+		if (m->lengths[b])
+			printf("   %6llu-%-7llu : %llu\n", 1ULL << b,
+			       (2ULL << b) - 1, m->lengths[b]);
+}
+
+int ExamineBitmap(char *filename, int brief, int verbose, struct supertype *st)
 {
 	/*
 	 * Read the bitmap file and display its contents
@@ -274,8 +662,16 @@ int ExamineBitmap(char *filename, int brief, struct supertype *st)
 	char buf[64];
 	int swap;
 	__u32 uuid32[4];
-
-	info = bitmap_file_read(filename, brief, &st);
+	struct dirty_map map;
+	struct dirty_list list;
+
+	memset(&map, 0, sizeof(map));
+	memset(&list, 0, sizeof(list));
+	list.limit = verbose > 1 ? 0 : DIRTY_LIST;
+	map.found = dirty_list_add;
+	map.data = &list;
+	info = bitmap_file_read(filename, brief, &st,
+				verbose > 0 ? &map : NULL);
 	if (!info)
 		return rv;
 
@@ -332,7 +728,12 @@ int ExamineBitmap(char *filename, int brief, struct supertype *st)
 	printf("          Bitmap : %llu bits (chunks), %llu dirty (%2.1f%%)\n",
 			info->total_bits, info->dirty_bits,
 			100.0 * info->dirty_bits / (info->total_bits + 1));
+	if (verbose > 0 && info->total_bits) {
+		print_dirty_map(info, &map, &list);
+		resync_estimate(info, (__u32 *)sb->uuid);
+	}
 free_info:
+	free(list.ext);
 	free(info);
 	return rv;
 }
@@ -0,0 +1,219 @@
+/*
+ * mdadm - manage Linux "md" devices aka RAID arrays.
+ *
+ * Copyright (C) 2010 Neil Brown <neilb@suse.de>
+ *
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *    Author: Neil Brown
+ *    Email: <neilb@suse.de>
+ */
+
+/*
+ * CRC32C (Castagnoli), as used to check reshape backups.
+ *
+ * crc32c() follows zlib's crc32(): pass 0 to start, and pass the
+ * previous result to continue over more data, so a region can be
+ * checked in pieces.  The SSE4.2 crc32 instruction is used when the
+ * CPU has it, otherwise a slicing-by-8 table which does a little under
+ * a byte per cycle.  impl_pick() makes the choice the first time it is
+ * needed.  Restart probes several backups at once, so under
+ * USE_PTHREADS that choice is made exactly once.
+ */
+
+#include "mdadm.h"
+#ifdef USE_PTHREADS
+#include <pthread.h>
+#endif
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && __GNUC__ >= 5
+#define HAVE_X86_CRC 1
+#include <immintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82F63B78	/* reversed 0x1EDC6F41 */
+
+typedef __u32 (*crc32c_fn)(__u32 crc, const unsigned char *buf, size_t len);
+
+static __u32 crc32c_table[8][256];
+
+static void make_crc32c_table(void)
+{
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		__u32 c = i;
+		for (j = 0; j < 8; j++)
+			c = (c >> 1) ^ (c & 1 ? CRC32C_POLY : 0);
+		crc32c_table[0][i] = c;
+	}
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			crc32c_table[j][i] = (crc32c_table[j-1][i] >> 8) ^
+				crc32c_table[0][crc32c_table[j-1][i] & 0xff];
+}
+
+static __u32 crc32c_slice8(__u32 crc, const unsigned char *buf, size_t len)
+{
+	/* 'crc' is the running (inverted) value */
+	while (len && ((unsigned long)buf & 7)) {
+		crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *buf++) & 0xff];
+		len--;
+	}
+	while (len >= 8) {
+		__u32 lo, hi;
+		memcpy(&lo, buf, 4);
+		memcpy(&hi, buf + 4, 4);
+		lo = __le32_to_cpu(lo) ^ crc;
+		hi = __le32_to_cpu(hi);
+		crc = crc32c_table[7][lo & 0xff] ^
+			crc32c_table[6][(lo >> 8) & 0xff] ^
+			crc32c_table[5][(lo >> 16) & 0xff] ^
+			crc32c_table[4][lo >> 24] ^
+			crc32c_table[3][hi & 0xff] ^
+			crc32c_table[2][(hi >> 8) & 0xff] ^
+			crc32c_table[1][(hi >> 16) & 0xff] ^
+			crc32c_table[0][hi >> 24];
+		buf += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *buf++) & 0xff];
+	return crc;
+}
+
+#ifdef HAVE_X86_CRC
+__attribute__((target("sse4.2")))
+static __u32 crc32c_sse42(__u32 crc, const unsigned char *buf, size_t len)
+{
+	while (len && ((unsigned long)buf & 7)) {
+		crc = _mm_crc32_u8(crc, *buf++);
+		len--;
+	}
+#ifdef __x86_64__
+	{
+		unsigned long long c = crc;
+		/* 4 independent-ish words per pass keeps the unit busy */
+		while (len >= 32) {
+			c = _mm_crc32_u64(c, *(const unsigned long long *)buf);
+			c = _mm_crc32_u64(c, *(const unsigned long long *)(buf+8));
+			c = _mm_crc32_u64(c, *(const unsigned long long *)(buf+16));
+			c = _mm_crc32_u64(c, *(const unsigned long long *)(buf+24));
+			buf += 32;
+			len -= 32;
+		}
+		while (len >= 8) {
+			c = _mm_crc32_u64(c, *(const unsigned long long *)buf);
+			buf += 8;
+			len -= 8;
+		}
+		crc = c;
+	}
+#endif
+	while (len >= 4) {
+		crc = _mm_crc32_u32(crc, *(const unsigned int *)buf);
+		buf += 4;
+		len -= 4;
+	}
+	while (len--)
+		crc = _mm_crc32_u8(crc, *buf++);
+	return crc;
+}
+
+static int have_sse42(void) { return __builtin_cpu_supports("sse4.2"); }
+#endif
+
+struct crc32c_template {
+	struct impl impl;
+	crc32c_fn fn;
+};
+
+/* Best first.  The last entry must always be usable. */
+static struct crc32c_template crc32c_templates[] = {
+#ifdef HAVE_X86_CRC
+	{ { "sse4.2", have_sse42 }, crc32c_sse42 },
+#endif
+	{ { "slice8", NULL }, crc32c_slice8 },
+	{ { NULL, NULL }, NULL }
+};
+
+static crc32c_fn crc32c_impl;
+static char *crc32c_impl_name;
+
+static int crc32c_check(void *entry)
+{
+	/* Compare 'entry' with the table, at awkward lengths and
+	 * alignments, and against the standard check value.
+	 */
+	crc32c_fn fn = ((struct crc32c_template *)entry)->fn;
+	static const int sizes[] = { 0, 1, 7, 31, 64, 257, 4096+13 };
+	enum { LEN = 4096+13+8 };
+	unsigned char *mem = malloc(LEN);
+	unsigned int seed = 1;
+	int rv = 0;
+	int i, s, a;
+
+	if (!mem)
+		return -1;
+	if (fn(~0U, (const unsigned char *)"123456789", 9) != ~0xE3069283U)
+		rv = -1;
+	for (i = 0; i < LEN; i++) {
+		seed = seed * 1103515245 + 12345;
+		mem[i] = seed >> 16;
+	}
+	for (s = 0; s < (int)(sizeof(sizes)/sizeof(sizes[0])) && rv == 0; s++)
+		for (a = 0; a < 8 && rv == 0; a++)
+			if (fn(~0U, mem + a, sizes[s]) !=
+			    crc32c_slice8(~0U, mem + a, sizes[s]))
+				rv = -1;
+	free(mem);
+	return rv;
+}
+
+static void crc32c_init(void)
+{
+	struct crc32c_template *t;
+
+	make_crc32c_table();
+	t = impl_pick(crc32c_templates, sizeof(*t), crc32c_check);
+	crc32c_impl_name = t->impl.name;
+	crc32c_impl = t->fn;
+}
+
+#ifdef USE_PTHREADS
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+#define crc32c_ready() pthread_once(&crc32c_once, crc32c_init)
+#else
+#define crc32c_ready() do { if (!crc32c_impl) crc32c_init(); } while (0)
+#endif
+
+char *crc32c_name(void)
+{
+	crc32c_ready();
+	return crc32c_impl_name;
+}
+
+int crc32c_selftest(int verbose)
+{
+	crc32c_ready();
+	return impl_selftest(crc32c_templates, sizeof(crc32c_templates[0]),
+			     crc32c_check, "crc32c", verbose);
+}
+
+__u32 crc32c(__u32 crc, const void *buf, size_t len)
+{
+	crc32c_ready();
+	return ~crc32c_impl(~crc, buf, len);
+}
@@ -0,0 +1,80 @@
+/*
+ * mdadm - manage Linux "md" devices aka RAID arrays.
+ *
+ * Copyright (C) 2010 Neil Brown <neilb@suse.de>
+ *
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *    Author: Neil Brown
+ *    Email: <neilb@suse.de>
+ */
+
+/*
+ * Choosing between CPU-specific versions of a function.
+ *
+ * xor_blocks(), the raid6 syndrome, crc32c() and the bitmap popcount
+ * each keep a table of versions, best first, ending with a portable
+ * reference version and then an entry with a NULL name.  Every entry
+ * starts with a 'struct impl'.  The first entry that the CPU can run
+ * and that agrees with the reference under the table's 'check' is
+ * used; anything that disagrees is skipped rather than trusted.  The
+ * reference itself is always usable and is not checked.
+ */
+
+#include "mdadm.h"
+
+#define entry(table, size, i) ((struct impl *)((char *)(table) + (i) * (size)))
+
+void *impl_pick(void *table, size_t size, int (*check)(void *entry))
+{
+	struct impl *t;
+	int i;
+
+	for (i = 0; ; i++) {
+		t = entry(table, size, i);
+		if (entry(table, size, i+1)->name == NULL)
+			/* the reference */
+			return t;
+		if (t->usable && !t->usable())
+			continue;
+		if (check(t) == 0)
+			return t;
+	}
+}
+
+int impl_selftest(void *table, size_t size, int (*check)(void *entry),
+		  char *what, int verbose)
+{
+	/* Check every version this CPU can run against the reference */
+	struct impl *t;
+	int rv = 0;
+	int i;
+
+	for (i = 0; (t = entry(table, size, i))->name; i++) {
+		int ok;
+		if (t->usable && !t->usable()) {
+			if (verbose)
+				printf("%s %-8s not supported\n", what, t->name);
+			continue;
+		}
+		ok = check(t) == 0;
+		if (verbose)
+			printf("%s %-8s %s\n", what, t->name, ok ? "ok" : "FAILED");
+		if (!ok)
+			rv = -1;
+	}
+	return rv;
+}
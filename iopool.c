@@ -0,0 +1,249 @@
+/*
+ * mdadm - manage Linux "md" devices aka RAID arrays.
+ *
+ * Copyright (C) 2010 Neil Brown <neilb@suse.de>
+ *
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *    Author: Neil Brown
+ *    Email: <neilb@suse.de>
+ */
+
+/*
+ * A small pool of worker threads for issuing I/O to several devices
+ * at once.  The caller fills in 'struct io_req's, submits them, and
+ * later waits for some or all of them.  Requests carry their own
+ * result so the caller can see exactly which ones failed.
+ *
+ * Without USE_PTHREADS, or if the pool could not be created, every
+ * request is performed synchronously by io_pool_submit() so callers
+ * never need a separate code path.  Submitting to a NULL pool is the
+ * easy way to do a single request (e.g. a full-length preadv) inline.
+ *
+ * Worker threads do not survive fork(), so a pool used from a child
+ * of the process that created it also falls back to synchronous I/O.
+ */
+
+#include "mdadm.h"
+#ifdef USE_PTHREADS
+#include <pthread.h>
+#endif
+
+struct io_pool {
+	int threads;
+	pid_t pid;		/* process that owns the threads */
+#ifdef USE_PTHREADS
+	pthread_t *tids;
+	pthread_mutex_t lock;
+	pthread_cond_t work;	/* signalled when a request is queued */
+	pthread_cond_t done;	/* signalled when a request completes */
+#endif
+	struct io_req *head, **tail;
+	int pending;		/* submitted but not yet complete */
+	int stop;
+};
+
+static void io_perform(struct io_req *r)
+{
+	ssize_t n = 0;
+	size_t done = 0;
+
+	errno = 0;
+	switch (r->op) {
+	case IO_READ:
+	case IO_WRITE:
+		/* short transfers are retried until EOF or error */
+		while (done < r->len) {
+			if (r->op == IO_READ)
+				n = pread(r->fd, (char*)r->buf + done,
+					  r->len - done, r->offset + done);
+			else
+				n = pwrite(r->fd, (char*)r->buf + done,
+					   r->len - done, r->offset + done);
+			if (n <= 0)
+				break;
+			done += n;
+		}
+		r->rv = (n < 0 && done == 0) ? -1 : (ssize_t)done;
+		break;
+	case IO_READV:
+	case IO_WRITEV:
+		/* 'iov' is consumed as the transfer progresses */
+		while (r->iovcnt > 0) {
+			if (r->op == IO_READV)
+				n = preadv(r->fd, r->iov, r->iovcnt,
+					   r->offset + done);
+			else
+				n = pwritev(r->fd, r->iov, r->iovcnt,
+					    r->offset + done);
+			if (n <= 0)
+				break;
+			done += n;
+			while (r->iovcnt > 0 && (size_t)n >= r->iov->iov_len) {
+				n -= r->iov->iov_len;
+				r->iov++;
+				r->iovcnt--;
+			}
+			if (n > 0) {
+				r->iov->iov_base = (char*)r->iov->iov_base + n;
+				r->iov->iov_len -= n;
+			}
+		}
+		r->rv = (n < 0 && done == 0) ? -1 : (ssize_t)done;
+		break;
+	case IO_FSYNC:
+		r->rv = fsync(r->fd);
+		break;
+	case IO_FDATASYNC:
+		r->rv = fdatasync(r->fd);
+		break;
+	case IO_CALL:
+		r->rv = r->fn(r);
+		break;
+	}
+	r->err = r->rv < 0 ? errno : 0;
+}
+
+#ifdef USE_PTHREADS
+static void *io_worker(void *v)
+{
+	struct io_pool *p = v;
+
+	pthread_mutex_lock(&p->lock);
+	while (1) {
+		struct io_req *r;
+		while (!p->head && !p->stop)
+			pthread_cond_wait(&p->work, &p->lock);
+		if (!p->head)
+			break;
+		r = p->head;
+		p->head = r->next;
+		if (!p->head)
+			p->tail = &p->head;
+		pthread_mutex_unlock(&p->lock);
+
+		io_perform(r);
+
+		pthread_mutex_lock(&p->lock);
+		r->done = 1;
+		p->pending--;
+		pthread_cond_broadcast(&p->done);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+#endif
+
+int io_pool_threaded(struct io_pool *p)
+{
+	return p && p->threads && p->pid == getpid();
+}
+
+struct io_pool *io_pool_create(int threads)
+{
+	struct io_pool *p = calloc(1, sizeof(*p));
+
+	if (!p)
+		return NULL;
+	p->tail = &p->head;
+	p->pid = getpid();
+#ifdef USE_PTHREADS
+	if (threads > IO_POOL_MAX)
+		threads = IO_POOL_MAX;
+	p->tids = calloc(threads > 0 ? threads : 1, sizeof(pthread_t));
+	if (!p->tids) {
+		free(p);
+		return NULL;
+	}
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->work, NULL);
+	pthread_cond_init(&p->done, NULL);
+	for (p->threads = 0; p->threads < threads; p->threads++)
+		if (pthread_create(&p->tids[p->threads], NULL,
+				   io_worker, p) != 0)
+			break;
+#endif
+	return p;
+}
+
+void io_pool_submit(struct io_pool *p, struct io_req *r)
+{
+	r->done = 0;
+	r->next = NULL;
+#ifdef USE_PTHREADS
+	if (io_pool_threaded(p)) {
+		pthread_mutex_lock(&p->lock);
+		*p->tail = r;
+		p->tail = &r->next;
+		p->pending++;
+		pthread_cond_signal(&p->work);
+		pthread_mutex_unlock(&p->lock);
+		return;
+	}
+#endif
+	io_perform(r);
+	r->done = 1;
+}
+
+void io_pool_wait_reqs(struct io_pool *p, struct io_req *reqs, int cnt)
+{
+	/* Wait for just these requests, others may still be in flight */
+#ifdef USE_PTHREADS
+	int i;
+
+	if (!io_pool_threaded(p))
+		return;
+	pthread_mutex_lock(&p->lock);
+	for (i = 0; i < cnt; i++)
+		while (!reqs[i].done)
+			pthread_cond_wait(&p->done, &p->lock);
+	pthread_mutex_unlock(&p->lock);
+#endif
+}
+
+void io_pool_wait(struct io_pool *p)
+{
+#ifdef USE_PTHREADS
+	if (!io_pool_threaded(p))
+		return;
+	pthread_mutex_lock(&p->lock);
+	while (p->pending)
+		pthread_cond_wait(&p->done, &p->lock);
+	pthread_mutex_unlock(&p->lock);
+#endif
+}
+
+void io_pool_destroy(struct io_pool *p)
+{
+	if (!p)
+		return;
+#ifdef USE_PTHREADS
+	if (p->pid == getpid()) {
+		int i;
+		pthread_mutex_lock(&p->lock);
+		p->stop = 1;
+		pthread_cond_broadcast(&p->work);
+		pthread_mutex_unlock(&p->lock);
+		for (i = 0; i < p->threads; i++)
+			pthread_join(p->tids[i], NULL);
+		pthread_mutex_destroy(&p->lock);
+		pthread_cond_destroy(&p->work);
+		pthread_cond_destroy(&p->done);
+		free(p->tids);
+	}
+#endif
+	free(p);
+}
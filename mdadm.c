@@ -104,6 +104,8 @@ int main(int argc, char *argv[])
 	int rebuild_map = 0;
 	int auto_update_home = 0;
 	char *subarray = NULL;
+	char *scrub_range = NULL;
+	char *copy_target = NULL;
 
 	int print_help = 0;
 	FILE *outf;
@@ -219,6 +221,8 @@ int main(int argc, char *argv[])
 		case DetailPlatform:
 		case KillSubarray:
 		case UpdateSubarray:
+		case ScrubArray:
+		case CopyArray:
 			if (opt == KillSubarray || opt == UpdateSubarray) {
 				if (subarray) {
 					fprintf(stderr, Name ": subarray can only be specified once\n");
@@ -226,6 +230,13 @@ int main(int argc, char *argv[])
 				}
 				subarray = optarg;
 			}
+			if (opt == CopyArray) {
+				if (copy_target) {
+					fprintf(stderr, Name ": copy-to target can only be specified once\n");
+					exit(2);
+				}
+				copy_target = optarg;
+			}
 		case 'K': if (!mode) newmode = MISC; break;
 		}
 		if (mode && newmode == mode) {
@@ -836,6 +847,8 @@ int main(int argc, char *argv[])
 		case O(MISC, DetailPlatform):
 		case O(MISC, KillSubarray):
 		case O(MISC, UpdateSubarray):
+		case O(MISC, ScrubArray):
+		case O(MISC, CopyArray):
 			if (devmode && devmode != opt &&
 			    (devmode == 'E' || (opt == 'E' && devmode != 'Q'))) {
 				fprintf(stderr, Name ": --examine/-E cannot be given with ");
@@ -857,6 +870,15 @@ int main(int argc, char *argv[])
 			test = 1;
 			continue;
 
+		case O(MISC, ScrubRange):
+			if (scrub_range) {
+				fprintf(stderr, Name ": scrub-range may only be specified once. "
+					"Second value is %s.\n", optarg);
+				exit(2);
+			}
+			scrub_range = optarg;
+			continue;
+
 		case O(MISC, Sparc22):
 			if (devmode != 'E') {
 				fprintf(stderr, Name ": --sparc2.2 only allowed with --examine\n");
@@ -1436,7 +1458,9 @@ int main(int argc, char *argv[])
 				case 'Q':
 					rv |= Query(dv->devname); continue;
 				case 'X':
-					rv |= ExamineBitmap(dv->devname, brief, ss); continue;
+					rv |= ExamineBitmap(dv->devname, brief,
+							     verbose-quiet, ss);
+					continue;
 				case 'W':
 					rv |= Wait(dv->devname); continue;
 				case Waitclean:
@@ -1453,6 +1477,12 @@ int main(int argc, char *argv[])
 					}
 					rv |= Update_subarray(dv->devname, subarray, update, &ident, quiet);
 					continue;
+				case ScrubArray:
+					rv |= Scrub(dv->devname, scrub_range, verbose-quiet);
+					continue;
+				case CopyArray:
+					rv |= Copy(dv->devname, copy_target, verbose-quiet);
+					continue;
 				}
 				mdfd = open_mddev(dv->devname, 1);
 				if (mdfd>=0) {
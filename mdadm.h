@@ -57,6 +57,7 @@ extern __off64_t lseek64 __P ((int __fd, __off64_t __offset, int __whence));
 #include	<sys/mount.h>
 #include	<asm/types.h>
 #include	<sys/ioctl.h>
+#include	<sys/uio.h>
 #define	MD_MAJOR 9
 #define MdpMinorShift 6
 
@@ -280,6 +281,9 @@ enum special_options {
 	DetailPlatform,
 	KillSubarray,
 	UpdateSubarray, /* 16 */
+	ScrubArray,
+	ScrubRange,
+	CopyArray,
 };
 
 /* structures read from config file */
@@ -362,18 +366,45 @@ struct mdstat_ent {
 	char *		metadata_version;
 	struct dev_member {
 		char			*name;
+		char			*role; /* the rest: "N]", "(F)" etc */
 		struct dev_member	*next;
 	} 		*members;
 	struct mdstat_ent *next;
+	void		*arena;	/* holds the whole read, see free_mdstat() */
 };
 
 extern struct mdstat_ent *mdstat_read(int hold, int start);
 extern void free_mdstat(struct mdstat_ent *ms);
-extern void mdstat_wait(int seconds);
+extern int mdstat_wait(int seconds);
+struct pollfd;
+extern int mdstat_poll(struct pollfd *fds, int nfds, int seconds);
 extern void mdstat_wait_fd(int fd, const sigset_t *sigmask);
 extern int mddev_busy(int devnum);
 extern struct mdstat_ent *mdstat_by_component(char *name);
 
+/* What changed in an array between two reads of /proc/mdstat */
+#define	MDSTAT_NEW	1	/* not there last time */
+#define	MDSTAT_GONE	2	/* there last time, not now */
+#define	MDSTAT_STATE	4	/* active, level or metadata */
+#define	MDSTAT_PATTERN	8	/* [UU_] */
+#define	MDSTAT_PROGRESS	16	/* resync/recovery percent */
+#define	MDSTAT_MEMBERS	32	/* devices, their slots or (F)/(S) */
+struct mdstat_change {
+	struct mdstat_ent *ent;	/* as it is now, or was if GONE */
+	int what;
+	struct mdstat_change *next;
+};
+/* Keeps the last read, so each new read can report just the changes */
+struct mdstat_feed {
+	int hold;		/* as for mdstat_read() */
+	struct mdstat_ent *now, *then;
+	struct mdstat_change *changes;
+};
+extern struct mdstat_change *mdstat_feed_read(struct mdstat_feed *feed);
+extern struct mdstat_change *mdstat_feed_find(struct mdstat_feed *feed,
+					      int devnum);
+extern void mdstat_feed_free(struct mdstat_feed *feed);
+
 struct map_ent {
 	struct map_ent *next;
 	int	devnum;
@@ -450,11 +481,104 @@ extern int save_stripes(int *source, unsigned long long *offsets,
 			int raid_disks, int chunk_size, int level, int layout,
 			int nwrites, int *dest,
 			unsigned long long start, unsigned long long length,
-			char *buf);
+			char *buf, __u32 *crc);
+/* Where save_stripes() has spent its time, accumulated over all calls:
+ * waiting for member reads, reconstructing missing blocks, and waiting
+ * for the backup writes.
+ */
+struct save_stats {
+	unsigned long long read_usec, parity_usec, write_usec;
+	unsigned long long bytes;
+};
+extern struct save_stats save_stats;
 extern int restore_stripes(int *dest, unsigned long long *offsets,
 			   int raid_disks, int chunk_size, int level, int layout,
 			   int source, unsigned long long read_offset,
 			   unsigned long long start, unsigned long long length);
+struct stripe_mismatch {
+	unsigned long long stripe;	/* stripe number == chunk on each member */
+	int parity;	/* 1 if P is inconsistent, 2 if Q, 3 for both */
+	int disk;	/* raid_disk holding the bad block, or -1 if unknown */
+};
+extern int check_stripes(int *source, unsigned long long *offsets,
+			 int raid_disks, int chunk_size, int level, int layout,
+			 unsigned long long start, unsigned long long length,
+			 int threads, struct stripe_mismatch **found);
+extern int *stripe_map(int level, int layout, int raid_disks,
+		       unsigned long long stripe);
+extern int layout_supported(int level, int layout, int raid_disks);
+extern int make_parity(char **stripes, int raid_disks, int chunk_size,
+		       int level, int layout, unsigned long long stripe);
+extern int raid5_extend(int level, int layout, int chunk_size,
+			int old_disks, int *rfds, unsigned long long *roffsets,
+			int new_disks, int *wfds, unsigned long long *woffsets,
+			unsigned long long length, int ckfd,
+			unsigned long long limit);
+extern void xor_blocks(char *target, char **sources, int disks, int size);
+extern char *xor_blocks_name(void);
+extern int xor_selftest(int verbose);
+extern char *raid6_name(void);
+extern int raid6_selftest(int verbose);
+
+/* dispatch.c - pick the best CPU-specific version of a function.
+ * Each entry of a table of versions starts with a struct impl.
+ */
+struct impl {
+	char *name;
+	int (*usable)(void);	/* NULL if every CPU can run it */
+};
+extern void *impl_pick(void *table, size_t size, int (*check)(void *entry));
+extern int impl_selftest(void *table, size_t size, int (*check)(void *entry),
+			 char *what, int verbose);
+
+/* crc32c.c - CRC32C, start with crc == 0 */
+extern __u32 crc32c(__u32 crc, const void *buf, size_t len);
+extern char *crc32c_name(void);
+extern int crc32c_selftest(int verbose);
+
+/* iopool.c - a few threads to issue I/O to several devices at once */
+enum io_op { IO_READ, IO_WRITE, IO_READV, IO_WRITEV,
+	     IO_FSYNC, IO_FDATASYNC, IO_CALL };
+struct io_req {
+	enum io_op op;
+	int fd;
+	void *buf;
+	size_t len;
+	struct iovec *iov;		/* for IO_READV/IO_WRITEV */
+	int iovcnt;
+	unsigned long long offset;
+	int (*fn)(struct io_req *r);	/* for IO_CALL */
+	void *data;			/* for IO_CALL */
+	/* results */
+	ssize_t rv;	/* bytes transferred, or return of sync/fn */
+	int err;	/* errno if rv < 0 */
+	int done;
+	struct io_req *next;
+};
+#define IO_POOL_MAX 64
+struct io_pool;
+extern struct io_pool *io_pool_create(int threads);
+extern int io_pool_threaded(struct io_pool *p);
+extern void io_pool_submit(struct io_pool *p, struct io_req *r);
+extern void io_pool_wait_reqs(struct io_pool *p, struct io_req *reqs, int cnt);
+extern void io_pool_wait(struct io_pool *p);
+extern void io_pool_destroy(struct io_pool *p);
+
+/* throttle.c: adjust sync speed to keep member latency near a target */
+struct throttle;
+extern struct throttle *throttle_start(char *sys_name, unsigned long target_ms);
+extern unsigned long throttle_poll(struct throttle *t);
+extern void throttle_stop(struct throttle *t);
+extern unsigned long throttle_target(unsigned long dflt);
+
+/* metrics.c: Prometheus-style metrics from --monitor */
+struct metrics;
+extern struct metrics *metrics_open(void);
+extern void metrics_array(struct metrics *mt, int devnum, int active,
+			  int working, int failed, int spare, int raid_disks,
+			  long degraded_secs);
+extern int metrics_write(struct metrics *mt);
+extern void metrics_close(struct metrics *mt);
 
 #ifndef Sendmail
 #define Sendmail "/usr/lib/sendmail -t"
@@ -826,6 +950,8 @@ extern int Kill_subarray(char *dev, char *subarray, int quiet);
 extern int Update_subarray(char *dev, char *subarray, char *update, mddev_ident_t ident, int quiet);
 extern int Wait(char *dev);
 extern int WaitClean(char *dev, int sock, int verbose);
+extern int Scrub(char *devname, char *range, int verbose);
+extern int Copy(char *devname, char *target, int verbose);
 
 extern int Incremental(char *devname, int verbose, int runstop,
 		       struct supertype *st, char *homehost, int require_homehost,
@@ -841,7 +967,8 @@ extern int CreateBitmap(char *filename, int force, char uuid[16],
 			unsigned long write_behind,
 			unsigned long long array_size,
 			int major);
-extern int ExamineBitmap(char *filename, int brief, struct supertype *st);
+extern int ExamineBitmap(char *filename, int brief, int verbose,
+			 struct supertype *st);
 extern int bitmap_update_uuid(int fd, int *uuid, int swap);
 extern unsigned long bitmap_sectors(struct bitmap_super_s *bsb);
 
@@ -940,6 +1067,9 @@ extern int mdmon_running(int devnum);
 extern int mdmon_pid(int devnum);
 extern int check_env(char *name);
 extern __u32 random32(void);
+extern unsigned long long now_usec(void);
+extern int write_file_atomic(char *path, void (*fill)(FILE *f, void *arg),
+			     void *arg);
 extern int start_mdmon(int devnum);
 
 extern char *devnum2devname(int num);
@@ -73,112 +73,196 @@
  *   pattern of failed drives (so need number of drives)
  *   percent resync complete
  *
- * As continuation is indicated by leading space, we use
- *  conf_line from config.c to read logical lines
+ * As continuation is indicated by leading space, logical lines are
+ *  read the way conf_line from config.c reads them
  *
  */
 
 #include	"mdadm.h"
-#include	"dlink.h"
 #include	<sys/select.h>
+#include	<poll.h>
 #include	<ctype.h>
 
-static void free_member_devnames(struct dev_member *m)
+/*
+ * Everything mdstat_read() returns - the entries, their member lists and
+ * the strings they point to - lives in one allocation: the text of the
+ * file, split into words in place, followed by arrays for the entries
+ * and members.  Every entry points back to it in ->arena, and
+ * free_mdstat() frees it in one go.  Monitor and mdmon read the file on
+ * every event, so this saves a great deal of malloc traffic on hosts
+ * with many arrays.
+ */
+
+struct mdstat_scan {
+	char *p, *end;
+	int nl;		/* just passed a newline */
+};
+
+static char *mdstat_word(struct mdstat_scan *s)
 {
-	while(m) {
-		struct dev_member *t = m;
+	/* The next word of this logical line, terminated in place, or
+	 * NULL at the end of the line.  As with conf_line(), a line
+	 * starting with a blank continues the one before.
+	 */
+	char *w;
 
-		m = m->next;
-		free(t->name);
-		free(t);
+	while (1) {
+		if (s->p >= s->end)
+			return NULL;
+		if (*s->p == '\n') {
+			s->nl = 1;
+			s->p++;
+			continue;
+		}
+		if (s->nl) {
+			if (*s->p != ' ' && *s->p != '\t')
+				return NULL;
+			s->nl = 0;
+		}
+		if (*s->p != ' ' && *s->p != '\t')
+			break;
+		s->p++;
 	}
+	w = s->p;
+	while (s->p < s->end && *s->p != ' ' && *s->p != '\t' &&
+	       *s->p != '\n') {
+		/* Hack for broken kernels (2.6.14-.24) that put
+		 *        "active(auto-read-only)"
+		 * in /proc/mdstat instead of
+		 *        "active (auto-read-only)"
+		 */
+		if (*s->p == '(' && s->p - w == 6 &&
+		    strncmp(w, "active", 6) == 0)
+			return "active";
+		s->p++;
+	}
+	if (s->p < s->end && *s->p == '\n')
+		s->nl = 1;
+	/* there is always room for this, even at the end */
+	*s->p = 0;
+	if (s->p < s->end)
+		s->p++;
+	return w;
 }
 
-static int add_member_devname(struct dev_member **m, char *name)
+static char *mdstat_slurp(int fd, size_t *lenp)
 {
-	struct dev_member *new;
-	char *t;
-
-	if ((t = strchr(name, '[')) == NULL)
-		/* not a device */
-		return 0;
-
-	new = malloc(sizeof(*new));
-	new->name = strndup(name, t - name);
-	new->next = *m;
-	*m = new;
-	return 1;
+	/* Read the whole file with pread; the buffer is sized from the
+	 * last read so it rarely needs to grow.
+	 */
+	static size_t size = 4096;
+	size_t len = 0;
+	char *buf = malloc(size);
+	ssize_t n;
+
+	while (buf) {
+		n = pread(fd, buf + len, size - len, len);
+		if (n < 0) {
+			free(buf);
+			return NULL;
+		}
+		if (n == 0)
+			break;
+		len += n;
+		if (len == size) {
+			char *nbuf = realloc(buf, size * 2);
+			if (!nbuf)
+				free(buf);
+			buf = nbuf;
+			size *= 2;
+		}
+	}
+	if (buf)
+		*lenp = len;
+	return buf;
 }
 
 void free_mdstat(struct mdstat_ent *ms)
 {
-	while (ms) {
-		struct mdstat_ent *t;
-		free(ms->dev);
-		free(ms->level);
-		free(ms->pattern);
-		free(ms->metadata_version);
-		free_member_devnames(ms->members);
-		t = ms;
-		ms = ms->next;
-		free(t);
-	}
+	if (ms)
+		free(ms->arena);
 }
 
 static int mdstat_fd = -1;
 struct mdstat_ent *mdstat_read(int hold, int start)
 {
-	FILE *f;
+	int fd;
 	struct mdstat_ent *all, *rv, **end, **insert_here;
-	char *line;
-
-	if (hold && mdstat_fd != -1) {
-		lseek(mdstat_fd, 0L, 0);
-		f = fdopen(dup(mdstat_fd), "r");
-	} else
-		f = fopen("/proc/mdstat", "r");
-	if (f == NULL)
-		return NULL;
+	struct mdstat_ent *ents;
+	struct dev_member *members;
+	struct mdstat_scan scan;
+	char *arena, *line, *c;
+	size_t len, off;
+	int nents = 0, nmembers = 0;
+
+	if (hold && mdstat_fd != -1)
+		fd = mdstat_fd;
 	else
-		fcntl(fileno(f), F_SETFD, FD_CLOEXEC);
+		fd = open("/proc/mdstat", O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fd != mdstat_fd)
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+	arena = mdstat_slurp(fd, &len);
+	if (hold && mdstat_fd == -1)
+		mdstat_fd = fd;
+	else if (fd != mdstat_fd)
+		close(fd);
+	if (!arena)
+		return NULL;
 
+	/* At most one entry per line, and every member has a '[' */
+	for (c = arena; c < arena + len; c++)
+		if (*c == '\n')
+			nents++;
+		else if (*c == '[')
+			nmembers++;
+	nents++;
+	off = (len + 1 + sizeof(long long) - 1) & ~(sizeof(long long) - 1);
+	c = realloc(arena, off + nents * sizeof(*ents) +
+		    nmembers * sizeof(*members));
+	if (!c) {
+		fprintf(stderr, Name ": malloc failed reading /proc/mdstat.\n");
+		free(arena);
+		return NULL;
+	}
+	arena = c;
+	ents = (struct mdstat_ent *)(arena + off);
+	members = (struct dev_member *)(ents + nents);
+	nents = 0;
+
+	scan.p = arena;
+	scan.end = arena + len;
+	scan.nl = 0;
 	all = NULL;
 	end = &all;
-	for (; (line = conf_line(f)) ; free_line(line)) {
+	for (; scan.p < scan.end ; scan.nl = 0) {
 		struct mdstat_ent *ent;
 		char *w;
 		int devnum;
 		int in_devs = 0;
 		char *ep;
 
-		if (strcmp(line, "Personalities")==0)
-			continue;
-		if (strcmp(line, "read_ahead")==0)
-			continue;
-		if (strcmp(line, "unused")==0)
+		line = mdstat_word(&scan);
+		if (!line)
 			continue;
 		insert_here = NULL;
 		/* Better be an md line.. */
-		if (strncmp(line, "md", 2)!= 0)
-			continue;
 		if (strncmp(line, "md_d", 4) == 0)
 			devnum = -1-strtoul(line+4, &ep, 10);
 		else if (strncmp(line, "md", 2) == 0)
 			devnum = strtoul(line+2, &ep, 10);
 		else
-			continue;
+			ep = NULL;
 		if (ep == NULL || *ep ) {
 			/* fprintf(stderr, Name ": bad /proc/mdstat line starts: %s\n", line); */
+			while (mdstat_word(&scan))
+				;
 			continue;
 		}
 
-		ent = malloc(sizeof(*ent));
-		if (!ent) {
-			fprintf(stderr, Name ": malloc failed reading /proc/mdstat.\n");
-			free_line(line);
-			break;
-		}
-		ent->dev = ent->level = ent->pattern= NULL;
+		ent = &ents[nents++];
+		ent->level = ent->pattern= NULL;
 		ent->next = NULL;
 		ent->percent = -1;
 		ent->active = -1;
@@ -188,11 +272,12 @@ struct mdstat_ent *mdstat_read(int hold, int start)
 		ent->chunk_size = 0;
 		ent->devcnt = 0;
 		ent->members = NULL;
+		ent->arena = arena;
 
-		ent->dev = strdup(line);
+		ent->dev = line;
 		ent->devnum = devnum;
 
-		for (w=dl_next(line); w!= line ; w=dl_next(w)) {
+		while ((w = mdstat_word(&scan)) != NULL) {
 			int l = strlen(w);
 			char *eq;
 			if (strcmp(w, "active")==0)
@@ -203,13 +288,12 @@ struct mdstat_ent *mdstat_read(int hold, int start)
 			} else if (ent->active > 0 &&
 				 ent->level == NULL &&
 				 w[0] != '(' /*readonly*/) {
-				ent->level = strdup(w);
+				ent->level = w;
 				in_devs = 1;
 			} else if (in_devs && strcmp(w, "blocks")==0)
 				in_devs = 0;
 			else if (in_devs) {
-				ent->devcnt +=
-					add_member_devname(&ent->members, w);
+				char *t = strchr(w, '[');
 				if (strncmp(w, "md", 2)==0) {
 					/* This has an md device as a component.
 					 * If that device is already in the
@@ -224,16 +308,28 @@ struct mdstat_ent *mdstat_read(int hold, int start)
 						ih = & (*ih)->next;
 					insert_here = ih;
 				}
-			} else if (strcmp(w, "super") == 0 &&
-				   dl_next(w) != line) {
-				w = dl_next(w);
-				ent->metadata_version = strdup(w);
+				if (t && nmembers) {
+					/* a device: "name[N]..." */
+					struct dev_member *m = members++;
+					nmembers--;
+					*t = 0;
+					m->name = w;
+					m->role = t+1;
+					m->next = ent->members;
+					ent->members = m;
+					ent->devcnt++;
+				}
+			} else if (strcmp(w, "super") == 0) {
+				w = mdstat_word(&scan);
+				if (!w)
+					break;
+				ent->metadata_version = w;
 			} else if (w[0] == '[' && isdigit(w[1])) {
 				ent->raid_disks = atoi(w+1);
 			} else if (!ent->pattern &&
 				 w[0] == '[' &&
 				 (w[1] == 'U' || w[1] == '_')) {
-				ent->pattern = strdup(w+1);
+				ent->pattern = w+1;
 				if (ent->pattern[l-2]==']')
 					ent->pattern[l-2] = '\0';
 			} else if (ent->percent == -1 &&
@@ -261,11 +357,10 @@ struct mdstat_ent *mdstat_read(int hold, int start)
 			end = &ent->next;
 		}
 	}
-	if (hold && mdstat_fd == -1) {
-		mdstat_fd = dup(fileno(f));
-		fcntl(mdstat_fd, F_SETFD, FD_CLOEXEC);
+	if (!all) {
+		free(arena);
+		return NULL;
 	}
-	fclose(f);
 
 	/* If we might want to start array,
 	 * reverse the order, so that components comes before composites
@@ -282,8 +377,139 @@ struct mdstat_ent *mdstat_read(int hold, int start)
 	return rv;
 }
 
-void mdstat_wait(int seconds)
+static int str_differ(char *a, char *b)
+{
+	if (!a || !b)
+		return a != b;
+	return strcmp(a, b) != 0;
+}
+
+static int mdstat_compare(struct mdstat_ent *was, struct mdstat_ent *is)
+{
+	struct dev_member *m1, *m2;
+	int what = 0;
+
+	if (was->active != is->active ||
+	    was->raid_disks != is->raid_disks ||
+	    str_differ(was->level, is->level) ||
+	    str_differ(was->metadata_version, is->metadata_version))
+		what |= MDSTAT_STATE;
+	if (str_differ(was->pattern, is->pattern))
+		what |= MDSTAT_PATTERN;
+	if (was->percent != is->percent || was->resync != is->resync)
+		what |= MDSTAT_PROGRESS;
+	/* the kernel lists members in the same order each time */
+	for (m1 = was->members, m2 = is->members;
+	     m1 && m2; m1 = m1->next, m2 = m2->next)
+		if (strcmp(m1->name, m2->name) != 0 ||
+		    strcmp(m1->role, m2->role) != 0)
+			break;
+	if (m1 || m2)
+		what |= MDSTAT_MEMBERS;
+	return what;
+}
+
+struct mdstat_change *mdstat_feed_read(struct mdstat_feed *feed)
+{
+	/* Read /proc/mdstat again and return a list of the arrays that
+	 * are new, gone or different since the last call, saying how.
+	 * Arrays that are unchanged are not listed.  feed->now has the
+	 * whole of the new read.  Everything returned stays valid until
+	 * the next call.  The first call reports every array as new.
+	 */
+	struct mdstat_ent *e, **then;
+	struct mdstat_change *block, *c, **end;
+	int nnow = 0, nthen = 0, i, next = 0;
+
+	free_mdstat(feed->then);
+	free(feed->changes);
+	feed->changes = NULL;
+	feed->then = feed->now;
+	feed->now = mdstat_read(feed->hold, 0);
+
+	for (e = feed->now; e; e = e->next)
+		nnow++;
+	for (e = feed->then; e; e = e->next)
+		nthen++;
+	/* the changes, then the old entries, crossed off as they are
+	 * matched
+	 */
+	c = malloc((nnow + nthen) * sizeof(*c) + nthen * sizeof(e) + 1);
+	if (!c) {
+		/* As though the read failed; all will be new next time */
+		free_mdstat(feed->now);
+		feed->now = NULL;
+		return NULL;
+	}
+	block = c;
+	then = (struct mdstat_ent **)(c + nnow + nthen);
+	for (i = 0, e = feed->then; e; e = e->next)
+		then[i++] = e;
+	end = &feed->changes;
+
+	for (e = feed->now; e; e = e->next) {
+		int what;
+
+		/* Arrays are normally listed in the same order, so try
+		 * the one after the last match first.
+		 */
+		i = next;
+		if (i >= nthen || !then[i] || then[i]->devnum != e->devnum)
+			for (i = 0; i < nthen; i++)
+				if (then[i] && then[i]->devnum == e->devnum)
+					break;
+		if (i < nthen) {
+			what = mdstat_compare(then[i], e);
+			then[i] = NULL;
+			next = i + 1;
+		} else
+			what = MDSTAT_NEW;
+		if (!what)
+			continue;
+		c->ent = e;
+		c->what = what;
+		*end = c;
+		end = &c->next;
+		c++;
+	}
+	for (i = 0; i < nthen; i++)
+		if (then[i]) {
+			c->ent = then[i];
+			c->what = MDSTAT_GONE;
+			*end = c;
+			end = &c->next;
+			c++;
+		}
+	*end = NULL;
+	/* The list, if any, starts at the front of the block */
+	if (!feed->changes)
+		free(block);
+	return feed->changes;
+}
+
+struct mdstat_change *mdstat_feed_find(struct mdstat_feed *feed, int devnum)
 {
+	/* What changed in the array 'devnum' at the last read, or NULL */
+	struct mdstat_change *c;
+
+	for (c = feed->changes; c; c = c->next)
+		if (c->ent->devnum == devnum)
+			return c;
+	return NULL;
+}
+
+void mdstat_feed_free(struct mdstat_feed *feed)
+{
+	free_mdstat(feed->now);
+	free_mdstat(feed->then);
+	free(feed->changes);
+	feed->now = feed->then = NULL;
+	feed->changes = NULL;
+}
+
+int mdstat_wait(int seconds)
+{
+	/* Returns > 0 if /proc/mdstat changed, 0 on timeout */
 	fd_set fds;
 	struct timeval tm;
 	int maxfd = 0;
@@ -294,7 +520,18 @@ void mdstat_wait(int seconds)
 	}
 	tm.tv_sec = seconds;
 	tm.tv_usec = 0;
-	select(maxfd + 1, NULL, NULL, &fds, &tm);
+	return select(maxfd + 1, NULL, NULL, &fds, &tm);
+}
+
+int mdstat_poll(struct pollfd *fds, int nfds, int seconds)
+{
+	/* As mdstat_wait(), but also wake on POLLPRI for 'fds', which
+	 * must have room for one more entry for /proc/mdstat.
+	 */
+	fds[nfds].fd = mdstat_fd;
+	fds[nfds].events = POLLPRI;
+	fds[nfds].revents = 0;
+	return poll(fds, nfds + 1, seconds * 1000);
 }
 
 void mdstat_wait_fd(int fd, const sigset_t *sigmask)
@@ -344,27 +581,25 @@ int mddev_busy(int devnum)
 
 struct mdstat_ent *mdstat_by_component(char *name)
 {
+	/* The entry is returned on its own, but still holds the whole
+	 * read, so free_mdstat() on it releases everything.
+	 */
 	struct mdstat_ent *mdstat = mdstat_read(0, 0);
+	struct mdstat_ent *ent;
 
-	while (mdstat) {
+	for (ent = mdstat; ent; ent = ent->next) {
 		struct dev_member *m;
-		struct mdstat_ent *ent;
-		if (mdstat->metadata_version &&
-		    strncmp(mdstat->metadata_version, "external:", 9) == 0 &&
-		    is_subarray(mdstat->metadata_version+9))
+		if (ent->metadata_version &&
+		    strncmp(ent->metadata_version, "external:", 9) == 0 &&
+		    is_subarray(ent->metadata_version+9))
 			/* don't return subarrays, only containers */
-			;
-		else for (m = mdstat->members; m; m = m->next) {
-				if (strcmp(m->name, name) == 0) {
-					free_mdstat(mdstat->next);
-					mdstat->next = NULL;
-					return mdstat;
-				}
+			continue;
+		for (m = ent->members; m; m = m->next)
+			if (strcmp(m->name, name) == 0) {
+				ent->next = NULL;
+				return ent;
 			}
-		ent = mdstat;
-		mdstat = mdstat->next;
-		ent->next = NULL;
-		free_mdstat(ent);
 	}
+	free_mdstat(mdstat);
 	return NULL;
 }
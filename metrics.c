@@ -0,0 +1,261 @@
+/*
+ * mdadm - manage Linux "md" devices aka RAID arrays.
+ *
+ * Copyright (C) 2010 Neil Brown <neilb@suse.de>
+ *
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *    Author: Neil Brown
+ *    Email: <neilb@suse.de>
+ */
+
+/*
+ * Metrics for the arrays --monitor is watching, in the Prometheus text
+ * format, so a collector can read one file rather than run
+ * "mdadm --detail" for every array.
+ *
+ * After each pass over the arrays Monitor hands us what it found
+ * through metrics_array(), and we add what sysfs says about sync
+ * progress, mismatches, the stripe cache and each member.  The format
+ * wants every sample of a metric together under one HELP/TYPE header,
+ * so samples are gathered per metric and the whole file is written
+ * at the end with write_file_atomic().
+ */
+
+#include "mdadm.h"
+#include <stdarg.h>
+
+enum metric {
+	M_RAID_DISKS,
+	M_DISKS,
+	M_DEGRADED,
+	M_DEGRADED_SECONDS,
+	M_STATE,
+	M_SYNC_ACTION,
+	M_SYNC_COMPLETED,
+	M_SYNC_SPEED,
+	M_MISMATCH,
+	M_STRIPE_CACHE,
+	M_MEMBER_STATE,
+	M_MEMBER_ERRORS,
+	M_UPDATED,
+	M_COUNT
+};
+
+static struct {
+	char *name, *help;
+} metric_info[M_COUNT] = {
+	[M_RAID_DISKS] = { "mdadm_array_raid_disks",
+			   "Devices the array should have" },
+	[M_DISKS] = { "mdadm_array_disks",
+		      "Devices in the array by state, as Monitor last saw them" },
+	[M_DEGRADED] = { "mdadm_array_degraded",
+			 "Devices missing from the array" },
+	[M_DEGRADED_SECONDS] = { "mdadm_array_degraded_seconds",
+				 "How long Monitor has seen the array degraded" },
+	[M_STATE] = { "mdadm_array_state",
+		      "The array's array_state" },
+	[M_SYNC_ACTION] = { "mdadm_array_sync_action",
+			    "The array's sync_action" },
+	[M_SYNC_COMPLETED] = { "mdadm_array_sync_completed",
+			       "Fraction of the current resync, recovery, check or reshape done" },
+	[M_SYNC_SPEED] = { "mdadm_array_sync_speed_bytes",
+			   "Current sync speed in bytes per second" },
+	[M_MISMATCH] = { "mdadm_array_mismatch_sectors",
+			 "mismatch_cnt from the last check or repair" },
+	[M_STRIPE_CACHE] = { "mdadm_array_stripe_cache_active",
+			     "Active entries in the RAID4/5/6 stripe cache" },
+	[M_MEMBER_STATE] = { "mdadm_member_state",
+			     "Each flag in a member's state" },
+	[M_MEMBER_ERRORS] = { "mdadm_member_errors",
+			      "Read errors corrected on a member" },
+	[M_UPDATED] = { "mdadm_monitor_updated_seconds",
+			"When these metrics were written" },
+};
+
+struct metrics {
+	char *path;
+	struct {
+		char *buf;
+		size_t len, size;
+	} m[M_COUNT];
+};
+
+static void add(struct metrics *mt, enum metric which, char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	while (1) {
+		size_t room = mt->m[which].size - mt->m[which].len;
+		va_start(ap, fmt);
+		n = vsnprintf(mt->m[which].buf + mt->m[which].len, room,
+			      fmt, ap);
+		va_end(ap);
+		if (n < 0)
+			return;
+		if ((size_t)n < room)
+			break;
+		room = mt->m[which].size ? mt->m[which].size * 2 : 1024;
+		while (room < mt->m[which].len + n + 1)
+			room *= 2;
+		if (!(mt->m[which].buf = realloc(mt->m[which].buf, room))) {
+			mt->m[which].size = mt->m[which].len = 0;
+			return;
+		}
+		mt->m[which].size = room;
+	}
+	mt->m[which].len += n;
+}
+
+struct metrics *metrics_open(void)
+{
+	/* Metrics go to MDADM_MONITOR_METRICS, if it is set */
+	char *path = getenv("MDADM_MONITOR_METRICS");
+	struct metrics *mt;
+
+	if (!path || !*path)
+		return NULL;
+	mt = calloc(1, sizeof(*mt));
+	if (!mt)
+		return NULL;
+	mt->path = path;
+	return mt;
+}
+
+static int get_word(struct mdinfo *sra, struct mdinfo *dev, char *name,
+		    char *buf, int len)
+{
+	int n = sysfs_get_str(sra, dev, name, buf, len);
+
+	if (n <= 0)
+		return 0;
+	buf[strcspn(buf, "\n")] = 0;
+	return buf[0] != 0;
+}
+
+void metrics_array(struct metrics *mt, int devnum, int active, int working,
+		   int failed, int spare, int raid_disks, long degraded_secs)
+{
+	struct mdinfo *sra, *sd;
+	char *dev = devnum2devname(devnum);
+	char buf[100];
+	unsigned long long a, b;
+
+	if (!mt || !dev)
+		return;
+	add(mt, M_RAID_DISKS, "{array=\"%s\"} %d\n", dev, raid_disks);
+	add(mt, M_DISKS, "{array=\"%s\",state=\"active\"} %d\n", dev, active);
+	add(mt, M_DISKS, "{array=\"%s\",state=\"working\"} %d\n", dev, working);
+	add(mt, M_DISKS, "{array=\"%s\",state=\"failed\"} %d\n", dev, failed);
+	add(mt, M_DISKS, "{array=\"%s\",state=\"spare\"} %d\n", dev, spare);
+	add(mt, M_DEGRADED_SECONDS, "{array=\"%s\"} %ld\n", dev, degraded_secs);
+
+	sra = sysfs_read(-1, devnum, GET_LEVEL|GET_DEVS);
+	if (!sra) {
+		free(dev);
+		return;
+	}
+	if (sysfs_get_ll(sra, NULL, "degraded", &a) == 0)
+		add(mt, M_DEGRADED, "{array=\"%s\"} %llu\n", dev, a);
+	if (get_word(sra, NULL, "array_state", buf, sizeof(buf)))
+		add(mt, M_STATE, "{array=\"%s\",state=\"%s\"} 1\n", dev, buf);
+	if (get_word(sra, NULL, "sync_action", buf, sizeof(buf)))
+		add(mt, M_SYNC_ACTION, "{array=\"%s\",action=\"%s\"} 1\n",
+		    dev, buf);
+	/* "done / total" in sectors, or "none" */
+	if (get_word(sra, NULL, "sync_completed", buf, sizeof(buf)) &&
+	    sscanf(buf, "%llu / %llu", &a, &b) == 2 && b)
+		add(mt, M_SYNC_COMPLETED, "{array=\"%s\"} %.4f\n", dev,
+		    (double)a / b);
+	/* K/sec, or "none" */
+	if (get_word(sra, NULL, "sync_speed", buf, sizeof(buf)))
+		add(mt, M_SYNC_SPEED, "{array=\"%s\"} %llu\n", dev,
+		    strtoull(buf, NULL, 10) * 1024);
+	if (sysfs_get_ll(sra, NULL, "mismatch_cnt", &a) == 0)
+		add(mt, M_MISMATCH, "{array=\"%s\"} %llu\n", dev, a);
+	if (sra->array.level >= 4 && sra->array.level <= 6 &&
+	    sysfs_get_ll(sra, NULL, "stripe_cache_active", &a) == 0)
+		add(mt, M_STRIPE_CACHE, "{array=\"%s\"} %llu\n", dev, a);
+
+	for (sd = sra->devs; sd; sd = sd->next) {
+		char *member = sd->sys_name + 4;	/* skip "dev-" */
+		char slot[12], *f, *sp;
+
+		if (sd->disk.raid_disk >= 0)
+			sprintf(slot, "%d", sd->disk.raid_disk);
+		else
+			strcpy(slot, "none");
+		if (get_word(sra, sd, "state", buf, sizeof(buf)))
+			for (f = strtok_r(buf, ",", &sp); f;
+			     f = strtok_r(NULL, ",", &sp))
+				add(mt, M_MEMBER_STATE,
+				    "{array=\"%s\",member=\"%s\",slot=\"%s\",state=\"%s\"} 1\n",
+				    dev, member, slot, f);
+		if (sysfs_get_ll(sra, sd, "errors", &a) == 0)
+			add(mt, M_MEMBER_ERRORS,
+			    "{array=\"%s\",member=\"%s\",slot=\"%s\"} %llu\n",
+			    dev, member, slot, a);
+	}
+	sysfs_free(sra);
+	free(dev);
+}
+
+static void metrics_fill(FILE *f, void *arg)
+{
+	struct metrics *mt = arg;
+	int i;
+
+	for (i = 0; i < M_COUNT; i++) {
+		char *p, *e;
+		if (!mt->m[i].len)
+			continue;
+		fprintf(f, "# HELP %s %s\n# TYPE %s gauge\n",
+			metric_info[i].name, metric_info[i].help,
+			metric_info[i].name);
+		/* each line is a sample; put the name in front */
+		for (p = mt->m[i].buf; *p; p = e + 1) {
+			e = strchr(p, '\n');
+			fprintf(f, "%s%.*s\n", metric_info[i].name,
+				(int)(e - p), p);
+		}
+	}
+}
+
+int metrics_write(struct metrics *mt)
+{
+	/* Write everything gathered since the last call, and start again */
+	int i, rv;
+
+	if (!mt)
+		return 0;
+	add(mt, M_UPDATED, " %ld\n", (long)time(0));
+	rv = write_file_atomic(mt->path, metrics_fill, mt);
+	for (i = 0; i < M_COUNT; i++)
+		mt->m[i].len = 0;
+	return rv;
+}
+
+void metrics_close(struct metrics *mt)
+{
+	int i;
+
+	if (!mt)
+		return;
+	for (i = 0; i < M_COUNT; i++)
+		free(mt->m[i].buf);
+	free(mt);
+}
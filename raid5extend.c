@@ -1,80 +1,520 @@
+/*
+ * mdadm - manage Linux "md" devices aka RAID arrays.
+ *
+ * Copyright (C) 2010 Neil Brown <neilb@suse.de>
+ *
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *    Author: Neil Brown
+ *    Email: <neilb@suse.de>
+ */
 
-int phys2log(int phys, int stripe, int n, int layout)
+/*
+ * Offline restripe: move the data of an 'old_disks' array to the same
+ * level and layout over 'new_disks' devices, without the kernel.
+ * This is for image files and arrays that are not running, so it can
+ * go as fast as the devices allow.
+ *
+ * Data is read a batch of old stripes at a time, one large pread per
+ * member.  New stripes are assembled from pointers into the read
+ * buffers, so data is not copied, and parity comes from the restripe.c
+ * kernels.  Each new member is then written with a single pwritev.
+ * While one batch is being written the next is being read into the
+ * other buffer.  Chunks left over after the last complete new stripe
+ * are carried into the next batch.  If the old array is not a whole
+ * number of new stripes, the last new stripe is padded with zeros.
+ *
+ * Growing in place (the same devices, at the same offsets, appear in
+ * both lists) is safe in normal running.  New stripe N overwrites old
+ * stripe N, and only once every chunk in it has already been read.
+ *
+ * With a checkpoint file ('ckfd') the work can be stopped, either by
+ * 'limit' or by a crash, and started again.  After each batch the new
+ * members are synced and the number of new stripes done is recorded.
+ * On restart the old stripes that still hold the data for the next new
+ * stripe are read again.  For that to work in place, we must never
+ * overwrite old stripes at or beyond the checkpoint's restart point.
+ * Near the start of the array that would allow no progress at all.
+ * There each new stripe is first written to a journal in the
+ * checkpoint file, which is replayed on restart.  This affects only a
+ * few stripes: old_data/(new_data-old_data) of them.
+ */
+
+#include "mdadm.h"
+
+#define EXTEND_BATCH_BYTES (16*1024*1024)
+#define EXTEND_JOURNAL 4096	/* offset of journal in checkpoint file */
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+struct extend_checkpoint {
+	char	magic[16];	/* "md_extend-1" */
+	__u32	level, layout, chunk_size;
+	__u32	old_disks, new_disks;
+	__u32	journal;	/* 1 if the journal holds new stripe 'done' */
+	__u64	length;		/* bytes of array data being moved */
+	__u64	done;		/* new stripes completely written */
+	__u32	csum;		/* of the preceding bytes */
+	__u8	pad[512-60];
+};
+
+struct extend {
+	int level, layout, chunk_size;
+	int old_disks, new_disks;
+	int dn, dm, np;		/* old and new data disks, parity disks */
+	int *wfds;
+	unsigned long long *woffsets;
+	struct io_pool *pool;
+	struct io_req *wreqs;
+	struct iovec *iov;
+	int maxnew;		/* most new stripes written at once */
+	char **ptrs;		/* maxnew * new_disks */
+	char *par;		/* maxnew * np chunks */
+	char *zbuf;		/* a chunk of zeros, for padding */
+};
+
+static __u32 ck_csum(struct extend_checkpoint *ck)
 {
-    /* In an 'n' disk array using 'layout',
-     * in stripe 'stripe', the physical disc 'phys'
-     * stores what logical chunk?
-     * -1 mean parity.
-     *
-     */
-    switch(layout) {
-    case ALGORITHM_LEFT_ASYMMETRIC:
-	pd = (n-1) - (stripe % n);
-	if (phys < pd)
-	    return phys;
-	else if (phys == pd)
-	    return -1;
-	else return phys-1;
-
-    case ALGORITHM_RIGHT_ASYMMETRIC:
-	pd = stripe % n;
-	if (phys < pd)
-	    return phys;
-	else if (phys == pd)
-	    return -1;
-	else return phys-1;
-
-    case ALGORITHM_LEFT_SYMMETRIC:
-	pd = (n-1) - (stripe %n);
-	if (phys < pd)
-	    return phys+ n-1-pd;
-	else if (phys == pd)
-	    return -1;
-	else return phys-pd-1;
-
-    case ALGORITHM_RIGHT_SYMMETRIC:
-	pd = stripe % n;
-	if (phys < pd)
-	    return phys+ n-1-pd;
-	else if (phys == pd)
-	    return -1;
-	else return phys-pd-1;
-    }
-    return -2;
+	unsigned char *c = (unsigned char *)ck;
+	int len = offsetof(struct extend_checkpoint, csum);
+	__u32 csum = 0;
+	int i;
+
+	for (i = 0; i < len; i++)
+		csum = (csum << 3) + (csum >> 29) + c[i];
+	return __cpu_to_le32(csum);
 }
 
-raid5_extend(unsigned long len, int chunksize, int layout, int n, int m, int rfds[], int wfds[])
+static int ck_write(int ckfd, struct extend_checkpoint *ck,
+		    unsigned long long done, int journal)
 {
+	ck->done = __cpu_to_le64(done);
+	ck->journal = __cpu_to_le32(journal);
+	ck->csum = ck_csum(ck);
+	if (pwrite(ckfd, ck, sizeof(*ck), 0) != sizeof(*ck) ||
+	    fdatasync(ckfd) != 0)
+		return -1;
+	return 0;
+}
 
-    static char buf[4096];
+static int same_file(int a, int b)
+{
+	struct stat sa, sb;
 
-    unsigned long blocks = len/4;
-    unsigned int blocksperchunk= chunksize/4096;
+	if (fstat(a, &sa) != 0 || fstat(b, &sb) != 0)
+		return 0;
+	if (S_ISBLK(sa.st_mode) && S_ISBLK(sb.st_mode))
+		return sa.st_rdev == sb.st_rdev;
+	return sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
 
-    unsigned long b;
+static int sync_new(struct extend *e)
+{
+	int d, rv = 0;
 
-    for (b=0; b<blocks; b++) {
-	unsigned long stripe = b / blocksperchunk;
-	unsigned int offset = b - (stripe*blocksperchunk);
-	unsigned long chunk = stripe * (n-1);
-	int src;
-	for (src=0; src<n; src++) {
-	    int dnum, snum;
-	    if (read(rfds[src], buf, sizeof(buf)) != sizeof(buf)) {
-		error();
-		return 0;
-	    }
+	for (d = 0; d < e->new_disks; d++) {
+		memset(&e->wreqs[d], 0, sizeof(e->wreqs[d]));
+		e->wreqs[d].op = IO_FDATASYNC;
+		e->wreqs[d].fd = e->wfds[d];
+		io_pool_submit(e->pool, &e->wreqs[d]);
+	}
+	io_pool_wait_reqs(e->pool, e->wreqs, e->new_disks);
+	for (d = 0; d < e->new_disks; d++)
+		if (e->wreqs[d].rv != 0)
+			rv = -1;
+	return rv;
+}
+
+/* Lay out 'cnt' new stripes from 'stripe' onwards, taking data from the
+ * chunks in 'cp' (padding with zeros after 'avail' of them), compute
+ * parity and start writing them.
+ */
+static int write_new(struct extend *e, char **cp, int avail,
+		     unsigned long long stripe, int cnt)
+{
+	int chunk = e->chunk_size;
+	int j, k, d;
+
+	for (j = 0; j < cnt; j++) {
+		char **p = e->ptrs + j * e->new_disks;
+		int *l2p = stripe_map(e->level, e->layout, e->new_disks,
+				      stripe + j);
+
+		if (!l2p)
+			return -2;
+		for (k = 0; k < e->dm; k++)
+			p[l2p[k]] = j*e->dm + k < avail ? cp[j*e->dm + k]
+				: e->zbuf;
+		for (k = 0; k < e->np; k++)
+			p[l2p[e->dm + k]] = e->par + (j*e->np + k) * chunk;
+		if (make_parity(p, e->new_disks, chunk, e->level, e->layout,
+				stripe + j) != 0)
+			return -2;
+	}
+	for (d = 0; d < e->new_disks; d++) {
+		struct iovec *v = e->iov + d * e->maxnew;
+		struct io_req *r = &e->wreqs[d];
+
+		for (j = 0; j < cnt; j++) {
+			v[j].iov_base = e->ptrs[j * e->new_disks + d];
+			v[j].iov_len = chunk;
+		}
+		memset(r, 0, sizeof(*r));
+		r->op = IO_WRITEV;
+		r->fd = e->wfds[d];
+		r->iov = v;
+		r->iovcnt = cnt;
+		r->offset = e->woffsets[d] + stripe * chunk;
+		io_pool_submit(e->pool, r);
+	}
+	return 0;
+}
+
+static int wait_new(struct extend *e, int cnt)
+{
+	int d, rv = 0;
+
+	io_pool_wait_reqs(e->pool, e->wreqs, e->new_disks);
+	for (d = 0; d < e->new_disks; d++)
+		if (e->wreqs[d].rv != (ssize_t)cnt * e->chunk_size)
+			rv = -1;
+	return rv;
+}
+
+static void read_old(struct io_req *rreqs, int *rfds,
+		     unsigned long long *roffsets, int old_disks,
+		     int chunk_size, int batch, char *buf,
+		     unsigned long long stripe, int cnt, struct io_pool *pool)
+{
+	int d;
+
+	for (d = 0; d < old_disks; d++) {
+		struct io_req *r = &rreqs[d];
+
+		memset(r, 0, sizeof(*r));
+		r->op = IO_READ;
+		r->fd = rfds[d];
+		r->buf = buf + (size_t)d * batch * chunk_size;
+		r->len = (size_t)cnt * chunk_size;
+		r->offset = roffsets[d] + stripe * chunk_size;
+		io_pool_submit(pool, r);
+	}
+}
+
+/* Returns 0 when the whole array has been moved, 1 if we stopped
+ * early because of 'limit', -1 for an I/O error, -2 if out of memory,
+ * and -3 if the request does not make sense (including a checkpoint
+ * for some other geometry).
+ */
+int raid5_extend(int level, int layout, int chunk_size,
+		 int old_disks, int *rfds, unsigned long long *roffsets,
+		 int new_disks, int *wfds, unsigned long long *woffsets,
+		 unsigned long long length, int ckfd,
+		 unsigned long long limit)
+{
+	struct extend e;
+	struct extend_checkpoint ck;
+	struct io_req *rreqs = NULL;
+	char *src[2] = { NULL, NULL };
+	char *carry = NULL;
+	char **cp = NULL;
+	unsigned long long src_stripes, new_stripes;
+	unsigned long long D = 0, next, stop;
+	unsigned long long rd_start = 0;
+	int rd_cnt = 0, reading = 0;
+	int batch, cap, cc = 0, skip, cur = 0;
+	int inplace = 0;
+	int i, j;
+	int rv = -2;
+
+	memset(&e, 0, sizeof(e));
+	e.level = level;
+	e.layout = layout;
+	e.chunk_size = chunk_size;
+	e.old_disks = old_disks;
+	e.new_disks = new_disks;
+	e.np = level == 6 ? 2 : 1;
+	e.dn = old_disks - e.np;
+	e.dm = new_disks - e.np;
+	e.wfds = wfds;
+	e.woffsets = woffsets;
+
+	if (level < 4 || level > 6 || e.dn < 1 || e.dm < 1 ||
+	    chunk_size <= 0 || chunk_size % 512 ||
+	    length % ((unsigned long long)chunk_size * e.dn))
+		return -3;
+	for (i = 0; i < old_disks; i++)
+		if (rfds[i] < 0)
+			return -3;
+	for (i = 0; i < new_disks; i++)
+		if (wfds[i] < 0)
+			return -3;
+	for (i = 0; i < old_disks; i++)
+		for (j = 0; j < new_disks; j++)
+			if (same_file(rfds[i], wfds[j])) {
+				/* only safe if nothing moves sideways */
+				if (i != j || roffsets[i] != woffsets[j])
+					return -3;
+				inplace = 1;
+			}
+	if (inplace && e.dm < e.dn)
+		return -3;
+
+	src_stripes = length / chunk_size / e.dn;
+	new_stripes = (length / chunk_size + e.dm - 1) / e.dm;
+
+	batch = EXTEND_BATCH_BYTES / (old_disks * chunk_size);
+	if (batch < 1)
+		batch = 1;
+	/* chunks we may hold: one batch plus what was carried over */
+	cap = batch * e.dn + e.dm;
+	e.maxnew = cap / e.dm + 1;
+	if (e.maxnew > IOV_MAX)
+		e.maxnew = IOV_MAX;
+
+	e.ptrs = malloc(e.maxnew * new_disks * sizeof(char*));
+	e.iov = malloc(e.maxnew * new_disks * sizeof(struct iovec));
+	e.wreqs = malloc(new_disks * sizeof(struct io_req));
+	rreqs = malloc(old_disks * sizeof(struct io_req));
+	cp = malloc(cap * sizeof(char*));
+	if (posix_memalign((void**)&src[0], 4096,
+			   (size_t)old_disks * batch * chunk_size))
+		src[0] = NULL;
+	if (posix_memalign((void**)&src[1], 4096,
+			   (size_t)old_disks * batch * chunk_size))
+		src[1] = NULL;
+	if (posix_memalign((void**)&carry, 4096, (size_t)cap * chunk_size))
+		carry = NULL;
+	if (posix_memalign((void**)&e.par, 4096,
+			   (size_t)e.maxnew * e.np * chunk_size))
+		e.par = NULL;
+	if (posix_memalign((void**)&e.zbuf, 4096, chunk_size))
+		e.zbuf = NULL;
+	if (!e.ptrs || !e.iov || !e.wreqs || !rreqs || !cp ||
+	    !src[0] || !src[1] || !carry || !e.par || !e.zbuf)
+		goto out;
+	memset(e.zbuf, 0, chunk_size);
+	e.pool = io_pool_create(old_disks + new_disks);
+
+	if (ckfd >= 0) {
+		if (pread(ckfd, &ck, sizeof(ck), 0) == sizeof(ck) &&
+		    memcmp(ck.magic, "md_extend-1", 12) == 0 &&
+		    ck.csum == ck_csum(&ck)) {
+			if (__le32_to_cpu(ck.level) != (unsigned)level ||
+			    __le32_to_cpu(ck.layout) != (unsigned)layout ||
+			    __le32_to_cpu(ck.chunk_size) != (unsigned)chunk_size ||
+			    __le32_to_cpu(ck.old_disks) != (unsigned)old_disks ||
+			    __le32_to_cpu(ck.new_disks) != (unsigned)new_disks ||
+			    __le64_to_cpu(ck.length) != length) {
+				rv = -3;
+				goto out;
+			}
+			D = __le64_to_cpu(ck.done);
+			if (D > new_stripes) {
+				rv = -3;
+				goto out;
+			}
+			if (__le32_to_cpu(ck.journal)) {
+				/* The data for new stripe D is in the journal,
+				 * but stripe D may be half written and the old
+				 * data under it is gone.  Write it again.
+				 */
+				rv = -1;
+				for (i = 0; i < e.dm; i++)
+					cp[i] = carry + (size_t)i * chunk_size;
+				if (pread(ckfd, carry, (size_t)e.dm * chunk_size,
+					  EXTEND_JOURNAL) != (ssize_t)e.dm * chunk_size)
+					goto out;
+				if ((rv = write_new(&e, cp, e.dm, D, 1)) != 0 ||
+				    (rv = wait_new(&e, 1)) != 0 ||
+				    (rv = sync_new(&e)) != 0 ||
+				    (rv = ck_write(ckfd, &ck, D+1, 0)) != 0)
+					goto out;
+				D++;
+			}
+		} else {
+			memset(&ck, 0, sizeof(ck));
+			strcpy(ck.magic, "md_extend-1");
+			ck.level = __cpu_to_le32(level);
+			ck.layout = __cpu_to_le32(layout);
+			ck.chunk_size = __cpu_to_le32(chunk_size);
+			ck.old_disks = __cpu_to_le32(old_disks);
+			ck.new_disks = __cpu_to_le32(new_disks);
+			ck.length = __cpu_to_le64(length);
+			if (ck_write(ckfd, &ck, 0, 0) != 0) {
+				rv = -1;
+				goto out;
+			}
+		}
+	}
+
+	stop = new_stripes;
+	if (limit && D + limit < stop)
+		stop = D + limit;
+	/* the old stripe holding the first chunk of new stripe D */
+	next = D * e.dm / e.dn;
+	skip = D * e.dm - next * e.dn;
+
+	rv = 0;
+	while (D < stop) {
+		int avail = cc, full, left;
+		int journal = 0;
+
+		if (!reading && next < src_stripes && cc <= e.dm) {
+			rd_start = next;
+			rd_cnt = batch;
+			if ((unsigned long long)rd_cnt > src_stripes - next)
+				rd_cnt = src_stripes - next;
+			read_old(rreqs, rfds, roffsets, old_disks, chunk_size,
+				 batch, src[cur], rd_start, rd_cnt, e.pool);
+			next += rd_cnt;
+			reading = 1;
+		}
+
+		for (i = 0; i < cc; i++)
+			cp[i] = carry + (size_t)i * chunk_size;
+		if (reading) {
+			io_pool_wait_reqs(e.pool, rreqs, old_disks);
+			reading = 0;
+			for (i = 0; i < old_disks; i++)
+				if (rreqs[i].rv != (ssize_t)rd_cnt * chunk_size)
+					rv = -1;
+			if (rv)
+				break;
+			for (j = 0; j < rd_cnt; j++) {
+				int *l2p = stripe_map(level, layout, old_disks,
+						      rd_start + j);
+				if (!l2p) {
+					rv = -2;
+					break;
+				}
+				for (i = skip; i < e.dn; i++)
+					cp[avail++] = src[cur]
+						+ ((size_t)l2p[i] * batch + j)
+						* chunk_size;
+				skip = 0;
+			}
+			if (rv)
+				break;
+		}
+
+		full = avail / e.dm;
+		if (next >= src_stripes && avail % e.dm)
+			/* the end: pad the last new stripe */
+			full++;
+		if ((unsigned long long)full > stop - D)
+			full = stop - D;
+		if (full > e.maxnew)
+			full = e.maxnew;
+		if (inplace && ckfd >= 0) {
+			/* don't overwrite what a restart would read */
+			unsigned long long safe = D * e.dm / e.dn;
+			if (D + full > safe) {
+				if (safe > D)
+					full = safe - D;
+				else if (full) {
+					full = 1;
+					journal = 1;
+				}
+			}
+		}
+		if (!full && next >= src_stripes) {
+			/* nothing to write and nothing left to read */
+			rv = -3;
+			break;
+		}
+		left = avail - full * e.dm;
+		if (left < 0)
+			left = 0;
+
+		if (journal) {
+			struct iovec *v = e.iov;
+			struct io_req r;
+
+			for (i = 0; i < e.dm; i++) {
+				v[i].iov_base = i < avail ? cp[i] : e.zbuf;
+				v[i].iov_len = chunk_size;
+			}
+			memset(&r, 0, sizeof(r));
+			r.op = IO_WRITEV;
+			r.fd = ckfd;
+			r.iov = v;
+			r.iovcnt = e.dm;
+			r.offset = EXTEND_JOURNAL;
+			io_pool_submit(NULL, &r);
+			if (r.rv != (ssize_t)e.dm * chunk_size ||
+			    ck_write(ckfd, &ck, D, 1) != 0) {
+				rv = -1;
+				break;
+			}
+		}
+		if (full && (rv = write_new(&e, cp, avail, D, full)) != 0)
+			break;
 
-	    snum = phys2log(src, stripe, n, layout);
+		/* start on the next batch while those are written */
+		if (next < src_stripes && left <= e.dm) {
+			rd_start = next;
+			rd_cnt = batch;
+			if ((unsigned long long)rd_cnt > src_stripes - next)
+				rd_cnt = src_stripes - next;
+			read_old(rreqs, rfds, roffsets, old_disks, chunk_size,
+				 batch, src[1-cur], rd_start, rd_cnt, e.pool);
+			next += rd_cnt;
+			reading = 1;
+		}
 
-	    if (snum == -1)
-		continue;
-	    chunk = stripe*(n-1)+snum;
+		if (full) {
+			if (wait_new(&e, full) != 0 ||
+			    (ckfd >= 0 &&
+			     (sync_new(&e) != 0 ||
+			      ck_write(ckfd, &ck, D + full, 0) != 0))) {
+				rv = -1;
+				break;
+			}
+		}
 
-	    dstripe = chunk/(m-1);
-	    dnum = log2phys(chunk-(stripe*(m-1)), dstripe, m, layout);
-	    llseek(wfds[dnum], dstripe*chunksize+(offset*4096), 0);
-	    write(wfds[dnum], buf, sizeof(buf));
+		/* keep what is left for next time */
+		for (i = 0; i < left; i++)
+			if (cp[full * e.dm + i] != carry + (size_t)i * chunk_size)
+				memmove(carry + (size_t)i * chunk_size,
+					cp[full * e.dm + i], chunk_size);
+		cc = left;
+		D += full;
+		if (reading)
+			cur = 1 - cur;
 	}
-    }
+	if (reading)
+		/* don't free the buffer under an outstanding read */
+		io_pool_wait_reqs(e.pool, rreqs, old_disks);
+	if (rv == 0 && ckfd < 0 && sync_new(&e) != 0)
+		rv = -1;
+	if (rv == 0 && D < new_stripes)
+		rv = 1;
+out:
+	io_pool_destroy(e.pool);
+	free(e.ptrs);
+	free(e.iov);
+	free(e.wreqs);
+	free(e.par);
+	free(e.zbuf);
+	free(rreqs);
+	free(cp);
+	free(src[0]);
+	free(src[1]);
+	free(carry);
+	return rv;
 }
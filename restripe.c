@@ -205,11 +205,138 @@ static int is_ddf(int layout)
 	}
 }
 
+/* Every layout above repeats after a fixed number of stripes, so rather
+ * than calling geo_map() for every block of every stripe we build a
+ * table for one period and index it by 'stripe % period'.
+ * For each phase we keep:
+ *   l2p: logical block -> physical disk, with P at [data_disks]
+ *        and Q at [data_disks+1] (the order save_stripes reads in)
+ *   p2l: physical disk -> logical block, -1 for P, -2 for Q
+ *   syn: for md raid6, the physical disks in Q-syndrome order,
+ *        which starts just after Q and skips P.
+ * Tables are built on first use and kept for the life of the process.
+ */
+struct layout_map {
+	int level, layout, raid_disks;
+	int data_disks;
+	int period;
+	int *l2p, *p2l, *syn;
+	struct layout_map *next;
+};
+
+static int geo_period(int level, int layout, int raid_disks)
+{
+	if (level == 6 &&
+	    (layout == ALGORITHM_LEFT_ASYMMETRIC_6 ||
+	     layout == ALGORITHM_RIGHT_ASYMMETRIC_6 ||
+	     layout == ALGORITHM_LEFT_SYMMETRIC_6 ||
+	     layout == ALGORITHM_RIGHT_SYMMETRIC_6))
+		/* Q is fixed, P rotates over the rest */
+		return raid_disks - 1;
+	return raid_disks;
+}
+
+static struct layout_map *layout_maps;
+
+static struct layout_map *layout_lookup(int level, int layout, int raid_disks)
+{
+	struct layout_map *lm;
+	int data_disks = raid_disks - (level == 0 ? 0 : level <= 5 ? 1 : 2);
+	int parity = raid_disks - data_disks;
+	int ph, i;
+
+	for (lm = layout_maps; lm; lm = lm->next)
+		if (lm->level == level && lm->layout == layout &&
+		    lm->raid_disks == raid_disks)
+			return lm;
+
+	lm = malloc(sizeof(*lm));
+	if (!lm)
+		return NULL;
+	lm->level = level;
+	lm->layout = layout;
+	lm->raid_disks = raid_disks;
+	lm->data_disks = data_disks;
+	lm->period = geo_period(level, layout, raid_disks);
+	lm->l2p = malloc(3 * lm->period * raid_disks * sizeof(int));
+	if (!lm->l2p) {
+		free(lm);
+		return NULL;
+	}
+	lm->p2l = lm->l2p + lm->period * raid_disks;
+	lm->syn = lm->p2l + lm->period * raid_disks;
+
+	for (ph = 0; ph < lm->period; ph++) {
+		int *l2p = lm->l2p + ph * raid_disks;
+		int *p2l = lm->p2l + ph * raid_disks;
+		int *syn = lm->syn + ph * raid_disks;
+
+		for (i = 0; i < raid_disks; i++)
+			p2l[i] = syn[i] = -3;
+		for (i = 0; i < data_disks + parity; i++) {
+			int block = i < data_disks ? i : data_disks - i - 1;
+			int d = geo_map(block, ph, raid_disks, level, layout);
+			if (d < 0 || d >= raid_disks) {
+				/* geo_map() doesn't know this layout */
+				free(lm->l2p);
+				free(lm);
+				return NULL;
+			}
+			l2p[i] = d;
+			p2l[d] = block;
+		}
+		if (level == 6) {
+			int pd = l2p[data_disks], qd = l2p[data_disks+1];
+			int j, s = 0;
+			for (j = 0; j < raid_disks; j++) {
+				int d = (qd + 1 + j) % raid_disks;
+				if (d != pd && d != qd)
+					syn[s++] = d;
+			}
+		}
+	}
+	lm->next = layout_maps;
+	layout_maps = lm;
+	return lm;
+}
 
-static void xor_blocks(char *target, char **sources, int disks, int size)
+static inline int *lm_l2p(struct layout_map *lm, unsigned long long stripe)
+{
+	return lm->l2p + (stripe % lm->period) * lm->raid_disks;
+}
+static inline int *lm_p2l(struct layout_map *lm, unsigned long long stripe)
+{
+	return lm->p2l + (stripe % lm->period) * lm->raid_disks;
+}
+static inline int *lm_syn(struct layout_map *lm, unsigned long long stripe)
+{
+	return lm->syn + (stripe % lm->period) * lm->raid_disks;
+}
+
+int layout_supported(int level, int layout, int raid_disks)
+{
+	/* Can save, restore and check stripes of this geometry? */
+	return layout_lookup(level, layout, raid_disks) != NULL;
+}
+
+
+/* Parity (xor) kernels.
+ * Every chunk that is backed up or restored during a reshape passes
+ * through xor_blocks(), so we keep a small table of implementations
+ * and impl_pick() chooses one the first time it is needed.
+ * The SIMD versions are only built for x86 with a compiler that
+ * understands per-function target attributes.
+ */
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && __GNUC__ >= 5
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+typedef void (*xor_fn)(char *target, char **sources, int disks, int size);
+
+static void xor_blocks_byte(char *target, char **sources, int disks, int size)
 {
 	int i, j;
-	/* Amazingly inefficient... */
 	for (i=0; i<size; i++) {
 		char c = 0;
 		for (j=0 ; j<disks; j++)
@@ -218,7 +345,216 @@ static void xor_blocks(char *target, char **sources, int disks, int size)
 	}
 }
 
-static void qsyndrome(uint8_t *p, uint8_t *q, uint8_t **sources, int disks, int size)
+static void xor_blocks_word(char *target, char **sources, int disks, int size)
+{
+	/* 64 bits at a time, 4 words per pass.  memcpy keeps this safe
+	 * for unaligned buffers and compiles to plain loads where
+	 * alignment doesn't matter.
+	 */
+	int i, j;
+	for (i = 0; i + 32 <= size; i += 32) {
+		uint64_t w[4], s[4];
+		memcpy(w, sources[0] + i, 32);
+		for (j = 1; j < disks; j++) {
+			memcpy(s, sources[j] + i, 32);
+			w[0] ^= s[0]; w[1] ^= s[1];
+			w[2] ^= s[2]; w[3] ^= s[3];
+		}
+		memcpy(target + i, w, 32);
+	}
+	if (i < size) {
+		char *tail[disks];
+		for (j = 0; j < disks; j++)
+			tail[j] = sources[j] + i;
+		xor_blocks_byte(target + i, tail, disks, size - i);
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+static void xor_tail(char *target, char **sources, int disks, int done, int size)
+{
+	int j;
+	if (done < size) {
+		char *tail[disks];
+		for (j = 0; j < disks; j++)
+			tail[j] = sources[j] + done;
+		xor_blocks_word(target + done, tail, disks, size - done);
+	}
+}
+
+__attribute__((target("sse2")))
+static void xor_blocks_sse2(char *target, char **sources, int disks, int size)
+{
+	int i, j;
+	for (i = 0; i + 64 <= size; i += 64) {
+		__m128i a = _mm_loadu_si128((__m128i*)(sources[0]+i));
+		__m128i b = _mm_loadu_si128((__m128i*)(sources[0]+i+16));
+		__m128i c = _mm_loadu_si128((__m128i*)(sources[0]+i+32));
+		__m128i d = _mm_loadu_si128((__m128i*)(sources[0]+i+48));
+		for (j = 1; j < disks; j++) {
+			char *s = sources[j] + i;
+			a = _mm_xor_si128(a, _mm_loadu_si128((__m128i*)s));
+			b = _mm_xor_si128(b, _mm_loadu_si128((__m128i*)(s+16)));
+			c = _mm_xor_si128(c, _mm_loadu_si128((__m128i*)(s+32)));
+			d = _mm_xor_si128(d, _mm_loadu_si128((__m128i*)(s+48)));
+		}
+		_mm_storeu_si128((__m128i*)(target+i), a);
+		_mm_storeu_si128((__m128i*)(target+i+16), b);
+		_mm_storeu_si128((__m128i*)(target+i+32), c);
+		_mm_storeu_si128((__m128i*)(target+i+48), d);
+	}
+	xor_tail(target, sources, disks, i, size);
+}
+
+__attribute__((target("avx2")))
+static void xor_blocks_avx2(char *target, char **sources, int disks, int size)
+{
+	int i, j;
+	for (i = 0; i + 128 <= size; i += 128) {
+		__m256i a = _mm256_loadu_si256((__m256i*)(sources[0]+i));
+		__m256i b = _mm256_loadu_si256((__m256i*)(sources[0]+i+32));
+		__m256i c = _mm256_loadu_si256((__m256i*)(sources[0]+i+64));
+		__m256i d = _mm256_loadu_si256((__m256i*)(sources[0]+i+96));
+		for (j = 1; j < disks; j++) {
+			char *s = sources[j] + i;
+			a = _mm256_xor_si256(a, _mm256_loadu_si256((__m256i*)s));
+			b = _mm256_xor_si256(b, _mm256_loadu_si256((__m256i*)(s+32)));
+			c = _mm256_xor_si256(c, _mm256_loadu_si256((__m256i*)(s+64)));
+			d = _mm256_xor_si256(d, _mm256_loadu_si256((__m256i*)(s+96)));
+		}
+		_mm256_storeu_si256((__m256i*)(target+i), a);
+		_mm256_storeu_si256((__m256i*)(target+i+32), b);
+		_mm256_storeu_si256((__m256i*)(target+i+64), c);
+		_mm256_storeu_si256((__m256i*)(target+i+96), d);
+	}
+	xor_tail(target, sources, disks, i, size);
+}
+
+__attribute__((target("avx512f")))
+static void xor_blocks_avx512(char *target, char **sources, int disks, int size)
+{
+	int i, j;
+	for (i = 0; i + 256 <= size; i += 256) {
+		__m512i a = _mm512_loadu_si512(sources[0]+i);
+		__m512i b = _mm512_loadu_si512(sources[0]+i+64);
+		__m512i c = _mm512_loadu_si512(sources[0]+i+128);
+		__m512i d = _mm512_loadu_si512(sources[0]+i+192);
+		for (j = 1; j < disks; j++) {
+			char *s = sources[j] + i;
+			a = _mm512_xor_si512(a, _mm512_loadu_si512(s));
+			b = _mm512_xor_si512(b, _mm512_loadu_si512(s+64));
+			c = _mm512_xor_si512(c, _mm512_loadu_si512(s+128));
+			d = _mm512_xor_si512(d, _mm512_loadu_si512(s+192));
+		}
+		_mm512_storeu_si512(target+i, a);
+		_mm512_storeu_si512(target+i+64, b);
+		_mm512_storeu_si512(target+i+128, c);
+		_mm512_storeu_si512(target+i+192, d);
+	}
+	xor_tail(target, sources, disks, i, size);
+}
+#endif /* HAVE_X86_SIMD */
+
+struct xor_template {
+	struct impl impl;
+	xor_fn fn;
+};
+
+#ifdef HAVE_X86_SIMD
+static int have_sse2(void) { return __builtin_cpu_supports("sse2"); }
+static int have_avx2(void) { return __builtin_cpu_supports("avx2"); }
+static int have_avx512(void) { return __builtin_cpu_supports("avx512f"); }
+#endif
+
+/* Best first.  The last entry must always be usable. */
+static struct xor_template xor_templates[] = {
+#ifdef HAVE_X86_SIMD
+	{ { "avx512", have_avx512 }, xor_blocks_avx512 },
+	{ { "avx2", have_avx2 }, xor_blocks_avx2 },
+	{ { "sse2", have_sse2 }, xor_blocks_sse2 },
+#endif
+	{ { "word64", NULL }, xor_blocks_word },
+	{ { "byte", NULL }, xor_blocks_byte },
+	{ { NULL, NULL }, NULL }
+};
+
+static xor_fn xor_impl;
+static char *xor_impl_name;
+
+static int xor_check(void *entry)
+{
+	/* Compare 'entry' against the byte loop over a few awkward
+	 * sizes and alignments.  Return 0 if they always agree.
+	 */
+	xor_fn fn = ((struct xor_template *)entry)->fn;
+	static const int sizes[] = { 1, 31, 64, 257, 4096, 4096+129 };
+	enum { NSRC = 5, LEN = 4096+129+8 };
+	char *mem = malloc((NSRC+2) * LEN);
+	char *srcs[NSRC];
+	unsigned int seed = 1;
+	int rv = 0;
+	int i, s, d;
+
+	if (!mem)
+		return -1;
+	for (i = 0; i < (NSRC+2) * LEN; i++) {
+		seed = seed * 1103515245 + 12345;
+		mem[i] = seed >> 16;
+	}
+	for (s = 0; s < (int)(sizeof(sizes)/sizeof(sizes[0])) && rv == 0; s++)
+		for (d = 1; d <= NSRC && rv == 0; d++) {
+			char *want = mem + NSRC * LEN;
+			char *got = mem + (NSRC+1) * LEN + 3;
+			for (i = 0; i < d; i++)
+				srcs[i] = mem + i * LEN + (i & 7);
+			xor_blocks_byte(want, srcs, d, sizes[s]);
+			fn(got, srcs, d, sizes[s]);
+			if (memcmp(want, got, sizes[s]) != 0)
+				rv = -1;
+		}
+	free(mem);
+	return rv;
+}
+
+static void xor_init(void)
+{
+	struct xor_template *t = impl_pick(xor_templates, sizeof(*t),
+					   xor_check);
+
+	xor_impl_name = t->impl.name;
+	xor_impl = t->fn;
+}
+
+char *xor_blocks_name(void)
+{
+	if (!xor_impl)
+		xor_init();
+	return xor_impl_name;
+}
+
+int xor_selftest(int verbose)
+{
+	return impl_selftest(xor_templates, sizeof(xor_templates[0]),
+			     xor_check, "xor", verbose);
+}
+
+void xor_blocks(char *target, char **sources, int disks, int size)
+{
+	if (!xor_impl)
+		xor_init();
+	xor_impl(target, sources, disks, size);
+}
+
+/* RAID6 syndrome and recovery.
+ * The reference code below works a byte at a time.  Everything else
+ * multiplies by a constant using two 16-entry tables, one for each
+ * nibble (raid6_vgfmul, as in the kernel), so the working set is a
+ * few cache lines rather than the 64K full multiplication table, and
+ * the same tables drive PSHUFB on CPUs that have it.
+ * Callers arrange the sources for md or DDF ordering (DDF passes
+ * 'zero' for the P and Q slots) so nothing here needs to care.
+ */
+static void qsyndrome_byte(uint8_t *p, uint8_t *q, uint8_t **sources, int disks, int size)
 {
 	int d, z;
 	uint8_t wq0, wp0, wd0, w10, w20;
@@ -238,7 +574,6 @@ static void qsyndrome(uint8_t *p, uint8_t *q, uint8_t **sources, int disks, int
 	}
 }
 
-
 /*
  * The following was taken from linux/drivers/md/mktables.c, and modified
  * to create in-memory tables rather than C code
@@ -275,20 +610,39 @@ static uint8_t gfpow(uint8_t a, int b)
 	return v;
 }
 
+uint8_t *zero;
+static int zero_size;
+static int zero_init(int size)
+{
+	/* 'zero' must be at least as big as any chunk we handle */
+	if (zero && zero_size >= size)
+		return 0;
+	free(zero);
+	zero = calloc(1, size);
+	zero_size = zero ? size : 0;
+	return zero ? 0 : -1;
+}
+
 int tables_ready = 0;
-uint8_t raid6_gfmul[256][256];
+uint8_t raid6_vgfmul[256][32] __attribute__((aligned(16)));
 uint8_t raid6_gfexp[256];
 uint8_t raid6_gfinv[256];
 uint8_t raid6_gfexi[256];
+uint8_t raid6_gflog[256];
+static void raid6_init(void);
 void make_tables(void)
 {
 	int i, j;
 	uint8_t v;
 
-	/* Compute multiplication table */
+	/* Compute nibble multiplication tables:
+	 * c*x == vgfmul[c][x & 15] ^ vgfmul[c][16 + (x >> 4)]
+	 */
 	for (i = 0; i < 256; i++)
-		for (j = 0; j < 256; j++)
-				raid6_gfmul[i][j] = gfmul(i, j);
+		for (j = 0; j < 16; j++) {
+			raid6_vgfmul[i][j] = gfmul(i, j);
+			raid6_vgfmul[i][j+16] = gfmul(i, j << 4);
+		}
 
 	/* Compute power-of-2 table (exponent) */
 	v = 1;
@@ -299,6 +653,10 @@ void make_tables(void)
 			v = 0;	/* For entry 255, not a real entry */
 	}
 
+	/* Compute log table, the inverse of the above */
+	for (i = 0; i < 255; i++)
+		raid6_gflog[raid6_gfexp[i]] = i;
+
 	/* Compute inverse table x^-1 == x^254 */
 	for (i = 0; i < 256; i++)
 		raid6_gfinv[i] = gfpow(i, 254);
@@ -308,17 +666,402 @@ void make_tables(void)
 		raid6_gfexi[i] = raid6_gfinv[raid6_gfexp[i] ^ 1];
 
 	tables_ready = 1;
+	raid6_init();
 }
 
-uint8_t *zero;
-/* Following was taken from linux/drivers/md/raid6recov.c */
+static inline uint8_t nibble_mul(const uint8_t *tbl, uint8_t x)
+{
+	return tbl[x & 15] ^ tbl[16 + (x >> 4)];
+}
+
+/* The recovery kernels only see the final step.  With pm the multiplier
+ * table for P (may be NULL) and qm the one for Q:
+ *   2data:  px = p^dp; db = pm*px ^ qm*(q^dq); dq = db; dp = db^px
+ *   datap:  dq = qm*(q^dq); p ^= dq
+ */
+static void recov_2data_scalar(uint8_t *p, uint8_t *q, uint8_t *dp, uint8_t *dq,
+			       const uint8_t *pm, const uint8_t *qm, size_t bytes)
+{
+	uint8_t px, db;
+	while (bytes--) {
+		px = *p++ ^ *dp;
+		db = nibble_mul(pm, px) ^ nibble_mul(qm, *q++ ^ *dq);
+		*dq++ = db;
+		*dp++ = db ^ px;
+	}
+}
+
+static void recov_datap_scalar(uint8_t *p, uint8_t *q, uint8_t *dq,
+			       const uint8_t *qm, size_t bytes)
+{
+	while (bytes--) {
+		*p++ ^= *dq = nibble_mul(qm, *q++ ^ *dq);
+		dq++;
+	}
+}
+
+/* 64-bit SWAR syndrome, as in the kernel's int64 code */
+#define NBYTES(x) ((x) * 0x0101010101010101ULL)
+static inline uint64_t shlbyte(uint64_t v)
+{
+	return (v << 1) & NBYTES(0xfe);
+}
+static inline uint64_t hibmask(uint64_t v)
+{
+	uint64_t vv = v & NBYTES(0x80);
+	return (vv << 1) - (vv >> 7);
+}
+
+static void qsyndrome_word(uint8_t *p, uint8_t *q, uint8_t **sources, int disks, int size)
+{
+	int d, z;
+	for (d = 0; d + 8 <= size; d += 8) {
+		uint64_t wp, wq, wd;
+		memcpy(&wd, sources[disks-1] + d, 8);
+		wp = wq = wd;
+		for (z = disks-2; z >= 0; z--) {
+			memcpy(&wd, sources[z] + d, 8);
+			wp ^= wd;
+			wq = shlbyte(wq) ^ (hibmask(wq) & NBYTES(0x1d)) ^ wd;
+		}
+		memcpy(p + d, &wp, 8);
+		memcpy(q + d, &wq, 8);
+	}
+	if (d < size) {
+		uint8_t *tail[disks];
+		for (z = 0; z < disks; z++)
+			tail[z] = sources[z] + d;
+		qsyndrome_byte(p + d, q + d, tail, disks, size - d);
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+static void qsyndrome_tail(uint8_t *p, uint8_t *q, uint8_t **sources,
+			   int disks, int done, int size)
+{
+	int z;
+	if (done < size) {
+		uint8_t *tail[disks];
+		for (z = 0; z < disks; z++)
+			tail[z] = sources[z] + done;
+		qsyndrome_word(p + done, q + done, tail, disks, size - done);
+	}
+}
+
+__attribute__((target("ssse3")))
+static void qsyndrome_ssse3(uint8_t *p, uint8_t *q, uint8_t **sources, int disks, int size)
+{
+	const __m128i poly = _mm_set1_epi8(0x1d);
+	const __m128i zero = _mm_setzero_si128();
+	int d, z;
+
+	for (d = 0; d + 32 <= size; d += 32) {
+		__m128i wp0, wq0, wp1, wq1, wd0, wd1, w0, w1;
+		wp0 = wq0 = _mm_loadu_si128((__m128i*)(sources[disks-1]+d));
+		wp1 = wq1 = _mm_loadu_si128((__m128i*)(sources[disks-1]+d+16));
+		for (z = disks-2; z >= 0; z--) {
+			wd0 = _mm_loadu_si128((__m128i*)(sources[z]+d));
+			wd1 = _mm_loadu_si128((__m128i*)(sources[z]+d+16));
+			wp0 = _mm_xor_si128(wp0, wd0);
+			wp1 = _mm_xor_si128(wp1, wd1);
+			w0 = _mm_and_si128(_mm_cmpgt_epi8(zero, wq0), poly);
+			w1 = _mm_and_si128(_mm_cmpgt_epi8(zero, wq1), poly);
+			wq0 = _mm_xor_si128(_mm_add_epi8(wq0, wq0), w0);
+			wq1 = _mm_xor_si128(_mm_add_epi8(wq1, wq1), w1);
+			wq0 = _mm_xor_si128(wq0, wd0);
+			wq1 = _mm_xor_si128(wq1, wd1);
+		}
+		_mm_storeu_si128((__m128i*)(p+d), wp0);
+		_mm_storeu_si128((__m128i*)(p+d+16), wp1);
+		_mm_storeu_si128((__m128i*)(q+d), wq0);
+		_mm_storeu_si128((__m128i*)(q+d+16), wq1);
+	}
+	qsyndrome_tail(p, q, sources, disks, d, size);
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i mul_ssse3(__m128i x, __m128i tlo, __m128i thi)
+{
+	const __m128i low4 = _mm_set1_epi8(0x0f);
+	__m128i lo = _mm_and_si128(x, low4);
+	__m128i hi = _mm_and_si128(_mm_srli_epi16(x, 4), low4);
+	return _mm_xor_si128(_mm_shuffle_epi8(tlo, lo),
+			     _mm_shuffle_epi8(thi, hi));
+}
+
+__attribute__((target("ssse3")))
+static void recov_2data_ssse3(uint8_t *p, uint8_t *q, uint8_t *dp, uint8_t *dq,
+			      const uint8_t *pm, const uint8_t *qm, size_t bytes)
+{
+	__m128i plo = _mm_loadu_si128((__m128i*)pm);
+	__m128i phi = _mm_loadu_si128((__m128i*)(pm+16));
+	__m128i qlo = _mm_loadu_si128((__m128i*)qm);
+	__m128i qhi = _mm_loadu_si128((__m128i*)(qm+16));
+	size_t i;
+
+	for (i = 0; i + 16 <= bytes; i += 16) {
+		__m128i px = _mm_xor_si128(_mm_loadu_si128((__m128i*)(p+i)),
+					   _mm_loadu_si128((__m128i*)(dp+i)));
+		__m128i qx = _mm_xor_si128(_mm_loadu_si128((__m128i*)(q+i)),
+					   _mm_loadu_si128((__m128i*)(dq+i)));
+		__m128i db = _mm_xor_si128(mul_ssse3(px, plo, phi),
+					   mul_ssse3(qx, qlo, qhi));
+		_mm_storeu_si128((__m128i*)(dq+i), db);
+		_mm_storeu_si128((__m128i*)(dp+i), _mm_xor_si128(db, px));
+	}
+	recov_2data_scalar(p+i, q+i, dp+i, dq+i, pm, qm, bytes-i);
+}
+
+__attribute__((target("ssse3")))
+static void recov_datap_ssse3(uint8_t *p, uint8_t *q, uint8_t *dq,
+			      const uint8_t *qm, size_t bytes)
+{
+	__m128i qlo = _mm_loadu_si128((__m128i*)qm);
+	__m128i qhi = _mm_loadu_si128((__m128i*)(qm+16));
+	size_t i;
+
+	for (i = 0; i + 16 <= bytes; i += 16) {
+		__m128i qx = _mm_xor_si128(_mm_loadu_si128((__m128i*)(q+i)),
+					   _mm_loadu_si128((__m128i*)(dq+i)));
+		__m128i d = mul_ssse3(qx, qlo, qhi);
+		_mm_storeu_si128((__m128i*)(dq+i), d);
+		_mm_storeu_si128((__m128i*)(p+i),
+				 _mm_xor_si128(_mm_loadu_si128((__m128i*)(p+i)), d));
+	}
+	recov_datap_scalar(p+i, q+i, dq+i, qm, bytes-i);
+}
+
+__attribute__((target("avx2")))
+static void qsyndrome_avx2(uint8_t *p, uint8_t *q, uint8_t **sources, int disks, int size)
+{
+	const __m256i poly = _mm256_set1_epi8(0x1d);
+	const __m256i zero = _mm256_setzero_si256();
+	int d, z;
+
+	for (d = 0; d + 64 <= size; d += 64) {
+		__m256i wp0, wq0, wp1, wq1, wd0, wd1, w0, w1;
+		wp0 = wq0 = _mm256_loadu_si256((__m256i*)(sources[disks-1]+d));
+		wp1 = wq1 = _mm256_loadu_si256((__m256i*)(sources[disks-1]+d+32));
+		for (z = disks-2; z >= 0; z--) {
+			wd0 = _mm256_loadu_si256((__m256i*)(sources[z]+d));
+			wd1 = _mm256_loadu_si256((__m256i*)(sources[z]+d+32));
+			wp0 = _mm256_xor_si256(wp0, wd0);
+			wp1 = _mm256_xor_si256(wp1, wd1);
+			w0 = _mm256_and_si256(_mm256_cmpgt_epi8(zero, wq0), poly);
+			w1 = _mm256_and_si256(_mm256_cmpgt_epi8(zero, wq1), poly);
+			wq0 = _mm256_xor_si256(_mm256_add_epi8(wq0, wq0), w0);
+			wq1 = _mm256_xor_si256(_mm256_add_epi8(wq1, wq1), w1);
+			wq0 = _mm256_xor_si256(wq0, wd0);
+			wq1 = _mm256_xor_si256(wq1, wd1);
+		}
+		_mm256_storeu_si256((__m256i*)(p+d), wp0);
+		_mm256_storeu_si256((__m256i*)(p+d+32), wp1);
+		_mm256_storeu_si256((__m256i*)(q+d), wq0);
+		_mm256_storeu_si256((__m256i*)(q+d+32), wq1);
+	}
+	qsyndrome_tail(p, q, sources, disks, d, size);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i mul_avx2(__m256i x, __m256i tlo, __m256i thi)
+{
+	const __m256i low4 = _mm256_set1_epi8(0x0f);
+	__m256i lo = _mm256_and_si256(x, low4);
+	__m256i hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), low4);
+	return _mm256_xor_si256(_mm256_shuffle_epi8(tlo, lo),
+				_mm256_shuffle_epi8(thi, hi));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i table_avx2(const uint8_t *t)
+{
+	/* the same 16 entries in both lanes, as vpshufb works per lane */
+	return _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i*)t));
+}
+
+__attribute__((target("avx2")))
+static void recov_2data_avx2(uint8_t *p, uint8_t *q, uint8_t *dp, uint8_t *dq,
+			     const uint8_t *pm, const uint8_t *qm, size_t bytes)
+{
+	__m256i plo = table_avx2(pm), phi = table_avx2(pm+16);
+	__m256i qlo = table_avx2(qm), qhi = table_avx2(qm+16);
+	size_t i;
+
+	for (i = 0; i + 32 <= bytes; i += 32) {
+		__m256i px = _mm256_xor_si256(_mm256_loadu_si256((__m256i*)(p+i)),
+					      _mm256_loadu_si256((__m256i*)(dp+i)));
+		__m256i qx = _mm256_xor_si256(_mm256_loadu_si256((__m256i*)(q+i)),
+					      _mm256_loadu_si256((__m256i*)(dq+i)));
+		__m256i db = _mm256_xor_si256(mul_avx2(px, plo, phi),
+					      mul_avx2(qx, qlo, qhi));
+		_mm256_storeu_si256((__m256i*)(dq+i), db);
+		_mm256_storeu_si256((__m256i*)(dp+i), _mm256_xor_si256(db, px));
+	}
+	recov_2data_scalar(p+i, q+i, dp+i, dq+i, pm, qm, bytes-i);
+}
+
+__attribute__((target("avx2")))
+static void recov_datap_avx2(uint8_t *p, uint8_t *q, uint8_t *dq,
+			     const uint8_t *qm, size_t bytes)
+{
+	__m256i qlo = table_avx2(qm), qhi = table_avx2(qm+16);
+	size_t i;
+
+	for (i = 0; i + 32 <= bytes; i += 32) {
+		__m256i qx = _mm256_xor_si256(_mm256_loadu_si256((__m256i*)(q+i)),
+					      _mm256_loadu_si256((__m256i*)(dq+i)));
+		__m256i d = mul_avx2(qx, qlo, qhi);
+		_mm256_storeu_si256((__m256i*)(dq+i), d);
+		_mm256_storeu_si256((__m256i*)(p+i),
+				    _mm256_xor_si256(_mm256_loadu_si256((__m256i*)(p+i)), d));
+	}
+	recov_datap_scalar(p+i, q+i, dq+i, qm, bytes-i);
+}
+
+static int have_ssse3(void) { return __builtin_cpu_supports("ssse3"); }
+#endif /* HAVE_X86_SIMD */
+
+struct raid6_calls {
+	struct impl impl;
+	void (*gen_syndrome)(uint8_t *p, uint8_t *q, uint8_t **sources,
+			     int disks, int size);
+	void (*recov_2data)(uint8_t *p, uint8_t *q, uint8_t *dp, uint8_t *dq,
+			    const uint8_t *pm, const uint8_t *qm, size_t bytes);
+	void (*recov_datap)(uint8_t *p, uint8_t *q, uint8_t *dq,
+			    const uint8_t *qm, size_t bytes);
+};
+
+/* Best first.  The last entry must always be usable. */
+static struct raid6_calls raid6_algos[] = {
+#ifdef HAVE_X86_SIMD
+	{ { "avx2", have_avx2 }, qsyndrome_avx2, recov_2data_avx2, recov_datap_avx2 },
+	{ { "ssse3", have_ssse3 }, qsyndrome_ssse3, recov_2data_ssse3, recov_datap_ssse3 },
+#endif
+	{ { "word64", NULL }, qsyndrome_word, recov_2data_scalar, recov_datap_scalar },
+	{ { "byte", NULL }, qsyndrome_byte, recov_2data_scalar, recov_datap_scalar },
+	{ { NULL, NULL }, NULL, NULL, NULL }
+};
+
+static struct raid6_calls *raid6_impl;
+
+static int raid6_check(void *entry)
+{
+	/* Compare syndrome generation against the byte loop, then
+	 * wipe pairs of blocks and make sure recovery puts them back.
+	 * Return 0 if everything matched.
+	 * This runs lazily from the first qsyndrome(), when callers may
+	 * already hold 'zero' in their block lists, so it has its own
+	 * zeroed block rather than resizing the shared one.
+	 */
+	struct raid6_calls *c = entry;
+	enum { NDATA = 6, LEN = 4096+80 };
+	uint8_t *mem = malloc((NDATA + 7) * LEN);
+	uint8_t *ptrs[NDATA + 2];
+	uint8_t *p, *q, *p2, *q2, *save_a, *save_b, *zbuf;
+	unsigned int seed = 7;
+	int len = LEN - 8;
+	int rv = 0;
+	int i, a, b;
+
+	if (!mem)
+		return -1;
+	for (i = 0; i < (NDATA + 6) * LEN; i++) {
+		seed = seed * 1103515245 + 12345;
+		mem[i] = seed >> 16;
+	}
+	zbuf = mem + (NDATA + 6) * LEN;
+	memset(zbuf, 0, LEN);
+	for (i = 0; i < NDATA; i++)
+		ptrs[i] = mem + i * LEN + (i & 3);
+	p = mem + NDATA * LEN;
+	q = mem + (NDATA+1) * LEN;
+	p2 = mem + (NDATA+2) * LEN + 1;
+	q2 = mem + (NDATA+3) * LEN + 5;
+	save_a = mem + (NDATA+4) * LEN;
+	save_b = mem + (NDATA+5) * LEN;
+	ptrs[NDATA] = p;
+	ptrs[NDATA+1] = q;
+
+	qsyndrome_byte(p, q, ptrs, NDATA, len);
+	c->gen_syndrome(p2, q2, ptrs, NDATA, len);
+	if (memcmp(p, p2, len) != 0 || memcmp(q, q2, len) != 0)
+		rv = -1;
+
+	for (a = 0; a < NDATA && rv == 0; a++) {
+		const uint8_t *qm;
+		uint8_t *dq;
+
+		/* data + P */
+		memcpy(save_a, ptrs[a], len);
+		qm = raid6_vgfmul[raid6_gfinv[raid6_gfexp[a]]];
+		dq = ptrs[a];
+		memcpy(p2, p, len);
+		ptrs[a] = zbuf;
+		qsyndrome_byte(p2, dq, ptrs, NDATA, len);
+		ptrs[a] = dq;
+		c->recov_datap(p2, q, dq, qm, len);
+		if (memcmp(dq, save_a, len) != 0 || memcmp(p2, p, len) != 0)
+			rv = -1;
+
+		for (b = a+1; b < NDATA && rv == 0; b++) {
+			const uint8_t *pm;
+			uint8_t *dp;
+
+			memcpy(save_b, ptrs[b], len);
+			pm = raid6_vgfmul[raid6_gfexi[b-a]];
+			qm = raid6_vgfmul[raid6_gfinv[raid6_gfexp[a] ^
+						      raid6_gfexp[b]]];
+			dp = ptrs[a];
+			dq = ptrs[b];
+			ptrs[a] = ptrs[b] = zbuf;
+			qsyndrome_byte(dp, dq, ptrs, NDATA, len);
+			ptrs[a] = dp;
+			ptrs[b] = dq;
+			c->recov_2data(p, q, dp, dq, pm, qm, len);
+			if (memcmp(dp, save_a, len) != 0 ||
+			    memcmp(dq, save_b, len) != 0)
+				rv = -1;
+		}
+	}
+	free(mem);
+	return rv;
+}
+
+static void raid6_init(void)
+{
+	raid6_impl = impl_pick(raid6_algos, sizeof(raid6_algos[0]),
+			       raid6_check);
+}
+
+char *raid6_name(void)
+{
+	if (!tables_ready)
+		make_tables();
+	return raid6_impl->impl.name;
+}
+
+int raid6_selftest(int verbose)
+{
+	if (!tables_ready)
+		make_tables();
+	return impl_selftest(raid6_algos, sizeof(raid6_algos[0]),
+			     raid6_check, "raid6", verbose);
+}
+
+static void qsyndrome(uint8_t *p, uint8_t *q, uint8_t **sources, int disks, int size)
+{
+	if (!tables_ready)
+		make_tables();
+	raid6_impl->gen_syndrome(p, q, sources, disks, size);
+}
+
+/* Following was adapted from linux/drivers/md/raid6recov.c */
 
 /* Recover two failed data blocks. */
 void raid6_2data_recov(int disks, size_t bytes, int faila, int failb,
 		       uint8_t **ptrs)
 {
 	uint8_t *p, *q, *dp, *dq;
-	uint8_t px, qx, db;
 	const uint8_t *pbmul;	/* P multiplier table for B data */
 	const uint8_t *qmul;		/* Q multiplier table (for both) */
 
@@ -340,17 +1083,11 @@ void raid6_2data_recov(int disks, size_t bytes, int faila, int failb,
 	ptrs[failb]   = dq;
 
 	/* Now, pick the proper data tables */
-	pbmul = raid6_gfmul[raid6_gfexi[failb-faila]];
-	qmul  = raid6_gfmul[raid6_gfinv[raid6_gfexp[faila]^raid6_gfexp[failb]]];
+	pbmul = raid6_vgfmul[raid6_gfexi[failb-faila]];
+	qmul  = raid6_vgfmul[raid6_gfinv[raid6_gfexp[faila]^raid6_gfexp[failb]]];
 
 	/* Now do it... */
-	while ( bytes-- ) {
-		px    = *p ^ *dp;
-		qx    = qmul[*q ^ *dq];
-		*dq++ = db = pbmul[px] ^ qx; /* Reconstructed B */
-		*dp++ = db ^ px; /* Reconstructed A */
-		p++; q++;
-	}
+	raid6_impl->recov_2data(p, q, dp, dq, pbmul, qmul, bytes);
 }
 
 /* Recover failure of one data block plus the P block */
@@ -373,13 +1110,10 @@ void raid6_datap_recov(int disks, size_t bytes, int faila, uint8_t **ptrs)
 	ptrs[faila]   = dq;
 
 	/* Now, pick the proper data tables */
-	qmul  = raid6_gfmul[raid6_gfinv[raid6_gfexp[faila]]];
+	qmul  = raid6_vgfmul[raid6_gfinv[raid6_gfexp[faila]]];
 
 	/* Now do it... */
-	while ( bytes-- ) {
-		*p++ ^= *dq = qmul[*q ^ *dq];
-		q++; dq++;
-	}
+	raid6_impl->recov_datap(p, q, dq, qmul, bytes);
 }
 
 /* Save data:
@@ -390,50 +1124,170 @@ void raid6_datap_recov(int disks, size_t bytes, int faila, uint8_t **ptrs)
  *    right (Write) location
  *  A start and length which must be stripe-aligned
  *  'buf' is large enough to hold one stripe, and is aligned
+ *
+ * All the member reads for a stripe are issued at once through
+ * an io_pool, and if we can get a second buffer, the reads for
+ * the next stripe are started before we reconstruct and write
+ * this one.
  */
+static struct io_pool *restripe_pool;
+static pid_t restripe_pool_pid;
+
+static struct io_pool *get_restripe_pool(int threads)
+{
+	/* A pool inherited across fork() has no threads behind it */
+	if (!restripe_pool || restripe_pool_pid != getpid()) {
+		restripe_pool = io_pool_create(threads);
+		restripe_pool_pid = getpid();
+	}
+	return restripe_pool;
+}
+
+static void read_stripe(struct io_req *reqs, struct layout_map *lm,
+			int *source, unsigned long long *offsets,
+			int chunk_size, unsigned long long start, char *buf)
+{
+	unsigned long long stripe = start/chunk_size/lm->data_disks;
+	int *l2p = lm_l2p(lm, stripe);
+	int disk;
+
+	for (disk = 0; disk < lm->raid_disks ; disk++) {
+		struct io_req *r = &reqs[disk];
+		int dnum = l2p[disk];
+
+		memset(r, 0, sizeof(*r));
+		r->op = IO_READ;
+		r->fd = source[dnum];
+		r->buf = buf + disk * chunk_size;
+		r->len = chunk_size;
+		r->offset = offsets[dnum] + stripe * chunk_size;
+		if (r->fd < 0) {
+			r->rv = -1;
+			r->done = 1;
+		} else
+			io_pool_submit(restripe_pool, r);
+	}
+}
+
+struct save_stats save_stats;
+
+static unsigned long long save_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+static int wait_writes(struct io_req *reqs, int *pending, int cnt, int len)
+{
+	/* Wait for the writes of one stripe to all destinations,
+	 * returning -1 if any of them fell short.
+	 */
+	int rv = 0;
+	int i;
+
+	unsigned long long t;
+
+	if (!*pending)
+		return 0;
+	t = save_now();
+	io_pool_wait_reqs(restripe_pool, reqs, cnt);
+	save_stats.write_usec += save_now() - t;
+	for (i = 0; i < cnt; i++)
+		if (reqs[i].rv != len)
+			rv = -1;
+	*pending = 0;
+	return rv;
+}
 
 int save_stripes(int *source, unsigned long long *offsets,
 		 int raid_disks, int chunk_size, int level, int layout,
 		 int nwrites, int *dest,
 		 unsigned long long start, unsigned long long length,
-		 char *buf)
+		 char *buf, __u32 *crc)
 {
+	/* If 'crc' is given, the CRC32C of the data written is
+	 * accumulated into it.
+	 */
 	int len;
 	int data_disks = raid_disks - (level == 0 ? 0 : level <=5 ? 1 : 2);
 	int disk;
 	int i;
+	struct io_req reqs[2][raid_disks];
+	struct io_req wreqs[2][nwrites > 0 ? nwrites : 1];
+	int wpending[2] = {0, 0};
+	unsigned long long dpos[nwrites > 0 ? nwrites : 1];
+	struct layout_map *lm;
+	char *sbufs[2];
+	int slot = 0;
+	int pending = 0;
+	int rv = 0;
 
 	if (!tables_ready)
 		make_tables();
 
-	if (zero == NULL) {
-		zero = malloc(chunk_size);
-		memset(zero, 0, chunk_size);
+	if (zero_init(chunk_size) != 0)
+		return -1;
+	lm = layout_lookup(level, layout, raid_disks);
+	if (!lm)
+		return -1;
+
+	get_restripe_pool(2 * raid_disks + nwrites);
+
+	/* Each destination is written from where the caller left it,
+	 * all of them at once, and is left positioned after the data.
+	 */
+	for (i = 0; i < nwrites; i++) {
+		off64_t pos = lseek64(dest[i], 0, SEEK_CUR);
+		if (pos < 0)
+			return -1;
+		dpos[i] = pos;
 	}
 
+	sbufs[0] = buf;
+	if (length <= (unsigned long long)data_disks * chunk_size ||
+	    posix_memalign((void**)&sbufs[1], 4096, raid_disks * chunk_size))
+		sbufs[1] = NULL;
+
 	len = data_disks * chunk_size;
 	while (length > 0) {
 		int failed = 0;
 		int fdisk[3], fblock[3];
-		for (disk = 0; disk < raid_disks ; disk++) {
-			unsigned long long offset;
-			int dnum;
-
-			offset = (start/chunk_size/data_disks)*chunk_size;
-			dnum = geo_map(disk < data_disks ? disk : data_disks - disk - 1,
-				       start/chunk_size/data_disks,
-				       raid_disks, level, layout);
-			if (dnum < 0) abort();
-			if (source[dnum] < 0 ||
-			    lseek64(source[dnum], offsets[dnum]+offset, 0) < 0 ||
-			    read(source[dnum], buf+disk * chunk_size, chunk_size)
-			    != chunk_size)
+		unsigned long long stripe = start/chunk_size/data_disks;
+		int *l2p = lm_l2p(lm, stripe);
+		unsigned long long t;
+
+		buf = sbufs[slot];
+		if (!pending) {
+			if (wait_writes(wreqs[slot], &wpending[slot],
+					nwrites, len))
+				rv = -1;
+			read_stripe(reqs[slot], lm, source, offsets,
+				    chunk_size, start, buf);
+		}
+		pending = 0;
+		if (sbufs[1] && length > (unsigned long long)len) {
+			/* the writes from that buffer must finish first */
+			if (wait_writes(wreqs[1-slot], &wpending[1-slot],
+					nwrites, len))
+				rv = -1;
+			read_stripe(reqs[1-slot], lm, source, offsets,
+				    chunk_size, start + len, sbufs[1-slot]);
+			pending = 1;
+		}
+		t = save_now();
+		io_pool_wait_reqs(restripe_pool, reqs[slot], raid_disks);
+		save_stats.read_usec += save_now() - t;
+
+		t = save_now();
+		for (disk = 0; disk < raid_disks ; disk++)
+			if (reqs[slot][disk].rv != chunk_size)
 				if (failed <= 2) {
-					fdisk[failed] = dnum;
+					fdisk[failed] = l2p[disk];
 					fblock[failed] = disk;
 					failed++;
 				}
-		}
 		if (failed == 0 || fblock[0] >= data_disks)
 			/* all data disks are good */
 			;
@@ -448,65 +1302,48 @@ int save_stripes(int *source, unsigned long long *offsets,
 
 			xor_blocks(buf + fblock[0]*chunk_size,
 				   bufs, data_disks, chunk_size);
-		} else if (failed > 2 || level != 6)
+		} else if (failed > 2 || level != 6) {
 			/* too much failure */
-			return -1;
+			rv = -1;
+			break;
+		}
 		else {
 			/* RAID6 computations needed. */
 			uint8_t *bufs[data_disks+4];
-			int qdisk;
 			int syndrome_disks;
-			disk = geo_map(-1, start/chunk_size/data_disks,
-				       raid_disks, level, layout);
-			qdisk = geo_map(-2, start/chunk_size/data_disks,
-				       raid_disks, level, layout);
 			if (is_ddf(layout)) {
 				/* q over 'raid_disks' blocks, in device order.
 				 * 'p' and 'q' get to be all zero
 				 */
 				for (i = 0; i < raid_disks; i++)
 					bufs[i] = zero;
-				for (i = 0; i < data_disks; i++) {
-					int dnum = geo_map(i,
-							   start/chunk_size/data_disks,
-							   raid_disks, level, layout);
-					int snum;
+				for (i = 0; i < data_disks; i++)
 					/* i is the logical block number, so is index to 'buf'.
-					 * dnum is physical disk number
+					 * l2p[i] is physical disk number
 					 * and thus the syndrome number.
 					 */
-					snum = dnum;
-					bufs[snum] = (uint8_t*)buf + chunk_size * i;
-				}
+					bufs[l2p[i]] = (uint8_t*)buf + chunk_size * i;
 				syndrome_disks = raid_disks;
 			} else {
 				/* for md, q is over 'data_disks' blocks,
 				 * starting immediately after 'q'
 				 * Note that for the '_6' variety, the p block
-				 * makes a hole that we need to be careful of.
+				 * makes a hole, which lm_syn() already skips.
 				 */
-				int j;
-				int snum = 0;
-				for (j = 0; j < raid_disks; j++) {
-					int dnum = (qdisk + 1 + j) % raid_disks;
-					if (dnum == disk || dnum == qdisk)
-						continue;
-					for (i = 0; i < data_disks; i++)
-						if (geo_map(i,
-							    start/chunk_size/data_disks,
-							    raid_disks, level, layout) == dnum)
-							break;
+				int *p2l = lm_p2l(lm, stripe);
+				int *syn = lm_syn(lm, stripe);
+				int snum;
+				for (snum = 0; snum < data_disks; snum++) {
 					/* i is the logical block number, so is index to 'buf'.
-					 * dnum is physical disk number
 					 * snum is syndrome disk for which 0 is immediately after Q
 					 */
+					i = p2l[syn[snum]];
 					bufs[snum] = (uint8_t*)buf + chunk_size * i;
 
 					if (fblock[0] == i)
 						fdisk[0] = snum;
 					if (fblock[1] == i)
 						fdisk[1] = snum;
-					snum++;
 				}
 
 				syndrome_disks = data_disks;
@@ -531,14 +1368,116 @@ int save_stripes(int *source, unsigned long long *offsets,
 						  fdisk[0], fdisk[1], bufs);
 			}
 		}
+		save_stats.parity_usec += save_now() - t;
 
-		for (i=0; i<nwrites; i++)
-			if (write(dest[i], buf, len) != len)
-				return -1;
+		if (rv)
+			break;
+		if (crc)
+			*crc = crc32c(*crc, buf, len);
+		for (i = 0; i < nwrites; i++) {
+			struct io_req *r = &wreqs[slot][i];
+			memset(r, 0, sizeof(*r));
+			r->op = IO_WRITE;
+			r->fd = dest[i];
+			r->buf = buf;
+			r->len = len;
+			r->offset = dpos[i];
+			io_pool_submit(restripe_pool, r);
+			dpos[i] += len;
+		}
+		wpending[slot] = 1;
+		save_stats.bytes += len;
 
 		length -= len;
 		start += len;
+		if (sbufs[1])
+			slot = 1 - slot;
 	}
+	if (pending)
+		/* don't free the buffer under an outstanding read */
+		io_pool_wait_reqs(restripe_pool, reqs[1-slot], raid_disks);
+	if (wait_writes(wreqs[0], &wpending[0], nwrites, len) ||
+	    wait_writes(wreqs[1], &wpending[1], nwrites, len))
+		rv = -1;
+	for (i = 0; i < nwrites; i++)
+		lseek64(dest[i], dpos[i], SEEK_SET);
+	free(sbufs[1]);
+	return rv;
+}
+
+/* Compute P (and Q) for one stripe held in stripes[0..raid_disks-1],
+ * indexed by physical disk.
+ */
+static void stripe_parity(char **stripes, char **blocks,
+			  struct layout_map *lm, int chunk_size,
+			  unsigned long long stripe)
+{
+	int data_disks = lm->data_disks;
+	int *l2p = lm_l2p(lm, stripe);
+	int disk, qdisk;
+	int syndrome_disks;
+	int i;
+
+	switch (lm->level) {
+	case 4:
+	case 5:
+		disk = l2p[data_disks];
+		for (i = 0; i < data_disks; i++)
+			blocks[i] = stripes[l2p[i]];
+		xor_blocks(stripes[disk], blocks, data_disks, chunk_size);
+		break;
+	case 6:
+		disk = l2p[data_disks];
+		qdisk = l2p[data_disks+1];
+		if (is_ddf(lm->layout)) {
+			/* q over 'raid_disks' blocks, in device order.
+			 * 'p' and 'q' get to be all zero
+			 */
+			for (i = 0; i < lm->raid_disks; i++)
+				if (i == disk || i == qdisk)
+					blocks[i] = (char*)zero;
+				else
+					blocks[i] = stripes[i];
+			syndrome_disks = lm->raid_disks;
+		} else {
+			/* for md, q is over 'data_disks' blocks,
+			 * starting immediately after 'q' and skipping 'p'
+			 */
+			int *syn = lm_syn(lm, stripe);
+			for (i = 0; i < data_disks; i++)
+				blocks[i] = stripes[syn[i]];
+
+			syndrome_disks = data_disks;
+		}
+		qsyndrome((uint8_t*)stripes[disk],
+			  (uint8_t*)stripes[qdisk],
+			  (uint8_t**)blocks,
+			  syndrome_disks, chunk_size);
+		break;
+	}
+}
+
+/* For other code that moves stripes about: where each block of a
+ * stripe lives (as for the l2p table above), and parity for a stripe
+ * whose blocks may be anywhere in memory.
+ */
+int *stripe_map(int level, int layout, int raid_disks,
+		unsigned long long stripe)
+{
+	struct layout_map *lm = layout_lookup(level, layout, raid_disks);
+
+	return lm ? lm_l2p(lm, stripe) : NULL;
+}
+
+int make_parity(char **stripes, int raid_disks, int chunk_size,
+		int level, int layout, unsigned long long stripe)
+{
+	struct layout_map *lm = layout_lookup(level, layout, raid_disks);
+	char *blocks[raid_disks];
+
+	if (!lm || level < 4 || zero_init(chunk_size) != 0)
+		return -1;
+	stripe_parity(stripes, blocks, lm, chunk_size, stripe);
 	return 0;
 }
 
@@ -546,114 +1485,420 @@ int save_stripes(int *source, unsigned long long *offsets,
  * We are given:
  *  A list of 'fds' of the active disks. Some may be '-1' for not-available.
  *  A geometry: raid_disks, chunk_size, level, layout
- *  An 'fd' to read from.  It is already seeked to the right (Read) location.
+ *  An 'fd' to read from, and the offset at which the backup starts.
  *  A start and length.
  * The length must be a multiple of the stripe size.
  *
- * We build a full stripe in memory and then write it out.
+ * We work on a batch of stripes at a time.  Backup data is contiguous,
+ * so one preadv scatters a whole batch straight into place.  Consecutive
+ * stripes are contiguous on each member too, so after computing parity
+ * there is one pwritev per member, and those are issued in parallel.
  * We assume that there are enough working devices.
  */
+#define RESTORE_BATCH_BYTES (16*1024*1024)
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 int restore_stripes(int *dest, unsigned long long *offsets,
 		    int raid_disks, int chunk_size, int level, int layout,
 		    int source, unsigned long long read_offset,
 		    unsigned long long start, unsigned long long length)
 {
 	char *stripe_buf;
-	char **stripes = malloc(raid_disks * sizeof(char*));
-	char **blocks = malloc(raid_disks * sizeof(char*));
-	int i;
-
+	char **stripes, **blocks;
+	struct iovec *iov;
+	struct io_req *reqs;
+	struct layout_map *lm = layout_lookup(level, layout, raid_disks);
 	int data_disks = raid_disks - (level == 0 ? 0 : level <= 5 ? 1 : 2);
-
-	if (posix_memalign((void**)&stripe_buf, 4096, raid_disks * chunk_size))
+	unsigned long long len = (unsigned long long)data_disks * chunk_size;
+	int batch;
+	int i, n;
+	int rv = 0;
+
+	batch = RESTORE_BATCH_BYTES / (raid_disks * chunk_size);
+	if (batch * data_disks > IOV_MAX)
+		batch = IOV_MAX / data_disks;
+	if ((unsigned long long)batch > length / len)
+		batch = length / len;
+	if (batch < 1)
+		batch = 1;
+
+	stripes = malloc(batch * raid_disks * sizeof(char*));
+	blocks = malloc(raid_disks * sizeof(char*));
+	iov = malloc(batch * raid_disks * sizeof(*iov));
+	reqs = malloc(raid_disks * sizeof(*reqs));
+	if (posix_memalign((void**)&stripe_buf, 4096,
+			   (size_t)batch * raid_disks * chunk_size))
 		stripe_buf = NULL;
-	if (zero == NULL) {
-		zero = malloc(chunk_size);
-		if (zero)
-			memset(zero, 0, chunk_size);
-	}
 	if (stripe_buf == NULL || stripes == NULL || blocks == NULL
-	    || zero == NULL) {
-		free(stripe_buf);
-		free(stripes);
-		free(blocks);
-		free(zero);
-		return -2;
+	    || iov == NULL || reqs == NULL || lm == NULL
+	    || zero_init(chunk_size) != 0) {
+		rv = -2;
+		goto out;
 	}
-	for (i=0; i<raid_disks; i++)
-		stripes[i] = stripe_buf + i * chunk_size;
+	for (i = 0; i < batch * raid_disks; i++)
+		stripes[i] = stripe_buf + (size_t)i * chunk_size;
+	get_restripe_pool(2 * raid_disks);
+
 	while (length > 0) {
-		unsigned int len = data_disks * chunk_size;
-		unsigned long long offset;
-		int disk, qdisk;
-		int syndrome_disks;
-		if (length < len)
-			return -3;
-		for (i=0; i < data_disks; i++) {
-			int disk = geo_map(i, start/chunk_size/data_disks,
-					   raid_disks, level, layout);
-			if ((unsigned long long)lseek64(source, read_offset, 0)
-			    != read_offset)
-				return -1;
-			if (read(source, stripes[disk],
-						     chunk_size) != chunk_size)
-				return -1;
-			read_offset += chunk_size;
+		unsigned long long stripe = start/chunk_size/data_disks;
+		struct io_req r;
+		int cnt;
+
+		if (length < len) {
+			rv = -3;
+			break;
 		}
-		/* We have the data, now do the parity */
-		offset = (start/chunk_size/data_disks) * chunk_size;
-		switch (level) {
-		case 4:
-		case 5:
-			disk = geo_map(-1, start/chunk_size/data_disks,
-					   raid_disks, level, layout);
-			for (i = 0; i < data_disks; i++)
-				blocks[i] = stripes[(disk+1+i) % raid_disks];
-			xor_blocks(stripes[disk], blocks, data_disks, chunk_size);
+		cnt = batch;
+		if ((unsigned long long)cnt > length / len)
+			cnt = length / len;
+
+		for (n = 0; n < cnt; n++)
+			for (i = 0; i < data_disks; i++) {
+				int disk = lm_l2p(lm, stripe + n)[i];
+				iov[n*data_disks + i].iov_base =
+					stripes[n*raid_disks + disk];
+				iov[n*data_disks + i].iov_len = chunk_size;
+			}
+		memset(&r, 0, sizeof(r));
+		r.op = IO_READV;
+		r.fd = source;
+		r.iov = iov;
+		r.iovcnt = cnt * data_disks;
+		r.offset = read_offset;
+		io_pool_submit(NULL, &r);
+		if ((unsigned long long)r.rv != cnt * len) {
+			rv = -1;
 			break;
-		case 6:
-			disk = geo_map(-1, start/chunk_size/data_disks,
-				       raid_disks, level, layout);
-			qdisk = geo_map(-2, start/chunk_size/data_disks,
-				       raid_disks, level, layout);
-			if (is_ddf(layout)) {
-				/* q over 'raid_disks' blocks, in device order.
-				 * 'p' and 'q' get to be all zero
-				 */
-				for (i = 0; i < raid_disks; i++)
-					if (i == disk || i == qdisk)
-						blocks[i] = (char*)zero;
-					else
-						blocks[i] = stripes[i];
-				syndrome_disks = raid_disks;
-			} else {
-				/* for md, q is over 'data_disks' blocks,
-				 * starting immediately after 'q'
-				 */
-				for (i = 0; i < data_disks; i++)
-					blocks[i] = stripes[(qdisk+1+i) % raid_disks];
+		}
+		read_offset += cnt * len;
 
-				syndrome_disks = data_disks;
+		/* We have the data, now do the parity */
+		for (n = 0; n < cnt; n++)
+			stripe_parity(stripes + n*raid_disks, blocks,
+				      lm, chunk_size, stripe + n);
+
+		for (i = 0; i < raid_disks; i++) {
+			struct iovec *v = iov + i * cnt;
+
+			memset(&reqs[i], 0, sizeof(reqs[i]));
+			reqs[i].done = 1;
+			if (dest[i] < 0)
+				continue;
+			for (n = 0; n < cnt; n++) {
+				v[n].iov_base = stripes[n*raid_disks + i];
+				v[n].iov_len = chunk_size;
 			}
-			qsyndrome((uint8_t*)stripes[disk],
-				  (uint8_t*)stripes[qdisk], 
-				  (uint8_t**)blocks,
-				  syndrome_disks, chunk_size);
+			reqs[i].op = IO_WRITEV;
+			reqs[i].fd = dest[i];
+			reqs[i].iov = v;
+			reqs[i].iovcnt = cnt;
+			reqs[i].offset = offsets[i] + stripe * chunk_size;
+			io_pool_submit(restripe_pool, &reqs[i]);
+		}
+		io_pool_wait_reqs(restripe_pool, reqs, raid_disks);
+		for (i = 0; i < raid_disks; i++)
+			if (dest[i] >= 0 &&
+			    reqs[i].rv != (ssize_t)cnt * chunk_size)
+				rv = -1;
+		if (rv)
 			break;
+		length -= cnt * len;
+		start += cnt * len;
+	}
+out:
+	free(stripe_buf);
+	free(stripes);
+	free(blocks);
+	free(iov);
+	free(reqs);
+	return rv;
+}
+
+/* Check data:
+ * Read stripes straight from the members and make sure that P (and Q)
+ * agree with the data.  'start' and 'length' are as for save_stripes
+ * and must be stripe-aligned.  Every stripe that does not agree is
+ * listed, in order, in '*found' which the caller must free.  The
+ * return value is the number found, or negative if some member could
+ * not be read.
+ *
+ * For RAID6 a single bad block can be located.  If data block z in
+ * syndrome order is out by some error E, then P is out by E and Q by
+ * g^z.E, so log(dQ) - log(dP) gives the same z at every byte where
+ * either is non-zero.  A bad P or Q on its own is the only one that
+ * does not match.  With RAID4/5 we can only say that the stripe is
+ * inconsistent.
+ *
+ * The work is shared by 'threads' threads.  Each takes every
+ * 'threads'th batch of stripes, reads each member's part of the batch
+ * with a single pread, and checks it before moving on, so the members
+ * of an array see several large sequential streams at once.
+ */
+#define CHECK_BATCH_BYTES (1024*1024)
+
+struct check_job {
+	int *source;
+	unsigned long long *offsets;
+	struct layout_map *lm;
+	int chunk_size;
+	unsigned long long first, last;	/* stripes, 'last' is excluded */
+	int batch, stride;
+	struct stripe_mismatch *found;
+	int nfound, nalloc;
+};
+
+static int raid6_locate(uint8_t *dp, uint8_t *dq, int size)
+{
+	/* 'dp' and 'dq' are the differences between the stored and
+	 * computed P and Q.  Return the syndrome index of the one data
+	 * block that explains both, or -1.
+	 */
+	int z = -1;
+	int i;
+
+	for (i = 0; i < size; i++) {
+		int lz;
+		if (!dp[i] && !dq[i])
+			continue;
+		if (!dp[i] || !dq[i])
+			return -1;
+		lz = (raid6_gflog[dq[i]] + 255 - raid6_gflog[dp[i]]) % 255;
+		if (z >= 0 && lz != z)
+			return -1;
+		z = lz;
+	}
+	return z;
+}
+
+static int check_one(struct check_job *j, char **stripes, char **blocks,
+		     char *p, char *q, unsigned long long stripe)
+{
+	struct layout_map *lm = j->lm;
+	int chunk_size = j->chunk_size;
+	int data_disks = lm->data_disks;
+	int *l2p = lm_l2p(lm, stripe);
+	int *syn = NULL;
+	int pd = l2p[data_disks];
+	int qd = lm->level == 6 ? l2p[data_disks+1] : -1;
+	int syndrome_disks = data_disks;
+	int bad = 0, disk = -1;
+	int i;
+
+	if (lm->level != 6) {
+		for (i = 0; i < data_disks; i++)
+			blocks[i] = stripes[l2p[i]];
+		xor_blocks(p, blocks, data_disks, chunk_size);
+	} else {
+		if (is_ddf(lm->layout)) {
+			for (i = 0; i < lm->raid_disks; i++)
+				if (i == pd || i == qd)
+					blocks[i] = (char*)zero;
+				else
+					blocks[i] = stripes[i];
+			syndrome_disks = lm->raid_disks;
+		} else {
+			syn = lm_syn(lm, stripe);
+			for (i = 0; i < data_disks; i++)
+				blocks[i] = stripes[syn[i]];
 		}
-		for (i=0; i < raid_disks ; i++)
-			if (dest[i] >= 0) {
-				if (lseek64(dest[i], offsets[i]+offset, 0) < 0)
-					return -1;
-				if (write(dest[i], stripes[i], chunk_size) != chunk_size)
-					return -1;
-			}
-		length -= len;
-		start += len;
+		qsyndrome((uint8_t*)p, (uint8_t*)q, (uint8_t**)blocks,
+			  syndrome_disks, chunk_size);
 	}
+
+	if (memcmp(p, stripes[pd], chunk_size) != 0)
+		bad |= 1;
+	if (qd >= 0 && memcmp(q, stripes[qd], chunk_size) != 0)
+		bad |= 2;
+	if (!bad)
+		return 0;
+
+	if (bad == 1 && qd >= 0)
+		disk = pd;
+	else if (bad == 2)
+		disk = qd;
+	else if (bad == 3) {
+		int z;
+		for (i = 0; i < chunk_size; i++) {
+			p[i] ^= stripes[pd][i];
+			q[i] ^= stripes[qd][i];
+		}
+		z = raid6_locate((uint8_t*)p, (uint8_t*)q, chunk_size);
+		if (z >= 0 && z < syndrome_disks)
+			disk = syn ? syn[z] : z;
+		if (disk == pd || disk == qd)
+			disk = -1;
+	}
+
+	if (j->nfound >= j->nalloc) {
+		struct stripe_mismatch *f;
+		f = realloc(j->found, (j->nalloc + 64) * sizeof(*f));
+		if (!f)
+			return -2;
+		j->found = f;
+		j->nalloc += 64;
+	}
+	j->found[j->nfound].stripe = stripe;
+	j->found[j->nfound].parity = bad;
+	j->found[j->nfound].disk = disk;
+	j->nfound++;
 	return 0;
 }
 
+static int check_batches(struct io_req *r)
+{
+	struct check_job *j = r->data;
+	int raid_disks = j->lm->raid_disks;
+	size_t blen = (size_t)j->batch * j->chunk_size;
+	char *stripes[raid_disks], *blocks[raid_disks];
+	char *buf, *p, *q;
+	unsigned long long s;
+	int rv = 0;
+
+	if (posix_memalign((void**)&buf, 4096,
+			   raid_disks * blen + 2 * j->chunk_size))
+		return -2;
+	p = buf + raid_disks * blen;
+	q = p + j->chunk_size;
+
+	for (s = j->first; s < j->last && rv == 0;
+	     s += (unsigned long long)j->batch * j->stride) {
+		int n = j->batch;
+		int d, k;
+
+		if ((unsigned long long)n > j->last - s)
+			n = j->last - s;
+		for (d = 0; d < raid_disks; d++) {
+			struct io_req rd;
+
+			memset(&rd, 0, sizeof(rd));
+			rd.op = IO_READ;
+			rd.fd = j->source[d];
+			rd.buf = buf + d * blen;
+			rd.len = (size_t)n * j->chunk_size;
+			rd.offset = j->offsets[d] + s * j->chunk_size;
+			io_pool_submit(NULL, &rd);
+			if (rd.rv != (ssize_t)rd.len) {
+				rv = -1;
+				break;
+			}
+		}
+		for (k = 0; k < n && rv == 0; k++) {
+			for (d = 0; d < raid_disks; d++)
+				stripes[d] = buf + d * blen
+					+ (size_t)k * j->chunk_size;
+			rv = check_one(j, stripes, blocks, p, q, s + k);
+		}
+	}
+	free(buf);
+	return rv;
+}
+
+static int cmp_mismatch(const void *av, const void *bv)
+{
+	const struct stripe_mismatch *a = av, *b = bv;
+
+	if (a->stripe < b->stripe)
+		return -1;
+	return a->stripe > b->stripe;
+}
+
+int check_stripes(int *source, unsigned long long *offsets,
+		  int raid_disks, int chunk_size, int level, int layout,
+		  unsigned long long start, unsigned long long length,
+		  int threads, struct stripe_mismatch **found)
+{
+	struct layout_map *lm;
+	int data_disks = raid_disks - (level <= 5 ? 1 : 2);
+	unsigned long long len = (unsigned long long)data_disks * chunk_size;
+	unsigned long long first, last;
+	struct check_job *jobs;
+	struct io_req *reqs;
+	struct io_pool *pool = NULL;
+	int batch;
+	int t, i;
+	int rv = 0, cnt = 0;
+
+	*found = NULL;
+	if (level < 4 || level > 6 || start % len || length % len)
+		return -3;
+	for (i = 0; i < raid_disks; i++)
+		if (source[i] < 0)
+			return -1;
+	if (length == 0)
+		return 0;
+
+	/* Settle on the kernels before the threads start using them */
+	if (!tables_ready)
+		make_tables();
+	xor_blocks_name();
+	lm = layout_lookup(level, layout, raid_disks);
+	if (!lm || zero_init(chunk_size) != 0)
+		return -2;
+
+	batch = CHECK_BATCH_BYTES / chunk_size;
+	if (batch < 1)
+		batch = 1;
+	first = start / len;
+	last = first + length / len;
+	if (threads < 1)
+		threads = 1;
+	if ((unsigned long long)threads * batch > last - first)
+		threads = (last - first + batch - 1) / batch;
+
+	jobs = calloc(threads, sizeof(*jobs));
+	reqs = calloc(threads, sizeof(*reqs));
+	if (!jobs || !reqs) {
+		free(jobs);
+		free(reqs);
+		return -2;
+	}
+	if (threads > 1)
+		pool = io_pool_create(threads);
+
+	for (t = 0; t < threads; t++) {
+		jobs[t].source = source;
+		jobs[t].offsets = offsets;
+		jobs[t].lm = lm;
+		jobs[t].chunk_size = chunk_size;
+		jobs[t].first = first + (unsigned long long)t * batch;
+		jobs[t].last = last;
+		jobs[t].batch = batch;
+		jobs[t].stride = threads;
+		reqs[t].op = IO_CALL;
+		reqs[t].fn = check_batches;
+		reqs[t].data = &jobs[t];
+		io_pool_submit(pool, &reqs[t]);
+	}
+	io_pool_wait_reqs(pool, reqs, threads);
+	io_pool_destroy(pool);
+
+	for (t = 0; t < threads; t++) {
+		if (reqs[t].rv < 0 && rv == 0)
+			rv = reqs[t].rv;
+		cnt += jobs[t].nfound;
+	}
+	if (rv == 0 && cnt) {
+		*found = malloc(cnt * sizeof(**found));
+		if (!*found)
+			rv = -2;
+	}
+	if (rv == 0 && *found) {
+		cnt = 0;
+		for (t = 0; t < threads; t++) {
+			memcpy(*found + cnt, jobs[t].found,
+			       jobs[t].nfound * sizeof(**found));
+			cnt += jobs[t].nfound;
+		}
+		qsort(*found, cnt, sizeof(**found), cmp_mismatch);
+	}
+	for (t = 0; t < threads; t++)
+		free(jobs[t].found);
+	free(jobs);
+	free(reqs);
+	return rv ? rv : cnt;
+}
+
 #ifdef MAIN
 
 int test_stripes(int *source, unsigned long long *offsets,
@@ -662,42 +1907,46 @@ int test_stripes(int *source, unsigned long long *offsets,
 {
 	/* ready the data and p (and q) blocks, and check we got them right */
 	char *stripe_buf = malloc(raid_disks * chunk_size);
+	char *check_buf = malloc(raid_disks * chunk_size);
 	char **stripes = malloc(raid_disks * sizeof(char*));
+	char **check = malloc(raid_disks * sizeof(char*));
 	char **blocks = malloc(raid_disks * sizeof(char*));
-	char *p = malloc(chunk_size);
-	char *q = malloc(chunk_size);
+	struct layout_map *lm = layout_lookup(level, layout, raid_disks);
 
 	int i;
 	int data_disks = raid_disks - (level == 5 ? 1: 2);
-	for ( i = 0 ; i < raid_disks ; i++)
+	if (zero_init(chunk_size) != 0 || !lm)
+		return -1;
+	for ( i = 0 ; i < raid_disks ; i++) {
 		stripes[i] = stripe_buf + i * chunk_size;
+		check[i] = check_buf + i * chunk_size;
+	}
 
 	while (length > 0) {
+		int *l2p = lm_l2p(lm, start/chunk_size);
 		int disk;
 
 		for (i = 0 ; i < raid_disks ; i++) {
 			lseek64(source[i], offsets[i]+start, 0);
 			read(source[i], stripes[i], chunk_size);
 		}
-		for (i = 0 ; i < data_disks ; i++) {
-			int disk = geo_map(i, start/chunk_size, raid_disks,
-					   level, layout);
-			blocks[i] = stripes[disk];
-			printf("%d->%d\n", i, disk);
-		}
+		for (i = 0 ; i < data_disks ; i++)
+			printf("%d->%d\n", i, l2p[i]);
+		memcpy(check_buf, stripe_buf, raid_disks * chunk_size);
+		stripe_parity(check, blocks, lm, chunk_size, start/chunk_size);
 		switch(level) {
 		case 6:
-			qsyndrome(p, q, (uint8_t**)blocks, data_disks, chunk_size);
-			disk = geo_map(-1, start/chunk_size, raid_disks,
-				       level, layout);
-			if (memcmp(p, stripes[disk], chunk_size) != 0) {
-				printf("P(%d) wrong at %llu\n", disk,
+			disk = l2p[data_disks+1];
+			if (memcmp(check[disk], stripes[disk], chunk_size) != 0) {
+				printf("Q(%d) wrong at %llu\n", disk,
 				       start / chunk_size);
 			}
-			disk = geo_map(-2, start/chunk_size, raid_disks,
-				       level, layout);
-			if (memcmp(q, stripes[disk], chunk_size) != 0) {
-				printf("Q(%d) wrong at %llu\n", disk,
+			/* fall through */
+		case 4:
+		case 5:
+			disk = l2p[data_disks];
+			if (memcmp(check[disk], stripes[disk], chunk_size) != 0) {
+				printf("P(%d) wrong at %llu\n", disk,
 				       start / chunk_size);
 			}
 			break;
@@ -708,6 +1957,239 @@ int test_stripes(int *source, unsigned long long *offsets,
 	return 0;
 }
 
+/* Every layout geo_map() knows, for each level, ending with -1 */
+static const int layouts4[] = { 0, -1 };
+static const int layouts5[] = { 0, 1, 2, 3, 4, 5, -1 };
+static const int layouts6[] = { 0, 1, 2, 3, 4, 5, 8, 9, 10,
+				16, 17, 18, 19, 20, -1 };
+
+static const int *level_layouts(int level)
+{
+	return level == 4 ? layouts4 : level == 5 ? layouts5 : layouts6;
+}
+
+static int layout_selftest(int verbose)
+{
+	/* Check the cached layout tables agree with geo_map over
+	 * several periods for every layout we know about.
+	 */
+	int level, disks, l;
+	int rv = 0;
+
+	for (level = 4; level <= 6; level++)
+		for (disks = level - 1; disks <= 9; disks++)
+			for (l = 0; level_layouts(level)[l] >= 0; l++) {
+				int layout = level_layouts(level)[l];
+				struct layout_map *lm =
+					layout_lookup(level, layout, disks);
+				unsigned long long st;
+				int b;
+				for (st = 0; lm && st < 3ULL * disks; st++)
+					for (b = 0; b < disks; b++) {
+						int block = b < lm->data_disks ? b
+							: lm->data_disks - b - 1;
+						if (lm_l2p(lm, st)[b] !=
+						    geo_map(block, st, disks,
+							    level, layout))
+							rv = -1;
+					}
+				if (!lm)
+					rv = -1;
+			}
+	if (verbose)
+		printf("layout tables %s\n", rv ? "FAILED" : "ok");
+	return rv;
+}
+
+/* Benchmark: time parity generation and RAID6 recovery on stripes
+ * held in memory, for each level, layout, number of disks and chunk
+ * size, and print one CSV line per test.  Rates are for the data
+ * blocks of the stripes processed, so different numbers of disks can
+ * be compared directly.  BENCH_BYTES of stripes are cycled through so
+ * we are timing memory rather than cache, and every recovery is
+ * checked against the original data before it is timed.
+ */
+#define BENCH_BYTES (32*1024*1024)
+
+enum bench_op { BENCH_GEN, BENCH_2DATA, BENCH_DATAP };
+
+static double bench_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void bench_stripe(enum bench_op op, struct layout_map *lm,
+			 char **stripe, char **blocks, int chunk_size,
+			 unsigned long long s)
+{
+	/* Rebuild data blocks 0 and 1, or data block 0 and P,
+	 * laying the stripe out for recovery as save_stripes does.
+	 */
+	uint8_t *ptrs[lm->raid_disks + 2];
+	int data_disks = lm->data_disks;
+	int *l2p = lm_l2p(lm, s);
+	int pd = l2p[data_disks], qd = l2p[data_disks+1];
+	int fa = 0, fb = 1;
+	int sd, i;
+
+	if (op == BENCH_GEN) {
+		stripe_parity(stripe, blocks, lm, chunk_size, s);
+		return;
+	}
+	if (is_ddf(lm->layout)) {
+		for (i = 0; i < lm->raid_disks; i++)
+			ptrs[i] = (i == pd || i == qd) ? zero
+				: (uint8_t*)stripe[i];
+		fa = l2p[0];
+		fb = l2p[1];
+		sd = lm->raid_disks;
+	} else {
+		int *syn = lm_syn(lm, s);
+		for (i = 0; i < data_disks; i++) {
+			ptrs[i] = (uint8_t*)stripe[syn[i]];
+			if (syn[i] == l2p[0])
+				fa = i;
+			if (syn[i] == l2p[1])
+				fb = i;
+		}
+		sd = data_disks;
+	}
+	ptrs[sd] = (uint8_t*)stripe[pd];
+	ptrs[sd+1] = (uint8_t*)stripe[qd];
+	if (op == BENCH_2DATA) {
+		if (fa > fb) {
+			i = fa; fa = fb; fb = i;
+		}
+		raid6_2data_recov(sd+2, chunk_size, fa, fb, ptrs);
+	} else
+		raid6_datap_recov(sd+2, chunk_size, fa, ptrs);
+}
+
+static int bench_run(enum bench_op op, int level, int layout,
+		     int raid_disks, int chunk_size, double secs,
+		     char *buf, char *save)
+{
+	static char *opname[] = { "syndrome", "2data", "datap" };
+	struct layout_map *lm = layout_lookup(level, layout, raid_disks);
+	int nstripes = BENCH_BYTES / raid_disks / chunk_size;
+	char **stripes;
+	char *blocks[raid_disks];
+	unsigned long long iters = 0, bytes;
+	double start, t;
+	int s, i;
+
+	if (nstripes < 1)
+		nstripes = 1;
+	if (!lm || zero_init(chunk_size) != 0 ||
+	    (stripes = malloc(nstripes * raid_disks * sizeof(char*))) == NULL)
+		return -1;
+	for (i = 0; i < nstripes * raid_disks; i++)
+		stripes[i] = buf + (size_t)i * chunk_size;
+	for (s = 0; s < nstripes; s++)
+		stripe_parity(stripes + s*raid_disks, blocks,
+			      lm, chunk_size, s);
+
+	if (op != BENCH_GEN)
+		/* one of each phase of the layout is enough */
+		for (s = 0; s < nstripes && s < lm->period; s++) {
+			char **st = stripes + s*raid_disks;
+			int *l2p = lm_l2p(lm, s);
+			int f[2];
+
+			f[0] = l2p[0];
+			f[1] = op == BENCH_2DATA ? l2p[1] : l2p[lm->data_disks];
+			for (i = 0; i < 2; i++) {
+				memcpy(save + i*chunk_size, st[f[i]], chunk_size);
+				memset(st[f[i]], 0x5a, chunk_size);
+			}
+			bench_stripe(op, lm, st, blocks, chunk_size, s);
+			for (i = 0; i < 2; i++)
+				if (memcmp(save + i*chunk_size, st[f[i]],
+					   chunk_size) != 0) {
+					fprintf(stderr, "test_stripe: %s recovery "
+						"wrong: level %d layout %d "
+						"disks %d chunk %d\n",
+						opname[op], level, layout,
+						raid_disks, chunk_size);
+					free(stripes);
+					return -1;
+				}
+		}
+
+	start = bench_now();
+	do {
+		for (s = 0; s < nstripes; s++)
+			bench_stripe(op, lm, stripes + s*raid_disks, blocks,
+				     chunk_size, s);
+		iters++;
+		t = bench_now() - start;
+	} while (t < secs);
+
+	bytes = iters * nstripes * lm->data_disks * (unsigned long long)chunk_size;
+	printf("%s,%d,%d,%d,%d,%s,%llu,%.6f,%.3f\n",
+	       level != 6 ? "xor" : opname[op],
+	       level, layout, raid_disks, chunk_size,
+	       level == 6 ? raid6_name() : xor_blocks_name(),
+	       bytes, t, bytes / t / 1e9);
+	free(stripes);
+	return 0;
+}
+
+static int bench(int msec, int level, int disks, int chunk_size)
+{
+	/* 0 for any of level, disks or chunk_size means "try them all" */
+	static const int disk_list[] = { 4, 6, 8, 12, 16, 0 };
+	static const int chunk_list[] = { 4096, 16384, 65536, 262144,
+					  1048576, 0 };
+	size_t maxchunk = chunk_size ? chunk_size : 1048576;
+	size_t size = (disks ? disks : 16) * maxchunk;
+	char *buf, *save;
+	size_t i;
+	int lv, d, c, l;
+	int op;
+	int rv = 0;
+
+	/* always room for at least one stripe */
+	if (size < BENCH_BYTES)
+		size = BENCH_BYTES;
+	if (posix_memalign((void**)&buf, 4096, size) ||
+	    posix_memalign((void**)&save, 4096, 2 * maxchunk))
+		return -1;
+	for (i = 0; i < size; i++)
+		buf[i] = random();
+
+	printf("op,level,layout,disks,chunk,impl,bytes,seconds,GB/s\n");
+	for (lv = 4; lv <= 6; lv++) {
+		if (level && level != lv)
+			continue;
+		for (d = 0; disk_list[d]; d++) {
+			int nd = disks ? disks : disk_list[d];
+			if (disks && d)
+				break;
+			for (c = 0; chunk_list[c]; c++) {
+				int cs = chunk_size ? chunk_size : chunk_list[c];
+				if (chunk_size && c)
+					break;
+				for (l = 0; level_layouts(lv)[l] >= 0; l++)
+					for (op = BENCH_GEN;
+					     op <= (lv == 6 ? BENCH_DATAP : BENCH_GEN);
+					     op++)
+						if (bench_run(op, lv,
+							      level_layouts(lv)[l],
+							      nd, cs, msec / 1000.0,
+							      buf, save))
+							rv = -1;
+			}
+		}
+	}
+	free(buf);
+	free(save);
+	return rv;
+}
+
 unsigned long long getnum(char *str, char **err)
 {
 	char *e;
@@ -734,9 +2216,93 @@ main(int argc, char *argv[])
 	int i;
 
 	char *err = NULL;
+	if (argc == 2 && strcmp(argv[1], "selftest") == 0) {
+		int rv = xor_selftest(1);
+		rv |= raid6_selftest(1);
+		rv |= layout_selftest(1);
+		rv |= crc32c_selftest(1);
+		printf("xor using %s, raid6 using %s, crc32c using %s\n",
+		       xor_blocks_name(), raid6_name(), crc32c_name());
+		exit(rv ? 1 : 0);
+	}
+	if (argc >= 2 && argc <= 6 && strcmp(argv[1], "bench") == 0) {
+		/* bench [msec [level [raid_disks [chunk_size]]]] */
+		int msec = argc > 2 ? getnum(argv[2], &err) : 100;
+		level = argc > 3 ? getnum(argv[3], &err) : 0;
+		raid_disks = argc > 4 ? getnum(argv[4], &err) : 0;
+		chunk_size = argc > 5 ? getnum(argv[5], &err) : 0;
+		if (err) {
+			fprintf(stderr, "test_stripe: Bad number: %s\n", err);
+			exit(2);
+		}
+		if ((level && (level < 4 || level > 6)) ||
+		    (raid_disks && raid_disks < (level == 4 || level == 5 ? 3 : 4)) ||
+		    chunk_size % 512) {
+			fprintf(stderr, "test_stripe: cannot bench that geometry\n");
+			exit(2);
+		}
+		exit(bench(msec, level, raid_disks, chunk_size) ? 1 : 0);
+	}
+	if (argc >= 10 && strcmp(argv[1], "extend") == 0) {
+		/* extend checkpoint limit old_disks new_disks chunk_size
+		 *        level layout length old-devices... new-devices...
+		 * Give the same device in both lists to grow in place.
+		 */
+		int old_disks = getnum(argv[4], &err);
+		int new_disks = getnum(argv[5], &err);
+		unsigned long long limit = getnum(argv[3], &err);
+		int ckfd = -1;
+		int rv;
+
+		chunk_size = getnum(argv[6], &err);
+		level = getnum(argv[7], &err);
+		layout = getnum(argv[8], &err);
+		length = getnum(argv[9], &err);
+		if (err) {
+			fprintf(stderr, "test_stripe: Bad number: %s\n", err);
+			exit(2);
+		}
+		if (argc != 10 + old_disks + new_disks) {
+			fprintf(stderr, "test_stripe: wrong number of devices: want %d found %d\n",
+				old_disks + new_disks, argc-10);
+			exit(2);
+		}
+		if (strcmp(argv[2], "-") != 0) {
+			ckfd = open(argv[2], O_RDWR|O_CREAT, 0600);
+			if (ckfd < 0) {
+				perror(argv[2]);
+				exit(3);
+			}
+		}
+		fds = malloc((old_disks + new_disks) * sizeof(*fds));
+		offsets = malloc((old_disks + new_disks) * sizeof(*offsets));
+		memset(offsets, 0, (old_disks + new_disks) * sizeof(*offsets));
+		for (i = 0; i < old_disks + new_disks; i++) {
+			fds[i] = open(argv[10+i], i < old_disks ? O_RDONLY
+				      : O_RDWR|O_CREAT, 0600);
+			if (fds[i] < 0) {
+				perror(argv[10+i]);
+				exit(3);
+			}
+		}
+		rv = raid5_extend(level, layout, chunk_size,
+				  old_disks, fds, offsets,
+				  new_disks, fds + old_disks, offsets + old_disks,
+				  length, ckfd, limit);
+		if (rv < 0) {
+			fprintf(stderr,
+				"test_stripe: raid5_extend returned %d\n", rv);
+			exit(1);
+		}
+		exit(rv ? 4 : 0);
+	}
 	if (argc < 10) {
-		fprintf(stderr, "Usage: test_stripe save/restore file raid_disks"
-			" chunk_size level layout start length devices...\n");
+		fprintf(stderr, "Usage: test_stripe save/restore/test/check file raid_disks"
+			" chunk_size level layout start length devices...\n"
+			"       test_stripe selftest\n"
+			"       test_stripe bench [msec [level [raid_disks [chunk_size]]]]\n"
+			"       test_stripe extend checkpoint limit old_disks new_disks"
+			" chunk_size level layout length devices...\n");
 		exit(1);
 	}
 	if (strcmp(argv[1], "save")==0)
@@ -745,6 +2311,8 @@ main(int argc, char *argv[])
 		save = 0;
 	else if (strcmp(argv[1], "test") == 0)
 		save = 2;
+	else if (strcmp(argv[1], "check") == 0)
+		save = 3;
 	else {
 		fprintf(stderr, "test_stripe: must give 'save' or 'restore'.\n");
 		exit(2);
@@ -766,6 +2334,11 @@ main(int argc, char *argv[])
 			raid_disks, argc-9);
 		exit(2);
 	}
+	if (!layout_supported(level, layout, raid_disks)) {
+		fprintf(stderr, "test_stripe: unsupported layout %d for "
+			"level %d\n", layout, level);
+		exit(2);
+	}
 	fds = malloc(raid_disks * sizeof(*fds));
 	offsets = malloc(raid_disks * sizeof(*offsets));
 	memset(offsets, 0, raid_disks * sizeof(*offsets));
@@ -791,12 +2364,30 @@ main(int argc, char *argv[])
 		int rv = save_stripes(fds, offsets,
 				      raid_disks, chunk_size, level, layout,
 				      1, &storefd,
-				      start, length, buf);
+				      start, length, buf, NULL);
 		if (rv != 0) {
 			fprintf(stderr,
 				"test_stripe: save_stripes returned %d\n", rv);
 			exit(1);
 		}
+	} else if (save == 3) {
+		struct stripe_mismatch *found;
+		int rv = check_stripes(fds, offsets,
+				       raid_disks, chunk_size, level, layout,
+				       start, length, raid_disks, &found);
+		if (rv < 0) {
+			fprintf(stderr,
+				"test_stripe: check_stripes returned %d\n", rv);
+			exit(1);
+		}
+		for (i = 0; i < rv; i++)
+			printf("mismatch at %llu: %s%s disk %d\n",
+			       found[i].stripe,
+			       (found[i].parity & 1) ? "P" : "",
+			       (found[i].parity & 2) ? "Q" : "",
+			       found[i].disk);
+		free(found);
+		exit(rv ? 4 : 0);
 	} else if (save == 2) {
 		int rv = test_stripes(fds, offsets,
 				      raid_disks, chunk_size, level, layout,
@@ -0,0 +1,319 @@
+/*
+ * mdadm - manage Linux "md" devices aka RAID arrays.
+ *
+ * Copyright (C) 2010 Neil Brown <neilb@suse.de>
+ *
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *    Author: Neil Brown
+ *    Email: <neilb@suse.de>
+ */
+
+/*
+ * Keep resync, recovery and reshape out of the way of applications.
+ *
+ * While an array is syncing we sample /sys/block/.../stat for the
+ * array and for each member.  If nothing but the sync is using the
+ * array, the sync may go as fast as sync_speed_max allows.  Once
+ * applications are using it we look at the busiest member: if
+ * requests there are queueing and taking longer than the target, the
+ * sync rate is halved, and while they are comfortably inside the
+ * target it is raised again a step at a time.  The rate is applied
+ * through sync_speed_min and sync_speed_max so md holds to it, and the
+ * original settings are put back when we stop - Monitor catches SIGTERM
+ * and SIGINT for this.  In case we are killed anyway, MAP_DIR/mdX.speed
+ * records the original settings and the rate we last set.  If the next
+ * run finds the speeds still at that rate they are ours, and the
+ * originals are put back; if anything else has changed them since, they
+ * are left alone.
+ *
+ * The stat files only give totals, so "latency" is the mean time per
+ * request completed on a member over a sample interval.  Taking the
+ * worst member follows the tail well enough when one device is the
+ * bottleneck, which is the case that matters.
+ */
+
+#include "mdadm.h"
+
+/* shortest time between samples, in microseconds */
+#define THROTTLE_INTERVAL 500000ULL
+
+struct throttle_dev {
+	char path[50];
+	unsigned long long ios, ticks, queue;
+};
+
+struct throttle {
+	struct mdinfo *sra;
+	char path[50];			/* stat file for the array */
+	unsigned long long md_ios;
+	struct throttle_dev *devs;
+	int ndevs;
+	unsigned long long target;	/* usec per request */
+	unsigned long floor, ceiling;	/* KB/sec */
+	unsigned long rate;
+	char old_min[20], old_max[20];
+	char mark[80];			/* MAP_DIR/mdX.speed */
+	unsigned long long last;	/* time of last sample, usec */
+};
+
+static int read_stat(char *path, unsigned long long *ios,
+		     unsigned long long *ticks, unsigned long long *queue)
+{
+	/* reads, merges, sectors, ticks, writes, merges, sectors, ticks,
+	 * in_flight, io_ticks, time_in_queue
+	 */
+	unsigned long long f[11];
+	char buf[256];
+	int fd, n;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	n = read(fd, buf, sizeof(buf)-1);
+	close(fd);
+	if (n <= 0)
+		return -1;
+	buf[n] = 0;
+	if (sscanf(buf, "%llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu",
+		   &f[0], &f[1], &f[2], &f[3], &f[4], &f[5], &f[6], &f[7],
+		   &f[8], &f[9], &f[10]) != 11)
+		return -1;
+	*ios = f[0] + f[4];
+	if (ticks)
+		*ticks = f[3] + f[7];
+	if (queue)
+		*queue = f[10];
+	return 0;
+}
+
+static void save_speed(struct mdinfo *sra, char *name, char *buf)
+{
+	/* "200000 (system)" is restored as "system" */
+	char val[40];
+
+	if (sysfs_get_str(sra, NULL, name, val, sizeof(val)) <= 0 ||
+	    strstr(val, "system"))
+		strcpy(buf, "system");
+	else {
+		strncpy(buf, val, 19);
+		buf[19] = 0;
+		buf[strcspn(buf, " \n")] = 0;
+	}
+}
+
+static void mark_speed(struct throttle *t, unsigned long rate)
+{
+	/* Note the original settings and the rate about to be set */
+	FILE *f;
+
+	(void)mkdir(MAP_DIR, 0755);
+	f = fopen(t->mark, "w");
+	if (!f)
+		return;
+	fprintf(f, "%s %s %lu\n", t->old_min, t->old_max, rate);
+	fclose(f);
+}
+
+static void recall_speed(struct throttle *t, char *sys_name)
+{
+	/* If a run that was killed left the speeds at its last rate,
+	 * what it found there is what we should put back.
+	 */
+	FILE *f = fopen(t->mark, "r");
+	char omin[20], omax[20];
+	unsigned long rate;
+	int n;
+
+	if (!f)
+		return;
+	n = fscanf(f, "%19s %19s %lu", omin, omax, &rate);
+	fclose(f);
+	if (n != 3 ||
+	    strcmp(t->old_min, "system") == 0 ||
+	    strcmp(t->old_max, "system") == 0 ||
+	    strtoul(t->old_min, NULL, 10) != rate ||
+	    strtoul(t->old_max, NULL, 10) != rate)
+		/* changed since, so not ours any more */
+		return;
+	fprintf(stderr, Name ": %s: sync speed %luK/sec was left by an "
+		"earlier run, restoring min %s and max %s\n",
+		sys_name, rate, omin, omax);
+	strcpy(t->old_min, omin);
+	strcpy(t->old_max, omax);
+	sysfs_set_str(t->sra, NULL, "sync_speed_min", omin);
+	sysfs_set_str(t->sra, NULL, "sync_speed_max", omax);
+}
+
+static void set_rate(struct throttle *t, unsigned long rate)
+{
+	if (rate == t->rate)
+		return;
+	mark_speed(t, rate);
+	/* never let min get above max on the way */
+	if (rate < t->rate) {
+		sysfs_set_num(t->sra, NULL, "sync_speed_min", rate);
+		sysfs_set_num(t->sra, NULL, "sync_speed_max", rate);
+	} else {
+		sysfs_set_num(t->sra, NULL, "sync_speed_max", rate);
+		sysfs_set_num(t->sra, NULL, "sync_speed_min", rate);
+	}
+	t->rate = rate;
+}
+
+struct throttle *throttle_start(char *sys_name, unsigned long target_ms)
+{
+	/* Start controlling the sync speed of the array 'sys_name'
+	 * (e.g. "md0") to keep member latency under 'target_ms'.
+	 */
+	struct throttle *t;
+	struct mdinfo *sd;
+	unsigned long long v;
+	int n;
+
+	if (target_ms == 0)
+		return NULL;
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		return NULL;
+	t->sra = sysfs_read(-1, devname2devnum(sys_name), GET_DEVS);
+	if (!t->sra) {
+		free(t);
+		return NULL;
+	}
+	t->target = target_ms * 1000ULL;
+	snprintf(t->path, sizeof(t->path), "/sys/block/%s/stat", sys_name);
+	read_stat(t->path, &t->md_ios, NULL, NULL);
+
+	for (n = 0, sd = t->sra->devs; sd; sd = sd->next)
+		n++;
+	t->devs = calloc(n ? n : 1, sizeof(t->devs[0]));
+	if (!t->devs) {
+		sysfs_free(t->sra);
+		free(t);
+		return NULL;
+	}
+	for (sd = t->sra->devs; sd; sd = sd->next) {
+		struct throttle_dev *d = &t->devs[t->ndevs];
+		snprintf(d->path, sizeof(d->path), "/sys/dev/block/%d:%d/stat",
+			 sd->disk.major, sd->disk.minor);
+		if (read_stat(d->path, &d->ios, &d->ticks, &d->queue) == 0)
+			t->ndevs++;
+	}
+
+	snprintf(t->mark, sizeof(t->mark), "%s/%s.speed", MAP_DIR, sys_name);
+	save_speed(t->sra, "sync_speed_min", t->old_min);
+	save_speed(t->sra, "sync_speed_max", t->old_max);
+	recall_speed(t, sys_name);
+	t->floor = 1000;
+	t->ceiling = 200000;
+	if (sysfs_get_ll(t->sra, NULL, "sync_speed_min", &v) == 0 && v > 0)
+		t->floor = v;
+	if (sysfs_get_ll(t->sra, NULL, "sync_speed_max", &v) == 0 && v > 0)
+		t->ceiling = v;
+	if (t->floor > t->ceiling)
+		t->floor = t->ceiling;
+	/* Nothing is known yet, so start as though idle */
+	t->rate = t->floor;
+	set_rate(t, t->ceiling);
+	t->last = now_usec();
+	return t;
+}
+
+unsigned long throttle_poll(struct throttle *t)
+{
+	/* Take a sample if it is time, adjust the rate, and return it */
+	unsigned long long now, md_ios, worst = 0, depth = 0;
+	unsigned long rate;
+	int i;
+
+	if (!t)
+		return 0;
+	now = now_usec();
+	if (now - t->last < THROTTLE_INTERVAL)
+		return t->rate;
+
+	for (i = 0; i < t->ndevs; i++) {
+		struct throttle_dev *d = &t->devs[i];
+		unsigned long long ios, ticks, queue;
+
+		if (read_stat(d->path, &ios, &ticks, &queue) != 0)
+			continue;
+		if (ios > d->ios) {
+			/* ticks are in msec */
+			unsigned long long lat = (ticks - d->ticks) * 1000 /
+				(ios - d->ios);
+			if (lat > worst)
+				worst = lat;
+		}
+		/* average queue depth over the interval, times 1000 */
+		if ((queue - d->queue) * 1000000 / (now - t->last) > depth)
+			depth = (queue - d->queue) * 1000000 / (now - t->last);
+		d->ios = ios;
+		d->ticks = ticks;
+		d->queue = queue;
+	}
+	if (read_stat(t->path, &md_ios, NULL, NULL) != 0)
+		md_ios = t->md_ios;
+
+	rate = t->rate;
+	if (md_ios == t->md_ios)
+		/* nobody else is using the array */
+		rate = t->ceiling;
+	else if (worst > t->target && depth >= 1000) {
+		/* requests are queueing and slow - back off */
+		rate /= 2;
+		if (rate < t->floor)
+			rate = t->floor;
+	} else if (worst < t->target * 3 / 4) {
+		rate += t->ceiling / 16;
+		if (rate > t->ceiling)
+			rate = t->ceiling;
+	}
+	set_rate(t, rate);
+	t->md_ios = md_ios;
+	t->last = now;
+	return t->rate;
+}
+
+void throttle_stop(struct throttle *t)
+{
+	if (!t)
+		return;
+	sysfs_set_str(t->sra, NULL, "sync_speed_min", t->old_min);
+	sysfs_set_str(t->sra, NULL, "sync_speed_max", t->old_max);
+	unlink(t->mark);
+	sysfs_free(t->sra);
+	free(t->devs);
+	free(t);
+}
+
+unsigned long throttle_target(unsigned long dflt)
+{
+	/* MDADM_SYNC_LATENCY, in milliseconds, or 'dflt' if it is not
+	 * set.  0 means leave the sync speed alone.
+	 */
+	char *env = getenv("MDADM_SYNC_LATENCY");
+	char *ep;
+	unsigned long ms;
+
+	if (!env || !*env)
+		return dflt;
+	ms = strtoul(env, &ep, 10);
+	if (*ep)
+		return dflt;
+	return ms;
+}
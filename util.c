@@ -1785,6 +1785,38 @@ __u32 random32(void)
 	return rv;
 }
 
+unsigned long long now_usec(void)
+{
+	/* For timing intervals, so not affected by the clock being set */
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+int write_file_atomic(char *path, void (*fill)(FILE *f, void *arg), void *arg)
+{
+	/* Have 'fill' write to path.new, then rename that over 'path'
+	 * so a reader never sees half of it.
+	 */
+	char tmp[PATH_MAX];
+	FILE *f;
+	int err;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.new", path) >= (int)sizeof(tmp))
+		return -1;
+	f = fopen(tmp, "w");
+	if (!f)
+		return -1;
+	fill(f, arg);
+	err = ferror(f);
+	if (fclose(f) != 0 || err || rename(tmp, path) != 0) {
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
 #ifndef MDASSEMBLE
 int flush_metadata_updates(struct supertype *st)
 {